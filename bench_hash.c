@@ -0,0 +1,264 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * bench_hash: throughput and bucket distribution of the key hash functions
+ * over key shapes seen by memlockd.
+ *
+ * usage: bench_hash [num_keys]
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "hash.h"
+
+#define MAX_KEY_LEN 256
+#define REPEAT 20
+
+struct hash_func {
+    const char *name;
+    unsigned int (*fn)(const void *key, int len, unsigned int seed);
+};
+
+static struct hash_func funcs[] = {
+    {"murmur2", em_hash_murmur2},
+    {"wyhash",  em_hash_wyhash},
+};
+
+struct key_set {
+    const char *name;
+    char  *keys;  /* packed back to back, so the loop isn't memory bound */
+    int   *offs;
+    int   *lens;
+};
+
+static uint64_t now_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static void gen_keys(struct key_set *ks, int shape, int num)
+{
+    int i = 0, j = 0, n = 0, off = 0;
+    char *k = NULL;
+
+    ks->keys = (char *)malloc((size_t)num * MAX_KEY_LEN);
+    ks->offs = (int *)malloc(num * sizeof(int));
+    ks->lens = (int *)malloc(num * sizeof(int));
+    if (ks->keys == NULL || ks->offs == NULL || ks->lens == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num; i++) {
+        k = ks->keys + off;
+        switch (shape) {
+            case 0:
+                ks->name = "seq";
+                n = snprintf(k, MAX_KEY_LEN, "lock:%d", i);
+                break;
+            case 1:
+                ks->name = "user";
+                n = snprintf(k, MAX_KEY_LEN, "user:%08x:session", (unsigned int)i * 2654435761u);
+                break;
+            case 2:
+                ks->name = "uuid";
+                n = snprintf(k, MAX_KEY_LEN, "%08x-%04x-4%03x-a%03x-%012llx",
+                        rand(), rand() & 0xffff, rand() & 0xfff, rand() & 0xfff,
+                        ((unsigned long long)rand() << 16) ^ i);
+                break;
+            case 3:
+                ks->name = "uri";
+                n = snprintf(k, MAX_KEY_LEN,
+                        "https://svc.example.com/v1/tenants/%d/resources/%d",
+                        i % 97, i);
+                break;
+            default:
+                ks->name = "long";
+                n = snprintf(k, MAX_KEY_LEN, "/jobs/%d/", i);
+                for (j = n; j < 200; j++) {
+                    k[j] = 'a' + (j % 26);
+                }
+                n = 200;
+                break;
+        }
+        ks->offs[i] = off;
+        ks->lens[i] = n;
+        off += n;
+    }
+
+    return;
+}
+
+static double bench_speed(struct hash_func *hf, struct key_set *ks, int num)
+{
+    int i = 0, r = 0;
+    unsigned int sink = 0;
+    uint64_t start = 0, best = (uint64_t)-1, t = 0;
+
+    for (r = 0; r < REPEAT; r++) {
+        start = now_ticks();
+        for (i = 0; i < num; i++) {
+            sink ^= hf->fn(ks->keys + ks->offs[i], ks->lens[i], 0x9e3779b9);
+        }
+        t = now_ticks() - start;
+        if (t < best) {
+            best = t;
+        }
+    }
+
+    if (sink == 0x12345678) {
+        printf(" ");
+    }
+
+    return (double)best / num;
+}
+
+/*
+ * chi-square of the bucket counts divided by the number of buckets:
+ * about 1.0 for a uniform hash, much higher when keys pile up.
+ */
+static double bench_buckets(struct hash_func *hf, struct key_set *ks, int num,
+        unsigned int nbuckets, int pow2, unsigned int *maxchain)
+{
+    int i = 0;
+    unsigned int h = 0, b = 0;
+    unsigned int *counts = NULL;
+    double expect = (double)num / nbuckets, chi = 0.0, d = 0.0;
+
+    counts = (unsigned int *)calloc(nbuckets, sizeof(unsigned int));
+    if (counts == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num; i++) {
+        h = hf->fn(ks->keys + ks->offs[i], ks->lens[i], 0x9e3779b9);
+        b = pow2 ? (h & (nbuckets - 1)) : (h % nbuckets);
+        counts[b]++;
+    }
+
+    *maxchain = 0;
+    for (b = 0; b < nbuckets; b++) {
+        d = counts[b] - expect;
+        chi += d * d / expect;
+        if (counts[b] > *maxchain) {
+            *maxchain = counts[b];
+        }
+    }
+
+    free(counts);
+
+    return chi / nbuckets;
+}
+
+/* worst deviation from 0.5 of any output bit flipping on a 1 bit input change */
+static double bench_avalanche(struct hash_func *hf, struct key_set *ks, int num)
+{
+    int i = 0, bit = 0, ob = 0, len = 0, samples = 0;
+    unsigned int h0 = 0, h1 = 0;
+    char k[MAX_KEY_LEN];
+    double flips[32] = {0}, worst = 0.0, p = 0.0;
+
+    if (num > 256) {
+        num = 256;
+    }
+
+    for (i = 0; i < num; i++) {
+        len = ks->lens[i];
+        memcpy(k, ks->keys + ks->offs[i], len);
+        h0 = hf->fn(k, len, 0x9e3779b9);
+        for (bit = 0; bit < len * 8; bit++) {
+            k[bit / 8] ^= (char)(1 << (bit % 8));
+            h1 = hf->fn(k, len, 0x9e3779b9) ^ h0;
+            k[bit / 8] ^= (char)(1 << (bit % 8));
+            for (ob = 0; ob < 32; ob++) {
+                flips[ob] += (h1 >> ob) & 1;
+            }
+            samples++;
+        }
+    }
+
+    for (ob = 0; ob < 32; ob++) {
+        p = flips[ob] / samples - 0.5;
+        if (p < 0) {
+            p = -p;
+        }
+        if (p > worst) {
+            worst = p;
+        }
+    }
+
+    return worst;
+}
+
+int main(int argc, char *argv[])
+{
+    int num = 1 << 18;
+    int shape = 0;
+    unsigned int f = 0, nb = 1;
+    unsigned int chain2 = 0, chainp = 0;
+    double cpk = 0.0, chi2 = 0.0, chip = 0.0, aval = 0.0;
+    struct key_set ks;
+
+    if (argc > 1) {
+        num = atoi(argv[1]);
+        if (num <= 0) {
+            fprintf(stderr, "usage: %s [num_keys]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    srand(1);
+
+    /* power of two buckets, about four keys each */
+    while (nb * 2 <= (unsigned int)num / 4) {
+        nb *= 2;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    printf("%d keys per shape, best of %d runs, cycles per key (rdtsc)\n", num, REPEAT);
+#else
+    printf("%d keys per shape, best of %d runs, ns per key\n", num, REPEAT);
+#endif
+    printf("chi2: chi-square / buckets over %u buckets (1.00 is ideal), "
+           "max: longest chain, aval: worst output bit bias\n\n", nb);
+    printf("%-6s %-8s %8s %10s %6s %10s %6s %7s\n",
+            "shape", "hash", "cyc/key", "chi2 pow2", "max", "chi2 prime", "max", "aval");
+
+    for (shape = 0; shape < 5; shape++) {
+        gen_keys(&ks, shape, num);
+        for (f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++) {
+            cpk = bench_speed(&funcs[f], &ks, num);
+            chi2 = bench_buckets(&funcs[f], &ks, num, nb, 1, &chain2);
+            chip = bench_buckets(&funcs[f], &ks, num, 65521, 0, &chainp);
+            aval = bench_avalanche(&funcs[f], &ks, num);
+            printf("%-6s %-8s %8.2f %10.3f %6u %10.3f %6u %7.4f\n",
+                    ks.name, funcs[f].name, cpk, chi2, chain2, chip, chainp, aval);
+        }
+        free(ks.keys);
+        free(ks.offs);
+        free(ks.lens);
+    }
+
+    return 0;
+}
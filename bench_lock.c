@@ -0,0 +1,546 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * bench_lock: lock + unlock latency through libmemlock in process, through
+ * the shared memory table of a memlockd -X, and through a memlockd on the
+ * loopback for comparison.
+ *
+ * usage: bench_lock [-n ops] [-t threads] [-w write%] [-p port] [-X file] [-s socket]
+ *
+ * in process: one thread on its own keys, then threads on keys of their
+ * own (engine mutex contention only), then threads taking turns on one
+ * write lock (every lock a handoff), then threads on one key mostly
+ * reading under each fairness policy, timing the wait for reads and for
+ * writes apart. the same three for the shared memory
+ * table with -X, each thread attached on its own. with -s the unix socket
+ * of a memlockd -s, and the shared memory rings set up on it, one
+ * command at a time and in batches. the loopback run is skipped if no
+ * memlockd listens on port.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "memlock.h"
+
+#define KEY_LEN 32
+#define NKEYS 1024
+#define HOLD_NS 2000   /* time a mixed run holds each lock */
+
+struct run {
+    int    id;
+    int    ops;
+    int    shared;   /* all threads on one key */
+    const char *shm; /* shared memory table, NULL for in process */
+    double *lat;     /* ns per lock + unlock */
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, double *lat, int num)
+{
+    int i = 0;
+    double sum = 0.0;
+
+    qsort(lat, num, sizeof(double), cmp_double);
+
+    for (i = 0; i < num; i++) {
+        sum += lat[i];
+    }
+
+    printf("%-24s %10.0f %10.0f %10.0f %10.0f\n", name, sum / num,
+            lat[num / 2], lat[(int)(num * 0.99)], lat[num - 1]);
+
+    return;
+}
+
+static void *shm_thread(void *arg)
+{
+    int i = 0, n = 0;
+    char key[KEY_LEN];
+    double t0 = 0.0;
+    struct run *r = (struct run *)arg;
+    struct shmlock *h = NULL;
+
+    h = shmlock_attach(r->shm);
+    if (h == NULL) {
+        fprintf(stderr, "shmlock_attach(%s): %s\n", r->shm, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < r->ops; i++) {
+        if (r->shared) {
+            n = snprintf(key, sizeof(key), "bench/shared");
+        }
+        else {
+            n = snprintf(key, sizeof(key), "bench/%d/%d", r->id, i % NKEYS);
+        }
+
+        t0 = now_ns();
+        if (shmlock_lock(h, key, n, MEMLOCK_WRITE) != 0 || shmlock_unlock(h, key, n) != 0) {
+            fprintf(stderr, "shmlock_lock(): %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        r->lat[i] = now_ns() - t0;
+    }
+
+    shmlock_detach(h);
+
+    return NULL;
+}
+
+static void *inproc_thread(void *arg)
+{
+    int i = 0, n = 0;
+    char key[KEY_LEN];
+    double t0 = 0.0;
+    struct run *r = (struct run *)arg;
+    struct memlock *l = NULL;
+
+    l = memlock_new();
+    if (l == NULL) {
+        fprintf(stderr, "memlock_new(): failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < r->ops; i++) {
+        if (r->shared) {
+            n = snprintf(key, sizeof(key), "bench/shared");
+        }
+        else {
+            n = snprintf(key, sizeof(key), "bench/%d/%d", r->id, i % NKEYS);
+        }
+
+        t0 = now_ns();
+        if (memlock_lock(l, key, n, MEMLOCK_WRITE) != 0 || memlock_unlock(l) != 0) {
+            fprintf(stderr, "memlock_lock(): failed\n");
+            exit(EXIT_FAILURE);
+        }
+        r->lat[i] = now_ns() - t0;
+    }
+
+    memlock_free(l);
+
+    return NULL;
+}
+
+static void inproc(const char *name, int threads, int ops, int shared, const char *shm)
+{
+    int i = 0;
+    double *lat = NULL;
+    pthread_t *tids = NULL;
+    struct run *runs = NULL;
+
+    lat = (double *)malloc((size_t)threads * ops * sizeof(double));
+    tids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    runs = (struct run *)calloc(threads, sizeof(struct run));
+    if (!lat || !tids || !runs) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < threads; i++) {
+        runs[i].id = i;
+        runs[i].ops = ops;
+        runs[i].shared = shared;
+        runs[i].shm = shm;
+        runs[i].lat = lat + (size_t)i * ops;
+        pthread_create(&tids[i], NULL, shm ? shm_thread : inproc_thread, &runs[i]);
+    }
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    report(name, lat, threads * ops);
+
+    free(lat);
+    free(tids);
+    free(runs);
+
+    return;
+}
+
+struct mixed {
+    int    id;
+    int    ops;
+    int    wpct;     /* percent of writes */
+    const char *key;
+    double *rlat;    /* ns waited per read */
+    int    nr;
+    double *wlat;    /* ns waited per write */
+    int    nw;
+};
+
+static void *mixed_thread(void *arg)
+{
+    int i = 0, write = 0;
+    unsigned int seed = 0;
+    double t0 = 0.0, t1 = 0.0;
+    struct mixed *m = (struct mixed *)arg;
+    struct memlock *l = NULL;
+
+    l = memlock_new();
+    if (l == NULL) {
+        fprintf(stderr, "memlock_new(): failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    seed = m->id + 1;
+
+    for (i = 0; i < m->ops; i++) {
+        write = (int)(rand_r(&seed) % 100) < m->wpct;
+
+        t0 = now_ns();
+        if (memlock_lock(l, m->key, strlen(m->key), write ? MEMLOCK_WRITE : MEMLOCK_READ) != 0) {
+            fprintf(stderr, "memlock_lock(): failed\n");
+            exit(EXIT_FAILURE);
+        }
+        t1 = now_ns();
+
+        if (write) {
+            m->wlat[m->nw++] = t1 - t0;
+        }
+        else {
+            m->rlat[m->nr++] = t1 - t0;
+        }
+
+        while (now_ns() - t1 < HOLD_NS) {
+            /* the critical section */
+        }
+
+        memlock_unlock(l);
+    }
+
+    memlock_free(l);
+
+    return NULL;
+}
+
+/* threads mostly reading one key under policy, waits for reads and writes */
+static void mixed(const char *name, int policy, int threads, int ops, int wpct)
+{
+    int i = 0, nr = 0, nw = 0;
+    char key[KEY_LEN], row[64];
+    double *rlat = NULL, *wlat = NULL;
+    pthread_t *tids = NULL;
+    struct mixed *runs = NULL;
+
+    snprintf(key, sizeof(key), "fair/%s", name);
+    if (memlock_fairness(key, strlen(key), policy) != 0) {
+        fprintf(stderr, "memlock_fairness(%s): failed\n", key);
+        exit(EXIT_FAILURE);
+    }
+
+    rlat = (double *)malloc((size_t)threads * ops * sizeof(double));
+    wlat = (double *)malloc((size_t)threads * ops * sizeof(double));
+    tids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    runs = (struct mixed *)calloc(threads, sizeof(struct mixed));
+    if (!rlat || !wlat || !tids || !runs) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < threads; i++) {
+        runs[i].id = i;
+        runs[i].ops = ops;
+        runs[i].wpct = wpct;
+        runs[i].key = key;
+        runs[i].rlat = rlat + (size_t)i * ops;
+        runs[i].wlat = wlat + (size_t)i * ops;
+        pthread_create(&tids[i], NULL, mixed_thread, &runs[i]);
+    }
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    /* gather the samples at the front */
+    for (i = 0; i < threads; i++) {
+        memmove(rlat + nr, runs[i].rlat, runs[i].nr * sizeof(double));
+        nr += runs[i].nr;
+        memmove(wlat + nw, runs[i].wlat, runs[i].nw * sizeof(double));
+        nw += runs[i].nw;
+    }
+
+    if (nr > 0) {
+        snprintf(row, sizeof(row), "%s, read waits", name);
+        report(row, rlat, nr);
+    }
+    if (nw > 0) {
+        snprintf(row, sizeof(row), "%s, write waits", name);
+        report(row, wlat, nw);
+    }
+
+    free(rlat);
+    free(wlat);
+    free(tids);
+    free(runs);
+
+    return;
+}
+
+/* one request, one reply line */
+static int roundtrip(int fd, const char *req, int len, char *buf, int size)
+{
+    int n = 0, got = 0;
+
+    if (write(fd, req, len) != len) {
+        return -1;
+    }
+
+    while (got < 2 || buf[got - 1] != '\n') {
+        n = read(fd, buf + got, size - got);
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+
+    return buf[0] == '+' ? 0 : -1;
+}
+
+static void sockbench(const char *name, int fd, int ops)
+{
+    int i = 0, n = 0;
+    char req[64], buf[256];
+    double t0 = 0.0, *lat = NULL;
+
+    lat = (double *)malloc(ops * sizeof(double));
+    if (lat == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < ops; i++) {
+        n = snprintf(req, sizeof(req), "lock bench/0/%d w\r\n", i % NKEYS);
+
+        t0 = now_ns();
+        if (roundtrip(fd, req, n, buf, sizeof(buf)) != 0
+                || roundtrip(fd, "unlock\r\n", 8, buf, sizeof(buf)) != 0) {
+            fprintf(stderr, "%s: request failed\n", name);
+            exit(EXIT_FAILURE);
+        }
+        lat[i] = now_ns() - t0;
+    }
+
+    report(name, lat, ops);
+
+    free(lat);
+
+    return;
+}
+
+static void loopback(int port, int ops)
+{
+    int fd = -1, one = 1;
+    struct sockaddr_in sin;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+        printf("%-24s no memlockd on port %d, skipped\n", "loopback", port);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockbench("loopback", fd, ops);
+
+    close(fd);
+
+    return;
+}
+
+/*
+ * the same round trips on the unix socket at path and over the rings
+ * set up on it, then the rings with batch commands queued at a time.
+ */
+static void unixsock(const char *path, int ops, int batch)
+{
+    int i = 0, j = 0, n = 0, fd = -1;
+    char req[64], buf[256], name[64];
+    double t0 = 0.0, *lat = NULL;
+    struct sockaddr_un sun;
+    struct shmring *r = NULL;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        printf("%-24s no memlockd on %s, skipped\n", "unix socket", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    sockbench("unix socket", fd, ops);
+    close(fd);
+
+    r = shmring_connect(path);
+    lat = (double *)malloc(ops * sizeof(double));
+    if (r == NULL || lat == NULL) {
+        fprintf(stderr, "shmring_connect(%s): %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < ops; i++) {
+        n = snprintf(req, sizeof(req), "lock bench/0/%d w\r\n", i % NKEYS);
+
+        t0 = now_ns();
+        if (shmring_send(r, req, n) != 0 || shmring_recv(r, buf, sizeof(buf)) < 0
+                || shmring_send(r, "unlock\r\n", 8) != 0
+                || shmring_recv(r, buf, sizeof(buf)) < 0 || buf[0] != '+') {
+            fprintf(stderr, "ring: request failed\n");
+            exit(EXIT_FAILURE);
+        }
+        lat[i] = now_ns() - t0;
+    }
+
+    report("ring", lat, ops);
+
+    /* a sample per batch, of its time per lock + unlock */
+    for (i = 0; i < ops / batch; i++) {
+        t0 = now_ns();
+        for (j = 0; j < batch; j++) {
+            n = snprintf(req, sizeof(req), "lock bench/0/%d w\r\nunlock\r\n",
+                    (i * batch + j) % NKEYS);
+            if (shmring_send(r, req, n) != 0) {
+                fprintf(stderr, "ring: send failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (j = 0; j < 2 * batch; j++) {
+            if (shmring_recv(r, buf, sizeof(buf)) < 0 || buf[0] != '+') {
+                fprintf(stderr, "ring: request failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        lat[i] = (now_ns() - t0) / batch;
+    }
+
+    snprintf(name, sizeof(name), "ring, batches of %d", batch);
+    report(name, lat, ops / batch);
+
+    shmring_close(r);
+    free(lat);
+
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    int c = 0, ops = 200000, threads = 4, port = 9970, wpct = 5;
+    char name[64];
+    const char *shm = NULL, *path = NULL;
+
+    while ((c = getopt(argc, argv, "n:t:w:p:X:s:")) != -1) {
+        switch (c) {
+            case 'n':
+                ops = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'w':
+                wpct = atoi(optarg);
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'X':
+                shm = optarg;
+                break;
+            case 's':
+                path = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n ops] [-t threads] [-w write%%] [-p port] [-X file] [-s socket]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (ops <= 0 || threads <= 0 || wpct < 0 || wpct > 100 || memlock_init() != 0) {
+        fprintf(stderr, "usage: %s [-n ops] [-t threads] [-w write%%] [-p port] [-X file] [-s socket]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d lock + unlock per thread, ns\n\n", ops);
+    printf("%-24s %10s %10s %10s %10s\n", "", "mean", "p50", "p99", "max");
+
+    inproc("in process", 1, ops, 0, NULL);
+
+    snprintf(name, sizeof(name), "in process, %d threads", threads);
+    inproc(name, threads, ops, 0, NULL);
+
+    snprintf(name, sizeof(name), "one key, %d threads", threads);
+    inproc(name, threads, ops, 1, NULL);
+
+    /* fewer of these, each holds its lock for HOLD_NS */
+    printf("\none key, %d threads, %d%% writes, lock waits\n", threads, wpct);
+    mixed("reader", MEMLOCK_FAIR_READER, threads, ops / 10, wpct);
+    mixed("writer", MEMLOCK_FAIR_WRITER, threads, ops / 10, wpct);
+    mixed("phase", MEMLOCK_FAIR_PHASE, threads, ops / 10, wpct);
+    printf("\n");
+
+    if (shm != NULL) {
+        inproc("shm", 1, ops, 0, shm);
+
+        snprintf(name, sizeof(name), "shm, %d threads", threads);
+        inproc(name, threads, ops, 0, shm);
+
+        snprintf(name, sizeof(name), "shm one key, %d threads", threads);
+        inproc(name, threads, ops, 1, shm);
+    }
+
+    if (path != NULL) {
+        unixsock(path, ops, 64);
+    }
+
+    loopback(port, ops);
+
+    return 0;
+}
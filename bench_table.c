@@ -0,0 +1,201 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * bench_table: the generic hashtable.c against the itemtable specialized
+ * from locktable.h for struct item, on the same items and keys.
+ *
+ * usage: bench_table [num_keys]
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "hash.h"
+#include "hashtable.h"
+#include "item.h"
+
+#define KEY_LEN 32
+
+static unsigned int hashfromkey(void *k)
+{
+    return ((struct item_key *)k)->hv;
+}
+
+static int equalkeys(void *k1, void *k2)
+{
+    struct item_key *ik1 = (struct item_key *)k1;
+    struct item_key *ik2 = (struct item_key *)k2;
+
+    return (ik1->nkey == ik2->nkey
+            && memcmp(ik1->key, ik2->key, ik1->nkey) == 0);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void make_keys(struct item_key *keys, char *buf, int num, const char *fmt)
+{
+    int i = 0, n = 0;
+
+    for (i = 0; i < num; i++) {
+        n = snprintf(buf + i * KEY_LEN, KEY_LEN, fmt, i);
+        keys[i].key = buf + i * KEY_LEN;
+        keys[i].nkey = n;
+        keys[i].hv = em_hash(keys[i].key, n, hash_seed);
+    }
+
+    return;
+}
+
+static void shuffle(int *order, int num)
+{
+    int i = 0, j = 0, t = 0;
+
+    for (i = 0; i < num; i++) {
+        order[i] = i;
+    }
+
+    for (i = num - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    int i = 0, num = 1 << 20, found = 0;
+    int *order = NULL;
+    char *kbuf = NULL, *mbuf = NULL;
+    double t0 = 0.0, t[2][4];
+    struct item *items = NULL;
+    struct item_key *keys = NULL, *miss = NULL;
+    struct hashtable *h = NULL;
+    struct itemtable it;
+
+    if (argc > 1) {
+        num = atoi(argv[1]);
+        if (num <= 0) {
+            fprintf(stderr, "usage: %s [num_keys]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    srand(1);
+    hash_init();
+
+    items = (struct item *)calloc(num, sizeof(struct item));
+    keys = (struct item_key *)malloc(num * sizeof(struct item_key));
+    miss = (struct item_key *)malloc(num * sizeof(struct item_key));
+    kbuf = (char *)malloc((size_t)num * KEY_LEN);
+    mbuf = (char *)malloc((size_t)num * KEY_LEN);
+    order = (int *)malloc(num * sizeof(int));
+    if (!items || !keys || !miss || !kbuf || !mbuf || !order) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    make_keys(keys, kbuf, num, "job/%d/lock");
+    make_keys(miss, mbuf, num, "job/%d/miss");
+    for (i = 0; i < num; i++) {
+        items[i].k = keys[i];
+    }
+    shuffle(order, num);
+
+    /* generic: struct entry per insert, hashfn/eqfn pointers, % prime */
+    h = create_hashtable(65535, hashfromkey, equalkeys);
+    if (h == NULL) {
+        fprintf(stderr, "create_hashtable(): failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < num; i++) {
+        hashtable_insert(h, &items[i].k, &items[i]);
+    }
+    t[0][0] = now_ns() - t0;
+
+    t0 = now_ns();
+    for (i = 0; i < num; i++) {
+        found += hashtable_search(h, &keys[order[i]]) != NULL;
+    }
+    t[0][1] = now_ns() - t0;
+
+    t0 = now_ns();
+    for (i = 0; i < num; i++) {
+        found += hashtable_search(h, &miss[order[i]]) != NULL;
+    }
+    t[0][2] = now_ns() - t0;
+
+    t0 = now_ns();
+    for (i = 0; i < num; i++) {
+        hashtable_remove(h, &items[order[i]].k);
+    }
+    t[0][3] = now_ns() - t0;
+
+    hashtable_destroy(h, 0);
+
+    /* specialized: intrusive chains, inlined hash and compare, mask */
+    if (itemtable_init(&it, 65536) != 0) {
+        fprintf(stderr, "itemtable_init(): failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < num; i++) {
+        itemtable_insert(&it, &items[i]);
+    }
+    t[1][0] = now_ns() - t0;
+
+    t0 = now_ns();
+    for (i = 0; i < num; i++) {
+        found += itemtable_search(&it, &keys[order[i]]) != NULL;
+    }
+    t[1][1] = now_ns() - t0;
+
+    t0 = now_ns();
+    for (i = 0; i < num; i++) {
+        found += itemtable_search(&it, &miss[order[i]]) != NULL;
+    }
+    t[1][2] = now_ns() - t0;
+
+    t0 = now_ns();
+    for (i = 0; i < num; i++) {
+        itemtable_remove(&it, &items[order[i]]);
+    }
+    t[1][3] = now_ns() - t0;
+
+    itemtable_destroy(&it, NULL);
+
+    if (found != num * 2) {
+        fprintf(stderr, "lookup mismatch: %d found, %d expected\n", found, num * 2);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d keys, ns per operation\n\n", num);
+    printf("%-12s %8s %8s %8s %8s\n", "table", "insert", "hit", "miss", "remove");
+    printf("%-12s %8.1f %8.1f %8.1f %8.1f\n", "hashtable",
+            t[0][0] / num, t[0][1] / num, t[0][2] / num, t[0][3] / num);
+    printf("%-12s %8.1f %8.1f %8.1f %8.1f\n", "itemtable",
+            t[1][0] / num, t[1][1] / num, t[1][2] / num, t[1][3] / num);
+
+    return 0;
+}
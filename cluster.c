@@ -0,0 +1,282 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Cluster mode: keys are partitioned over several daemons by a consistent
+ * hash ring.
+ *
+ * Every node is started with the same -C list of host:port and places
+ * CLUSTER_VNODES points on the ring at em_hash("host:port#i"). A key
+ * belongs to the node of the first point at or after
+ * em_hash(key, CLUSTER_SEED), wrapping around. The seed is fixed, not the
+ * per-process hash_seed, so that all nodes and clients agree; clients must
+ * use the em_hash() the server was built with.
+ *
+ * A node asked for a key it does not own answers
+ * "-MOVED <hash> <host:port>". "cluster slots" lists the hash ranges and
+ * their owners, for clients that route by themselves. The map is static:
+ * changing it means restarting the nodes with the new list, and locks
+ * held on keys that changed owner are not moved.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "hash.h"
+#include "cluster.h"
+
+#define CLUSTER_NAME_MAX 256
+
+struct ring_point {
+    unsigned int hv;
+    int node;
+};
+
+int cluster_enabled = 0;
+
+static char (*node_names)[CLUSTER_NAME_MAX] = NULL;
+static int nnodes = 0;
+static int self_node = -1;
+
+static struct ring_point *ring = NULL;
+static int npoints = 0;
+
+static char *slots_text = NULL;
+
+static int point_cmp(const void *a, const void *b)
+{
+    const struct ring_point *pa = (const struct ring_point *)a;
+    const struct ring_point *pb = (const struct ring_point *)b;
+
+    if (pa->hv != pb->hv) {
+        return pa->hv < pb->hv ? -1 : 1;
+    }
+
+    return pa->node - pb->node;
+}
+
+/* index of the first point at or after hv, 0 past the last one */
+static int ring_find(unsigned int hv)
+{
+    int lo = 0;
+    int hi = npoints;
+    int mid = 0;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ring[mid].hv < hv) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo == npoints ? 0 : lo;
+}
+
+/* index in the -C list of the node owning key */
+int cluster_node(const char *key, int nkey)
+{
+    return ring[ring_find(em_hash(key, nkey, CLUSTER_SEED))].node;
+}
+
+const char *cluster_name(int node)
+{
+    return node_names[node];
+}
+
+/*
+ * the owner of key, or NULL if it is this node. *hv gets the ring hash of
+ * the key.
+ */
+const char *cluster_owner(const char *key, int nkey, unsigned int *hv)
+{
+    int node = 0;
+
+    *hv = em_hash(key, nkey, CLUSTER_SEED);
+
+    node = ring[ring_find(*hv)].node;
+    if (node == self_node) {
+        return NULL;
+    }
+
+    return node_names[node];
+}
+
+const char *cluster_slots(void)
+{
+    return slots_text;
+}
+
+/*
+ * "+OK, cluster slots: n" and a "start-end host:port" line per run of
+ * the ring owned by one node. point i owns (ring[i - 1].hv, ring[i].hv],
+ * the first point also the wrap around past the last one.
+ */
+static int build_slots(void)
+{
+    int i = 0;
+    int n = 0;
+    int node = 0;
+    int cur = 0;
+    size_t off = 0;
+    size_t size = 0;
+    char *body = NULL;
+    unsigned long long start = 0;
+    unsigned long long end = 0;
+    unsigned long long cur_start = 0;
+
+    size = (size_t)(npoints + 1) * (CLUSTER_NAME_MAX + 48);
+    body = (char *)malloc(size);
+    if (body == NULL) {
+        return -1;
+    }
+
+    cur = ring[0].node;
+    cur_start = 0;
+    end = ring[0].hv;
+
+    for (i = 1; i <= npoints; i++) {
+        if (i < npoints) {
+            start = (unsigned long long)ring[i - 1].hv + 1;
+            node = ring[i].node;
+            if (ring[i].hv == ring[i - 1].hv) {
+                continue;
+            }
+        }
+        else {
+            if (ring[npoints - 1].hv == 0xffffffffU) {
+                break;
+            }
+            start = (unsigned long long)ring[npoints - 1].hv + 1;
+            node = ring[0].node;
+        }
+
+        if (node != cur) {
+            off += snprintf(body + off, size - off, "\r\n%llu-%llu %s",
+                    cur_start, end, node_names[cur]);
+            n++;
+            cur = node;
+            cur_start = start;
+        }
+
+        end = i < npoints ? ring[i].hv : 0xffffffffULL;
+    }
+
+    off += snprintf(body + off, size - off, "\r\n%llu-%llu %s",
+            cur_start, 0xffffffffULL, node_names[cur]);
+    n++;
+
+    slots_text = (char *)malloc(off + 64);
+    if (slots_text == NULL) {
+        free(body);
+        return -1;
+    }
+
+    sprintf(slots_text, "+OK, cluster slots: %d%s", n, body);
+
+    free(body);
+
+    return 0;
+}
+
+/*
+ * nodes is the comma separated host:port list shared by the cluster,
+ * self this node's entry in it; without one, the entry on port is.
+ * a client of the cluster passes neither. returns the number of nodes.
+ */
+int cluster_init(const char *nodes, const char *self, int port)
+{
+    int i = 0;
+    int j = 0;
+    int len = 0;
+    int matches = 0;
+    char name[CLUSTER_NAME_MAX + 16];
+    const char *p = NULL;
+    const char *q = NULL;
+    const char *colon = NULL;
+
+    if (nodes == NULL) {
+        return 0;
+    }
+
+    for (p = nodes, nnodes = 1; *p != '\0'; p++) {
+        if (*p == ',') {
+            nnodes++;
+        }
+    }
+
+    node_names = calloc(nnodes, CLUSTER_NAME_MAX);
+    ring = calloc((size_t)nnodes * CLUSTER_VNODES, sizeof(struct ring_point));
+    if (node_names == NULL || ring == NULL) {
+        fprintf(stderr, "cluster_init(): out of memory\n");
+        return -1;
+    }
+
+    for (p = nodes, i = 0; i < nnodes; i++, p = q + 1) {
+        q = strchr(p, ',');
+        if (q == NULL) {
+            q = p + strlen(p);
+        }
+
+        len = q - p;
+        colon = memchr(p, ':', len);
+        if (len == 0 || len >= CLUSTER_NAME_MAX || colon == NULL) {
+            fprintf(stderr, "cluster nodes must be host:port, not %.*s\n", len, p);
+            return -1;
+        }
+
+        memcpy(node_names[i], p, len);
+
+        for (j = 0; j < i; j++) {
+            if (strcmp(node_names[i], node_names[j]) == 0) {
+                fprintf(stderr, "cluster node %s listed twice\n", node_names[i]);
+                return -1;
+            }
+        }
+
+        if (self != NULL ? strcmp(node_names[i], self) == 0 : atoi(colon + 1) == port) {
+            self_node = i;
+            matches++;
+        }
+    }
+
+    /* a client, self and port both unset, only routes keys */
+    if ((self != NULL || port != 0) && matches != 1) {
+        fprintf(stderr, "%s this node in the cluster, use -N host:port\n",
+                matches == 0 ? "cannot find" : "cannot tell which is");
+        return -1;
+    }
+
+    for (i = 0; i < nnodes; i++) {
+        for (j = 0; j < CLUSTER_VNODES; j++) {
+            len = snprintf(name, sizeof(name), "%s#%d", node_names[i], j);
+            ring[npoints].hv = em_hash(name, len, CLUSTER_SEED);
+            ring[npoints].node = i;
+            npoints++;
+        }
+    }
+
+    qsort(ring, npoints, sizeof(struct ring_point), point_cmp);
+
+    if (build_slots() != 0) {
+        fprintf(stderr, "cluster_init(): out of memory\n");
+        return -1;
+    }
+
+    cluster_enabled = 1;
+
+    if (self_node >= 0) {
+        log_printf(LOGL_VERBOSE, "cluster of %d nodes, this is %s\n", nnodes, node_names[self_node]);
+    }
+
+    return nnodes;
+}
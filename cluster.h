@@ -0,0 +1,27 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _CLUSTER_H_
+#define _CLUSTER_H_
+
+#define CLUSTER_VNODES 128  /* ring points per node */
+#define CLUSTER_SEED   0    /* em_hash() seed of the ring, the same everywhere */
+
+extern int cluster_enabled;
+
+int cluster_init(const char *nodes, const char *self, int port);
+
+int cluster_node(const char *key, int nkey);
+
+const char *cluster_name(int node);
+
+const char *cluster_owner(const char *key, int nkey, unsigned int *hv);
+
+const char *cluster_slots(void);
+
+#endif
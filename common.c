@@ -17,63 +17,150 @@
 
 #include "event.h"
 #include "common.h"
+#include "hotkeys.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "repl.h"
+#include "session.h"
+#include "cluster.h"
+#include "ring.h"
 
 #define COMMAND_TOKEN 0
 #define SUBCOMMAND_TOKEN 1
 #define KEY_TOKEN 1
-#define KEY_MAX_LENGTH 64
-#define MAX_TOKENS 4
+#define KEY_MAX_LENGTH 1024
+#define MAX_TOKENS 5
+#define HOTKEYS_DEFAULT 10
+#define SCAN_MAX 1000
 
 struct token_t {
     char *value;
     size_t length;
 };
 
-void notify_block_conns(struct conn *c)
+uint64_t current_usec(void)
 {
-    int ret = 0;
-    struct conn *nc = NULL;
-    
-    nc = conn_find_blocklist(c);
-    if (nc == NULL) {
-        return;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t current_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* a blocked conn got the lock on it, arg caches the time of the handoff */
+static void conn_granted(struct item_waiter *w, struct item *it, void *arg)
+{
+    uint64_t *now = (uint64_t *)arg;
+    struct conn *nc = list_entry(w, struct conn, wait);
+
+    stats.curr_waiters--;
+
+    trace_event(TRACE_HANDOFF, nc->id, nc->sfd, it->k.hv, nc->wait.flags);
+
+    if (*now == 0) {
+        *now = current_usec();
     }
+    hotkeys_wait(&it->k, *now - nc->stamp);
+    hist_record(&stats.wait_hist, *now - nc->stamp);
+    nc->stamp = *now;
 
-    ret = hashlist_setlock(nc->lock_key, nc->lock_cmd);
-    if (ret < 0) {
-        out_string(nc, "-ERR, lock failed");
+    out_string(nc, "+OK, lock success");
+    nc->flags = sess_lock;
 
-        stats.lock_hits++;
+    stats.lock_cmds++;
 
-        if (!update_event(nc, EV_WRITE | EV_PERSIST)) {
-            if (settings.verbose > 0) {
-                fprintf(stderr, "notify_block_conns(): Couldn't update event\n");
-            }
-            conn_set_state(nc, conn_closing);
-        }
+    if ((nc->wait.flags & EM_DURABLE) && journal_hold(nc)) {
+        return;
     }
-    else if (ret > 0) {
-        conn_set_state(nc, conn_wait);
 
-        stats.lock_blks++;
+    if (!update_event(nc, EV_WRITE | EV_PERSIST)) {
+        log_printf(LOGL_VERBOSE, "notify_block_conns(): Couldn't update event\n");
+        conn_set_state(nc, conn_closing);
     }
-    else {
-        out_string(nc, "+OK, lock success");
-        nc->flags = sess_lock;
 
-        stats.lock_cmds++;
+    return;
+}
 
-        if (!update_event(nc, EV_WRITE | EV_PERSIST)) {
-            if (settings.verbose > 0) {
-                fprintf(stderr, "notify_block_conns(): Couldn't update event\n");
-            }
-            conn_set_state(nc, conn_closing);
-        }
+/*
+ * hand the lock on it over to the conns blocked on it, in arrival order,
+ * for as long as the head of the queue can be granted.
+ */
+void notify_block_conns(struct item *it)
+{
+    uint64_t now = 0;
+
+    assert(it != NULL);
+
+    hashlist_handoff(it, conn_granted, &now);
+
+    assert(it->ref > 0);
+
+    return;
+}
+
+/* a watch on it fired, wake its conn as a grant would */
+void notify_watch_conns(struct item_waiter *w, const struct item *it, int event)
+{
+    struct conn *nc = list_entry(w, struct conn, watch);
+
+    stats.watchers--;
+    stats.watch_fired++;
+
+    if (event == ITEM_WATCH_FREE) {
+        out_string(nc, "+OK, key is free");
+    }
+    else if (it->val & EM_WRITE) {
+        out_string(nc, "+OK, key is write locked");
+    }
+    else {
+        out_string(nc, "+OK, key is read locked");
+    }
+
+    if (!update_event(nc, EV_WRITE | EV_PERSIST)) {
+        log_printf(LOGL_VERBOSE, "notify_watch_conns(): Couldn't update event\n");
+        conn_set_state(nc, conn_closing);
     }
 
     return;
 }
 
+/*
+ * in cluster mode, send requests for keys another node owns there.
+ * returns 1 if the conn was redirected.
+ */
+static int redirect_key(struct conn *c, const char *key, const int nkey)
+{
+    unsigned int hv = 0;
+    const char *owner = NULL;
+    char buf[320] = {0};
+
+    if (!cluster_enabled) {
+        return 0;
+    }
+
+    owner = cluster_owner(key, nkey, &hv);
+    if (owner == NULL) {
+        return 0;
+    }
+
+    snprintf(buf, sizeof(buf), "-MOVED %u %s", hv, owner);
+    out_string(c, buf);
+
+    stats.cluster_moved++;
+
+    return 1;
+}
+
 static void process_lock_command(struct conn *c, struct token_t *tokens, const int ntokens)
 {
     int  i = 0;
@@ -84,6 +171,7 @@ static void process_lock_command(struct conn *c, struct token_t *tokens, const i
     char *key = NULL;
     char *ptr = NULL;
     char flags[4] = {0};
+    struct item_key ik;
 
     assert(c != NULL);
 
@@ -95,6 +183,15 @@ static void process_lock_command(struct conn *c, struct token_t *tokens, const i
     key = tokens[KEY_TOKEN].value;
     nkey = tokens[KEY_TOKEN].length;
 
+    if (repl_standby) {
+        out_string(c, "-ERR, standby is read only");
+        return;
+    }
+
+    if (redirect_key(c, key, nkey)) {
+        return;
+    }
+
     if (c->flags == sess_block) {
         out_string(c, "-ERR, waiting for have lock");
         return;
@@ -103,19 +200,25 @@ static void process_lock_command(struct conn *c, struct token_t *tokens, const i
         out_string(c, "-ERR, have locked one key");
         return;
     }
+
+    if (!list_empty(&c->watch.node)) {
+        /* a grant and the watch firing in one handoff share the reply buffer */
+        out_string(c, "-ERR, waiting for a watch");
+        return;
+    }
     
-    snprintf(c->lock_key, sizeof(c->lock_key), "%s", key);
+    /* checked before the copy, which would cut longer flags short */
+    if (tokens[2].length > sizeof(flags) - 1) {
+        out_string(c, "-ERR, bad command flags parameter");
+        return;
+    }
 
     snprintf(flags, sizeof(flags), "%s", tokens[2].value);
 
     len = strlen(flags);
-    if (len > 2) {
-        out_string(c, "-ERR, bad command flags parameter");
-        return;
-    }
 
     for (i = 0; i < len; i++) {
-        ptr = strchr("rwnb", flags[i]);
+        ptr = strchr("rwnbd", flags[i]);
         if (NULL == ptr) {
             out_string(c, "-ERR, illegal flags parameter");
             return;
@@ -130,26 +233,47 @@ static void process_lock_command(struct conn *c, struct token_t *tokens, const i
         val |= EM_NONBLOCK;
     }
 
-    c->lock_cmd = val;
+    if (strchr(flags, 'd')) {
+        val |= EM_DURABLE;
+    }
+
+    c->wait.flags = val;
 
-    ret = hashlist_setlock(key, val);
+    item_key_init(&ik, key, nkey);
+
+    ret = hashlist_setlock(&ik, val, &c->wait, &c->lock_it);
     if (ret < 0) {
+        trace_event(TRACE_FAIL, c->id, c->sfd, ik.hv, val);
+
         out_string(c, "-ERR, lock failed");
         c->flags = sess_init;
 
         stats.lock_hits++;
     }
     else if (ret > 0) {
+        trace_event(TRACE_BLOCK, c->id, c->sfd, ik.hv, val);
+
         conn_set_state(c, conn_wait);
         c->flags = sess_block;
+        c->stamp = current_usec();
+
+        hotkeys_block(&c->lock_it->k);
 
         stats.lock_blks++;
+        stats.curr_waiters++;
     }
     else {
+        trace_event(TRACE_GRANT, c->id, c->sfd, ik.hv, val);
+
         out_string(c, "+OK, lock success");
         c->flags = sess_lock;
+        c->stamp = current_usec();
 
         stats.lock_cmds++;
+
+        if (val & EM_DURABLE) {
+            journal_hold(c);
+        }
     }
 
     return;
@@ -159,24 +283,17 @@ static void process_unlock_command(struct conn *c, struct token_t *tokens, const
 {
     assert(c != NULL);
 
-    if (c->flags != sess_lock || c->lock_key[0] == '\0') {
+    if (c->flags != sess_lock || c->lock_it == NULL) {
         out_string(c, "-ERR, sequence error");
         return;
     }
 
-    if (c->lock_key[0] != '\0') {
-        hashlist_setunlock(c->lock_key);
-        c->lock_key[0] = '\0';
-    }
-
-    c->flags = sess_init;
+    conn_unlock(c);
 
     out_string(c, "+OK, unlock success");
 
     stats.unlock_cmds++;
 
-    notify_block_conns(c);
-
     return;
 }
 
@@ -189,9 +306,11 @@ static void process_stats_command(struct conn *c, struct token_t *tokens, const
     snprintf(buf, sizeof(buf), \
             "+OK, server stats:\r\nserver started: %ld\r\n"
             "current conns: %llu\r\ntotal conns: %llu\r\n"
+            "free conns: %llu\r\nfree buffers: %llu\r\n"
             "locked cmds: %llu\r\nlocked hits: %llu\r\n"
             "locked blks: %llu\r\nunlock cmds: %llu", \
             stats.started, stats.curr_conns, stats.total_conns, \
+            stats.conn_free, stats.buf_free, \
             stats.lock_cmds, stats.lock_hits, stats.lock_blks,
             stats.unlock_cmds);
 
@@ -200,6 +319,383 @@ static void process_stats_command(struct conn *c, struct token_t *tokens, const
     return;
 }
 
+/*
+ * stats latency
+ * percentiles of the time blocked lockers waited for the grant, of the
+ * time locks were held, and of the time spent on each command.
+ */
+static void process_latency_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    int  off = 0;
+    char buf[1024] = {0};
+
+    assert(c != NULL);
+
+    off = snprintf(buf, sizeof(buf), "+OK, latency:\r\n");
+    off += hist_format(&stats.wait_hist, "wait_us", buf + off, sizeof(buf) - off);
+    off += snprintf(buf + off, sizeof(buf) - off, "\r\n");
+    off += hist_format(&stats.hold_hist, "hold_us", buf + off, sizeof(buf) - off);
+    off += snprintf(buf + off, sizeof(buf) - off, "\r\n");
+    off += hist_format(&stats.cmd_hist, "cmd_ns", buf + off, sizeof(buf) - off);
+    off += snprintf(buf + off, sizeof(buf) - off, "\r\n");
+    hist_format(&stats.sync_hist, "sync_us", buf + off, sizeof(buf) - off);
+
+    out_string(c, buf);
+
+    return;
+}
+
+/*
+ * trace dump
+ * write the lock event ring to settings.trace_file for trace_decode.
+ */
+static void process_trace_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    long n = 0;
+    char buf[1024] = {0};
+
+    assert(c != NULL);
+
+    n = trace_dump(settings.trace_file);
+    if (n < 0) {
+        out_string(c, "-ERR, trace dump failed");
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "+OK, %ld events dumped to %s", n, settings.trace_file);
+
+    out_string(c, buf);
+
+    return;
+}
+
+/*
+ * stats replication
+ * role, lsn and how far the standbys are behind, or on a standby the
+ * primary followed and the age of the last batch applied.
+ */
+static void process_repl_stats_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    int  off = 0;
+    char buf[1024] = {0};
+
+    assert(c != NULL);
+
+    off = snprintf(buf, sizeof(buf), "+OK, replication:\r\n");
+    repl_format(buf + off, sizeof(buf) - off);
+
+    out_string(c, buf);
+
+    return;
+}
+
+/*
+ * promote
+ * stop following the primary and start granting locks. the holds
+ * mirrored from the primary are kept for settings.snapshot_grace.
+ */
+static void process_promote_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    char buf[128] = {0};
+
+    assert(c != NULL);
+
+    if (repl_promote() != 0) {
+        out_string(c, "-ERR, not a standby");
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "+OK, promoted at lsn %llu",
+            (unsigned long long)journal_lsn());
+
+    out_string(c, buf);
+
+    return;
+}
+
+/*
+ * session [id]
+ * without an id, start a session for this conn: a lock it holds outlives
+ * the connection by settings.session_grace seconds. with one, take that
+ * session over, together with the lock it kept.
+ */
+static void process_session_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    uint64_t id = 0;
+    char *end = NULL;
+    char buf[128] = {0};
+
+    assert(c != NULL);
+
+    if (settings.session_grace == 0) {
+        out_string(c, "-ERR, sessions are not enabled");
+        return;
+    }
+
+    if (c->sess != NULL) {
+        out_string(c, "-ERR, session exists");
+        return;
+    }
+
+    if (ntokens == 2) {
+        if (session_new(c) == NULL) {
+            out_string(c, "-ERR, out of memory");
+            return;
+        }
+
+        snprintf(buf, sizeof(buf), "+OK, session %016llx", (unsigned long long)c->sess->id);
+        out_string(c, buf);
+        return;
+    }
+
+    if (c->flags != sess_init || c->lock_it != NULL) {
+        out_string(c, "-ERR, sequence error");
+        return;
+    }
+
+    errno = 0;
+    id = strtoull(tokens[KEY_TOKEN].value, &end, 16);
+    if (errno != 0 || *end != '\0' || session_resume(c, id) != 0) {
+        out_string(c, "-ERR, no such session");
+        return;
+    }
+
+    out_string(c, c->lock_it != NULL ? "+OK, session resumed, lock held" : "+OK, session resumed");
+
+    return;
+}
+
+/*
+ * cluster slots
+ * the ranges of the key hash ring and the node owning each.
+ */
+static void process_cluster_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    assert(c != NULL);
+
+    if (!cluster_enabled) {
+        out_string(c, "-ERR, cluster mode is not enabled");
+        return;
+    }
+
+    out_string(c, cluster_slots());
+
+    return;
+}
+
+/*
+ * ring
+ * carry on over a pair of shared memory rings, see ring.c. the reply
+ * goes out on the socket with the fds, from ring_attach().
+ */
+static void process_ring_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    assert(c != NULL);
+
+    if (settings.socketpath == NULL) {
+        out_string(c, "-ERR, ring needs the unix socket");
+        return;
+    }
+
+    if (c->ring != NULL) {
+        out_string(c, "-ERR, ring exists");
+        return;
+    }
+
+    if (ring_attach(c) != 0) {
+        out_string(c, "-ERR, ring setup failed");
+        return;
+    }
+
+    return;
+}
+
+/*
+ * snapshot
+ * write the lock table to settings.snapshot_file now, in the background.
+ */
+static void process_snapshot_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    assert(c != NULL);
+
+    if (settings.snapshot_file == NULL) {
+        out_string(c, "-ERR, snapshots are not enabled");
+        return;
+    }
+
+    if (snapshot_start() != 0) {
+        out_string(c, "-ERR, snapshot in progress");
+        return;
+    }
+
+    out_string(c, "+OK, snapshot started");
+
+    return;
+}
+
+/*
+ * hotkeys [num | reset]
+ * the most contended keys: how often they blocked someone, how long the
+ * waiters waited and the holders held them meanwhile, and how many
+ * conns are queued on them now.
+ */
+static void process_hotkeys_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    int  i = 0;
+    int  n = 0;
+    int  num = HOTKEYS_DEFAULT;
+    int  depth = 0;
+    size_t off = 0;
+    char *buf = NULL;
+    struct list_head *node = NULL;
+    struct item *it = NULL;
+    struct item_key ik;
+    struct hotkey *top[HOTKEYS_TOPK];
+
+    assert(c != NULL);
+
+    if (ntokens == 3) {
+        if (strcmp(tokens[KEY_TOKEN].value, "reset") == 0) {
+            hotkeys_reset();
+            out_string(c, "+OK, hot keys reset");
+            return;
+        }
+
+        num = atoi(tokens[KEY_TOKEN].value);
+        if (num <= 0 || num > HOTKEYS_TOPK) {
+            out_string(c, "-ERR, bad command line format");
+            return;
+        }
+    }
+
+    n = hotkeys_top(top, num);
+
+    buf = (char *)malloc(64 + (size_t)n * (KEY_MAX_LENGTH + 128));
+    if (buf == NULL) {
+        out_string(c, "-ERR, out of memory");
+        return;
+    }
+
+    off = sprintf(buf, "+OK, hot keys: %d", n);
+
+    for (i = 0; i < n; i++) {
+        ik.key = top[i]->key;
+        ik.nkey = top[i]->nkey;
+        ik.hv = top[i]->hv;
+
+        depth = 0;
+        it = hashlist_findlock(&ik);
+        if (it != NULL) {
+            list_for_each (node, &it->waiters) {
+                depth++;
+            }
+        }
+
+        off += sprintf(buf + off, "\r\n%s waits %u wait_ms %.3f hold_ms %.3f queue %d",
+                top[i]->key, top[i]->waits, top[i]->wait_usec / 1000.0,
+                top[i]->hold_usec / 1000.0, depth);
+    }
+
+    out_string(c, buf);
+
+    free(buf);
+
+    return;
+}
+
+/*
+ * scan prefix limit [cursor]
+ * the keys under prefix in key order, up to limit of them, with their
+ * mode and holds. next is the cursor to carry on from, "-" at the end.
+ */
+static void process_scan_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    int  i = 0;
+    int  n = 0;
+    int  limit = 0;
+    size_t off = 0;
+    char *buf = NULL;
+    const char *cursor = NULL;
+    size_t ncursor = 0;
+    struct item **found = NULL;
+
+    assert(c != NULL);
+
+    limit = atoi(tokens[2].value);
+    if (limit <= 0 || limit > SCAN_MAX
+            || tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
+        out_string(c, "-ERR, bad command line format");
+        return;
+    }
+
+    if (ntokens == 5) {
+        cursor = tokens[3].value;
+        ncursor = tokens[3].length;
+    }
+
+    /* one more than asked for, to know if there is a next page */
+    found = (struct item **)malloc(sizeof(struct item *) * (limit + 1));
+    buf = (char *)malloc(64 + KEY_MAX_LENGTH + (size_t)limit * (KEY_MAX_LENGTH + 32));
+    if (found == NULL || buf == NULL) {
+        free(found);
+        free(buf);
+        out_string(c, "-ERR, out of memory");
+        return;
+    }
+
+    n = hashlist_scan(tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length,
+            cursor, ncursor, found, limit + 1);
+    if (n < 0) {
+        free(found);
+        free(buf);
+        out_string(c, "-ERR, ordered index is not enabled");
+        return;
+    }
+
+    off = sprintf(buf, "+OK, scan %d next %s", n > limit ? limit : n,
+            n > limit ? ITEM_key(found[limit - 1]) : "-");
+
+    for (i = 0; i < n && i < limit; i++) {
+        off += sprintf(buf + off, "\r\n%s %c %d", ITEM_key(found[i]),
+                (EM_WRITE & found[i]->val) ? 'w' : 'r', found[i]->ref);
+    }
+
+    out_string(c, buf);
+
+    free(found);
+    free(buf);
+
+    return;
+}
+
+/*
+ * unlockprefix prefix
+ * release the lock this conn holds if its key is under prefix. a conn
+ * holds one lock at a time, so this is 0 or 1 of them.
+ */
+static void process_unlockprefix_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    struct item *it = NULL;
+
+    assert(c != NULL);
+
+    it = c->lock_it;
+    if (c->flags != sess_lock || it == NULL
+            || it->k.nkey < tokens[KEY_TOKEN].length
+            || memcmp(it->k.key, tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length) != 0) {
+        out_string(c, "+OK, unlocked 0");
+        return;
+    }
+
+    conn_unlock(c);
+
+    out_string(c, "+OK, unlocked 1");
+
+    stats.unlock_cmds++;
+
+    return;
+}
+
 static void process_help_command(struct conn *c, struct token_t *tokens, const int ntokens)
 {
     char buf[1024] = {0};
@@ -208,8 +704,11 @@ static void process_help_command(struct conn *c, struct token_t *tokens, const i
 
     snprintf(buf, sizeof(buf), \
             "+OK, lock server command usage (V%s):\r\n"
-            "lock key_string {n | w/r}\r\nunlock\r\n"
-            "quit\r\nfind key_string\r\nstats\r\nhelp", LOCKD_VERSION);
+            "lock key_string {n | w/r | d}\r\nunlock\r\n"
+            "quit\r\nfind key_string\r\nwatch key_string\r\nhotkeys [num | reset]\r\n"
+            "scan prefix limit [cursor]\r\nunlockprefix prefix\r\n"
+            "stats [latency | replication]\r\ntrace dump\r\nsnapshot\r\n"
+            "promote\r\nsession [id]\r\ncluster slots\r\nring\r\nhelp", LOCKD_VERSION);
 
     out_string(c, buf);
 
@@ -219,6 +718,7 @@ static void process_help_command(struct conn *c, struct token_t *tokens, const i
 static void process_find_command(struct conn *c, struct token_t *tokens, const int ntokens)
 {
     struct item *it = NULL;
+    struct item_key ik;
 
     int  nkey = 0;
     char *key = NULL;
@@ -229,20 +729,86 @@ static void process_find_command(struct conn *c, struct token_t *tokens, const i
     key = tokens[KEY_TOKEN].value;
     nkey = tokens[KEY_TOKEN].length;
 
-    it = hashlist_findlock(key);
+    if (redirect_key(c, key, nkey)) {
+        return;
+    }
+
+    item_key_init(&ik, key, nkey);
+
+    it = hashlist_findlock(&ik);
     if (it == NULL) {
         out_string(c, "+OK, the key is not exist");
         return;
     }
 
-    snprintf(buf, sizeof(buf), "+OK, the key %d locked ref %d at %ld", \
-            it->val, it->ref, it->exp);
+    snprintf(buf, sizeof(buf), "+OK, the key %d locked ref %d at %ld gen %llu", \
+            it->val, it->ref, it->exp, (unsigned long long)it->gen);
 
     out_string(c, buf);
 
     return;
 }
 
+/*
+ * watch key
+ * instead of polling find: replies once key is released for good, or
+ * is handed over in the other mode. the conn waits for it as for a lock.
+ */
+static void process_watch_command(struct conn *c, struct token_t *tokens, const int ntokens)
+{
+    struct item *it = NULL;
+    struct item_key ik;
+
+    assert(c != NULL);
+
+    if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
+        out_string(c, "-ERR, bad command line format");
+        return;
+    }
+
+    if (repl_standby) {
+        /* a full resync frees the items, watchers and all */
+        out_string(c, "-ERR, standby is read only");
+        return;
+    }
+
+    if (redirect_key(c, tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length)) {
+        return;
+    }
+
+    if (!list_empty(&c->watch.node)) {
+        out_string(c, "-ERR, watching one key");
+        return;
+    }
+
+    if (c->flags == sess_block) {
+        /* its grant could come in the same handoff as the watch */
+        out_string(c, "-ERR, waiting for have lock");
+        return;
+    }
+
+    item_key_init(&ik, tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length);
+
+    it = hashlist_findlock(&ik);
+    if (it == NULL) {
+        out_string(c, "+OK, key is free");
+        return;
+    }
+
+    if (it == c->lock_it) {
+        /* nothing could fire it while we wait */
+        out_string(c, "-ERR, sequence error");
+        return;
+    }
+
+    hashlist_watch(it, &c->watch);
+    conn_set_state(c, conn_wait);
+
+    stats.watchers++;
+
+    return;
+}
+
 static int tokenize_command(char *command, struct token_t *tokens, 
         const int max_tokens)
 {
@@ -287,12 +853,11 @@ static void process_command(struct conn *c, char *command)
 {
     struct token_t tokens[MAX_TOKENS];
     int    ntokens = 0;
-    
+    uint64_t start = current_nsec();
+
     assert(c != NULL);
 
-    if (settings.verbose > 0) {
-        fprintf(stderr, "<<<. %d input cmd:[%s]\n", c->sfd, command);
-    }
+    log_printf(LOGL_VERBOSE, "<<<. %d input cmd:[%s]\n", c->sfd, command);
 
     ntokens = tokenize_command(command, tokens, MAX_TOKENS);
     if (ntokens >= 4
@@ -305,12 +870,53 @@ static void process_command(struct conn *c, char *command)
     }
     else if (ntokens == 2
             && (strcmp(tokens[COMMAND_TOKEN].value, "quit") == 0)) {
+        session_end(c);
         conn_set_state(c, conn_closing);
     }
     else if (ntokens == 2
             && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)) {
         process_stats_command(c, tokens, ntokens);
     }
+    else if (ntokens == 3
+            && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)
+            && (strcmp(tokens[KEY_TOKEN].value, "latency") == 0)) {
+        process_latency_command(c, tokens, ntokens);
+    }
+    else if (ntokens == 3
+            && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)
+            && (strcmp(tokens[KEY_TOKEN].value, "replication") == 0)) {
+        process_repl_stats_command(c, tokens, ntokens);
+    }
+    else if (ntokens == 2
+            && (strcmp(tokens[COMMAND_TOKEN].value, "promote") == 0)) {
+        process_promote_command(c, tokens, ntokens);
+    }
+    else if ((ntokens == 2 || ntokens == 3)
+            && (strcmp(tokens[COMMAND_TOKEN].value, "session") == 0)) {
+        process_session_command(c, tokens, ntokens);
+    }
+    else if (ntokens == 3
+            && (strcmp(tokens[COMMAND_TOKEN].value, "cluster") == 0)
+            && (strcmp(tokens[KEY_TOKEN].value, "slots") == 0)) {
+        process_cluster_command(c, tokens, ntokens);
+    }
+    else if (ntokens == 2
+            && (strcmp(tokens[COMMAND_TOKEN].value, "ring") == 0)) {
+        process_ring_command(c, tokens, ntokens);
+    }
+    else if (ntokens == 2
+            && (strcmp(tokens[COMMAND_TOKEN].value, "snapshot") == 0)) {
+        process_snapshot_command(c, tokens, ntokens);
+    }
+    else if (ntokens == 3
+            && (strcmp(tokens[COMMAND_TOKEN].value, "trace") == 0)
+            && (strcmp(tokens[KEY_TOKEN].value, "dump") == 0)) {
+        process_trace_command(c, tokens, ntokens);
+    }
+    else if ((ntokens == 2 || ntokens == 3)
+            && (strcmp(tokens[COMMAND_TOKEN].value, "hotkeys") == 0)) {
+        process_hotkeys_command(c, tokens, ntokens);
+    }
     else if (ntokens == 2
             && (strcmp(tokens[COMMAND_TOKEN].value, "help") == 0)) {
         process_help_command(c, tokens, ntokens);
@@ -319,10 +925,24 @@ static void process_command(struct conn *c, char *command)
             && (strcmp(tokens[COMMAND_TOKEN].value, "find") == 0)) {
         process_find_command(c, tokens, ntokens);
     }
+    else if (ntokens == 3
+            && (strcmp(tokens[COMMAND_TOKEN].value, "watch") == 0)) {
+        process_watch_command(c, tokens, ntokens);
+    }
+    else if ((ntokens == 4 || ntokens == 5)
+            && (strcmp(tokens[COMMAND_TOKEN].value, "scan") == 0)) {
+        process_scan_command(c, tokens, ntokens);
+    }
+    else if (ntokens == 3
+            && (strcmp(tokens[COMMAND_TOKEN].value, "unlockprefix") == 0)) {
+        process_unlockprefix_command(c, tokens, ntokens);
+    }
     else {
         out_string(c, "-ERR, unimplemented");
     }
 
+    hist_record(&stats.cmd_hist, current_nsec() - start);
+
     return;
 }
 
@@ -377,6 +997,12 @@ static int try_read_network(struct conn *c)
 
     assert(c != NULL);
 
+    if (c->rbuf == NULL && !conn_rbuf_alloc(c)) {
+        log_printf(LOGL_VERBOSE, "Couldn't alloc input buffer\n");
+        conn_set_state(c, conn_closing);
+        return 1;
+    }
+
     if (c->rcurr != c->rbuf) {
         if (c->rbytes != 0) /* otherwise there's nothing to copy */
             memmove(c->rbuf, c->rcurr, c->rbytes);
@@ -387,9 +1013,7 @@ static int try_read_network(struct conn *c)
         if (c->rbytes >= c->rsize) {
             char *new_rbuf = realloc(c->rbuf, c->rsize * 2);
             if (!new_rbuf) {
-                if (settings.verbose > 0) {
-                    fprintf(stderr, "Couldn't realloc input buffer\n");
-                }
+                log_printf(LOGL_VERBOSE, "Couldn't realloc input buffer\n");
 
                 c->rbytes = 0; /* ignore what we read */
                 out_string(c, "-ERR, out of memory reading request");
@@ -400,7 +1024,12 @@ static int try_read_network(struct conn *c)
         }
 
         int avail = c->rsize - c->rbytes;
-        res = read(c->sfd, c->rbuf + c->rbytes, avail);
+        if (c->ring != NULL) {
+            res = ring_read(c, c->rbuf + c->rbytes, avail);
+        }
+        else {
+            res = read(c->sfd, c->rbuf + c->rbytes, avail);
+        }
         if (res > 0) {
             gotdata = 1;
             c->rbytes += res;
@@ -432,7 +1061,16 @@ static int try_write_network(struct conn *c)
 
     assert(c != NULL);
 
-    n = write(c->sfd, c->wcurr, c->wbytes);
+    if (c->wbytes == 0) {
+        return 0;
+    }
+
+    if (c->ring != NULL) {
+        n = ring_write(c, c->wcurr, c->wbytes);
+    }
+    else {
+        n = write(c->sfd, c->wcurr, c->wbytes);
+    }
     if (n == -1) {
         return -1;
     }
@@ -440,10 +1078,9 @@ static int try_write_network(struct conn *c)
         return 0;
     }
 
-    /* */
+    /* all out, give the buffer back until there is more to say */
     if (n >= c->wbytes) {
-        c->wbytes = 0;
-        c->wcurr = c->wbuf;
+        conn_wbuf_release(c);
         goto done;
     }
 
@@ -476,13 +1113,11 @@ static void drive_machine(struct conn *c)
                         stop = true;
                     }
                     else if (errno == EMFILE) {
-                        if (settings.verbose > 0) {
-                            fprintf(stderr, "Too many open connections\n");
-                            stop = true;
-                        }
+                        log_printf(LOGL_VERBOSE, "Too many open connections\n");
+                        stop = true;
                     }
                     else {
-                        fprintf(stderr, "accept(): fatal error\n");
+                        log_printf(LOGL_ERROR, "accept(): fatal error\n");
                         stop = true;
                     }
                     break;
@@ -490,15 +1125,21 @@ static void drive_machine(struct conn *c)
 
                 if ((flags = fcntl(sfd, F_GETFL, 0)) < 0
                         || fcntl(sfd, F_SETFL, flags | O_NONBLOCK) < 0) {
-                    fprintf(stderr, "fcntl(): setting O_NONBLOCK\n");
+                    log_printf(LOGL_ERROR, "fcntl(): setting O_NONBLOCK\n");
                     close(sfd);
                     break;
                 }
 
-                nc = conn_new(sfd, conn_read, EV_READ | EV_PERSIST,
-                        DATA_BUFFER_SIZE, main_base);
+                nc = conn_new(sfd, conn_read, EV_READ | EV_PERSIST, main_base);
                 if (NULL == nc) {
-                    fprintf(stderr, "conn_new(): fatal error\n");
+                    log_printf(LOGL_ERROR, "conn_new(): fatal error\n");
+                    close(sfd);
+                    break;
+                }
+
+                if (!conn_add_to_connslist(nc)) {
+                    event_del(&nc->event);
+                    conn_free(nc);
                     close(sfd);
                     break;
                 }
@@ -506,8 +1147,6 @@ static void drive_machine(struct conn *c)
                 stats.curr_conns++;
                 stats.total_conns++;
 
-                conn_add_to_connslist(nc);
-
                 stop = true;
                 break;
                 
@@ -521,10 +1160,12 @@ static void drive_machine(struct conn *c)
                 }
 
                 /* we have no command line and no data to read from network */
+                if (c->rbytes == 0) {
+                    conn_rbuf_release(c);
+                }
+
                 if (!update_event(c, EV_READ | EV_PERSIST)) {
-                    if (settings.verbose > 0) {
-                        fprintf(stderr, "Couldn't update event\n");
-                    }
+                    log_printf(LOGL_VERBOSE, "Couldn't update event\n");
                     conn_set_state(c, conn_closing);
                     break;
                 }
@@ -536,10 +1177,10 @@ static void drive_machine(struct conn *c)
                 ret = try_write_network(c);
                 if (ret < 0) {
                     if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
-                            if (settings.verbose > 0) {
-                                fprintf(stderr, "Couldn't update event\n");
-                            }
+                        /* a full ring wakes us through its eventfd */
+                        if (!update_event(c, c->ring != NULL ? EV_READ | EV_PERSIST
+                                    : EV_WRITE | EV_PERSIST)) {
+                            log_printf(LOGL_VERBOSE, "Couldn't update event\n");
                             conn_set_state(c, conn_closing);
                             break;
                         }
@@ -565,10 +1206,12 @@ static void drive_machine(struct conn *c)
                 break;
 
             case conn_wait:
+                if (c->rbytes == 0) {
+                    conn_rbuf_release(c);
+                }
+
                 if (!update_event(c, EV_READ | EV_PERSIST)) {
-                    if (settings.verbose > 0) {
-                        fprintf(stderr, "Couldn't update event\n");
-                    }
+                    log_printf(LOGL_VERBOSE, "Couldn't update event\n");
                     conn_set_state(c, conn_closing);
                     break;
                 }
@@ -577,6 +1220,11 @@ static void drive_machine(struct conn *c)
                 stop = true;
                 break;
 
+            case conn_sync:
+                /* journal_synced() moves us on to conn_write */
+                stop = true;
+                break;
+
             case conn_closing:
                 conn_close(c);
                 stop = true;
@@ -598,9 +1246,7 @@ void event_handler(const int fd, const short which, void *arg)
 
     /* sanity */
     if (fd != c->sfd) {
-        if (settings.verbose > 0) {
-            fprintf(stderr, "Catastrophic: event fd doesn't match conn fd!\n");
-        }
+        log_printf(LOGL_VERBOSE, "Catastrophic: event fd doesn't match conn fd!\n");
         conn_close(c);
         return;
     }
@@ -617,17 +1263,25 @@ void out_string(struct conn *c, const char *str)
 
     assert(c != NULL);
 
-    if (settings.verbose > 0) {
-        fprintf(stderr, ">>>. %d output cmd:[%s]\n", c->sfd, str);
-    }
+    log_printf(LOGL_VERBOSE, ">>>. %d output cmd:[%s]\n", c->sfd, str);
 
     len = strlen(str);
-    if ((len + 2) > c->wsize) {
+    if ((len + 2) > OUTPUT_MAX_SIZE) {
         /* ought to be always enough. just fail for simplicity */
         str = "-ERR, server output line too long";
         len = strlen(str);
     }
 
+    if (c->wbuf != NULL && (len + 2) > c->wsize) {
+        conn_wbuf_release(c);
+    }
+
+    if (c->wbuf == NULL && !conn_wbuf_alloc(c, len + 2)) {
+        log_printf(LOGL_VERBOSE, "Couldn't alloc output buffer\n");
+        conn_set_state(c, conn_closing);
+        return;
+    }
+
     memcpy(c->wbuf, str, len);
     memcpy(c->wbuf + len, "\r\n", 2);
     c->wbytes = len + 2;
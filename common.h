@@ -9,6 +9,13 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+#include "hist.h"
+#include "log.h"
+
 /* Get a consistent bool type */
 #if HAVE_STDBOOL_H
 # include <stdbool.h>
@@ -19,33 +26,85 @@ typedef enum {false = 0, true = 1} bool;
 #define LOCKD_VERSION "0.0.1"
 
 #define DATA_BUFFER_SIZE 2048
+#define OUTPUT_MAX_SIZE (1024 * 1024)
 
 struct settings_t {
     int  maxconns;
+    int  prewarm_conns;  /* conn objects to pre-allocate at startup */
     int  port;
+    int  metrics_port;  /* prometheus listener, 0 is off */
     int  verbose;  /* debug model */
     int  num_threads;  /* number of libevent threads to run */
     int  access;  /* access mask (a la chmod) for unix domain socket */
     char *inter;
     char *socketpath;  /* path to unix socket if using local socket */
+    char *trace_file;  /* where "trace dump" and SIGUSR1 write the trace ring */
+    char *log_file;    /* log to this file instead of stderr */
+    unsigned long log_rotate;  /* rotate the log file after this many bytes */
+    char *snapshot_file;       /* lock table snapshot, NULL is off */
+    int  snapshot_interval;    /* seconds between snapshots, 0 only on demand */
+    int  snapshot_grace;       /* seconds restored locks are held for */
+    char *journal_file;        /* journal segments are journal_file.N */
+    int  repl_port;            /* port standbys connect to, 0 is off */
+    char *repl_primary;        /* host:port to follow as a standby, NULL is off */
+    char *hot_path;            /* unix socket for hot restart handovers, NULL is off */
+    int  session_grace;        /* seconds a session outlives its conn, 0 is off */
+    char *cluster_nodes;       /* host:port,... of the cluster, NULL is off */
+    char *cluster_self;        /* this node's entry, NULL to find it by port */
+    char *shm_file;            /* shared memory lock table, NULL is off */
+    unsigned int shm_slots;    /* keys the shared memory table has room for */
+    bool ordered;              /* keep the keys in order too, for scan */
 };
 
 struct stats {
     time_t             started;  /* when the process was started */
     unsigned long long curr_conns;
     unsigned long long total_conns;
+    unsigned long long conn_free;  /* conn objects on the free list */
+    unsigned long long buf_free;   /* buffers on the free list */
     unsigned long long lock_cmds;
     unsigned long long lock_hits;
     unsigned long long lock_blks;
+    unsigned long long curr_waiters;  /* conns queued for a lock */
     unsigned long long unlock_cmds;
     unsigned long long unlock_hits;
     unsigned long long items;
+    unsigned long long snapshots;       /* snapshots written */
+    unsigned long long snapshot_fails;
+    unsigned long long snapshot_usec;   /* duration of the last one */
+    time_t             snapshot_last;   /* when the last one was written */
+    unsigned long long journal_records;
+    unsigned long long journal_batches; /* write + fdatasync rounds */
+    unsigned long long journal_fails;
+    unsigned long long repl_standbys;   /* standbys connected */
+    unsigned long long repl_lag;        /* records the slowest standby has not acked */
+    unsigned long long repl_bytes;      /* bytes shipped to standbys */
+    unsigned long long repl_applied;    /* last lsn applied, on a standby */
+    unsigned long long repl_delay_usec; /* age of the last batch applied, on a standby */
+    unsigned long long sessions;        /* sessions, attached or not */
+    unsigned long long sessions_detached_locks; /* locks kept for detached sessions */
+    unsigned long long session_resumes;
+    unsigned long long session_expires;
+    unsigned long long cluster_moved;   /* requests redirected to another node */
+    unsigned long long shm_clients;     /* processes attached to the shm table */
+    unsigned long long shm_reaped;      /* shm clients found dead */
+    unsigned long long shm_reaped_locks; /* locks released for them */
+    unsigned long long ring_conns;      /* conns on shared memory rings */
+    unsigned long long ring_wakeups;    /* eventfd wakeups from ring clients */
+    unsigned long long watchers;        /* conns waiting on a watch */
+    unsigned long long watch_fired;
+    struct histogram   wait_hist;  /* usec from block to grant */
+    struct histogram   hold_hist;  /* usec from grant to unlock */
+    struct histogram   cmd_hist;   /* nsec spent processing a command */
+    struct histogram   lag_hist;   /* usec the event loop ran late */
+    struct histogram   sync_hist;  /* usec per journal write + fdatasync */
 };
 
 extern struct stats stats;
 extern struct settings_t settings;
 extern struct event_base *main_base;
 extern struct list_head listen_conn;
+extern volatile sig_atomic_t daemon_quit;
 
 #include "conn.h"
 #include "item.h"
@@ -53,6 +112,9 @@ extern struct list_head listen_conn;
 void event_handler(const int fd, const short which, void *arg);
 void out_string(struct conn *c, const char *str);
 bool update_event(struct conn *c, const int new_flags);
-void notify_block_conns(struct conn *c);
+void notify_block_conns(struct item *it);
+void notify_watch_conns(struct item_waiter *w, const struct item *it, int event);
+uint64_t current_usec(void);
+uint64_t current_nsec(void);
 
 #endif
@@ -13,73 +13,277 @@
 #include <assert.h>
 
 #include "common.h"
+#include "hotkeys.h"
+#include "trace.h"
+#include "session.h"
+#include "ring.h"
 
 extern struct settings_t settings;
 
 struct list_head connslist;
 
+/* client connections indexed by fd, sized from settings.maxconns */
+static struct conn **conns_table = NULL;
+static int conns_table_size = 0;
+
+static uint32_t conn_ids = 0;
+
+/*
+ * Closed conn objects are kept on conn_freelist (linked through cnode) and
+ * DATA_BUFFER_SIZE buffers on buf_freelist, so that accepting a connection
+ * does not have to go to malloc once the pools are warm.
+ *
+ * A conn only holds a buffer while it has partial input or pending output,
+ * idle connections hold none.
+ */
+#define BUF_PREWARM_MAX 1024
+
+struct buf_node {
+    struct buf_node *next;
+};
+
+static struct list_head conn_freelist;
+static struct buf_node *buf_freelist = NULL;
+
+static char *buf_get(void)
+{
+    struct buf_node *b = NULL;
+
+    if (buf_freelist == NULL) {
+        return (char *)malloc(DATA_BUFFER_SIZE);
+    }
+
+    b = buf_freelist;
+    buf_freelist = b->next;
+    stats.buf_free--;
+
+    return (char *)b;
+}
+
+static void buf_put(char *buf)
+{
+    struct buf_node *b = (struct buf_node *)buf;
+
+    b->next = buf_freelist;
+    buf_freelist = b;
+    stats.buf_free++;
+
+    return;
+}
+
+static struct conn *conn_get(void)
+{
+    struct conn *c = NULL;
+
+    if (list_empty(&conn_freelist)) {
+        return (struct conn *)calloc(1, sizeof(struct conn));
+    }
+
+    c = list_entry(conn_freelist.next, struct conn, cnode);
+    list_del(&c->cnode);
+    stats.conn_free--;
+
+    memset(c, 0, sizeof(struct conn));
+
+    return c;
+}
+
 void conn_init(void)
 {
     INIT_LIST_HEAD(&connslist);
+    INIT_LIST_HEAD(&conn_freelist);
+
+    /* leave room for stdio and the listening sockets */
+    conns_table_size = settings.maxconns + 16;
+    conns_table = (struct conn **)calloc(conns_table_size, sizeof(struct conn *));
+    if (conns_table == NULL) {
+        fprintf(stderr, "calloc(): conns table fatal error\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
-void conn_free(struct conn *c)
+static bool conn_table_grow(int sfd)
 {
-    if (c == NULL) {
+    int size = conns_table_size;
+    struct conn **table = NULL;
+
+    while (size <= sfd) {
+        size *= 2;
+    }
+
+    table = (struct conn **)realloc(conns_table, size * sizeof(struct conn *));
+    if (table == NULL) {
+        return false;
+    }
+
+    memset(table + conns_table_size, 0,
+            (size - conns_table_size) * sizeof(struct conn *));
+    conns_table = table;
+    conns_table_size = size;
+
+    return true;
+}
+
+struct conn *conn_find(const int sfd)
+{
+    if (sfd < 0 || sfd >= conns_table_size) {
+        return NULL;
+    }
+
+    return conns_table[sfd];
+}
+
+/*
+ * pre-allocate num conn objects and some buffers, so the first num
+ * connections are accepted without touching malloc.
+ */
+int conn_prewarm(int num)
+{
+    int i = 0;
+    char *buf = NULL;
+    struct conn *c = NULL;
+
+    for (i = 0; i < num; i++) {
+        c = (struct conn *)calloc(1, sizeof(struct conn));
+        if (c == NULL) {
+            return -1;
+        }
+        list_add(&c->cnode, &conn_freelist);
+        stats.conn_free++;
+    }
+
+    for (i = 0; i < num && i < BUF_PREWARM_MAX; i++) {
+        buf = (char *)malloc(DATA_BUFFER_SIZE);
+        if (buf == NULL) {
+            return -1;
+        }
+        buf_put(buf);
+    }
+
+    return 0;
+}
+
+bool conn_rbuf_alloc(struct conn *c)
+{
+    assert(c->rbuf == NULL);
+
+    c->rbuf = buf_get();
+    if (c->rbuf == NULL) {
+        return false;
+    }
+
+    c->rcurr = c->rbuf;
+    c->rsize = DATA_BUFFER_SIZE;
+    c->rbytes = 0;
+
+    return true;
+}
+
+void conn_rbuf_release(struct conn *c)
+{
+    if (c->rbuf == NULL) {
         return;
     }
 
-    if (c->rbuf != NULL) {
+    /* rbuf may have been grown by try_read_network(), don't pool it then */
+    if (c->rsize == DATA_BUFFER_SIZE) {
+        buf_put(c->rbuf);
+    }
+    else {
         free(c->rbuf);
     }
 
-    if (c->wbuf != NULL) {
+    c->rbuf = c->rcurr = NULL;
+    c->rsize = c->rbytes = 0;
+
+    return;
+}
+
+/* replies longer than DATA_BUFFER_SIZE get a buffer of their own */
+bool conn_wbuf_alloc(struct conn *c, int size)
+{
+    assert(c->wbuf == NULL);
+
+    if (size <= DATA_BUFFER_SIZE) {
+        c->wbuf = buf_get();
+        size = DATA_BUFFER_SIZE;
+    }
+    else {
+        c->wbuf = (char *)malloc(size);
+    }
+
+    if (c->wbuf == NULL) {
+        return false;
+    }
+
+    c->wcurr = c->wbuf;
+    c->wsize = size;
+    c->wbytes = 0;
+
+    return true;
+}
+
+void conn_wbuf_release(struct conn *c)
+{
+    if (c->wbuf == NULL) {
+        return;
+    }
+
+    if (c->wsize == DATA_BUFFER_SIZE) {
+        buf_put(c->wbuf);
+    }
+    else {
         free(c->wbuf);
     }
 
-    free(c);
+    c->wbuf = c->wcurr = NULL;
+    c->wsize = c->wbytes = 0;
 
     return;
 }
 
-struct conn *conn_new(const int sfd, const int init_state, 
-        const int event_flags, const int read_buffer_size, 
-        struct event_base *base)
+void conn_free(struct conn *c)
 {
-    struct conn *c = NULL;
-
-    c = (struct conn *)calloc(1, sizeof(struct conn));
     if (c == NULL) {
-        fprintf(stderr, "calloc(): struct conn fatal error\n");
-        return NULL;
+        return;
     }
 
-    c->rsize = read_buffer_size;
-    c->wsize = DATA_BUFFER_SIZE;
+    conn_rbuf_release(c);
+    conn_wbuf_release(c);
 
-    c->rbuf = c->wbuf = NULL;
-    c->rbuf = (char *)malloc(c->rsize);
-    c->wbuf = (char *)malloc(c->wsize);
+    list_add(&c->cnode, &conn_freelist);
+    stats.conn_free++;
 
-    if (c->rbuf == NULL || c->wbuf == NULL) {
-        conn_free(c);
-        fprintf(stderr, "malloc(): struct conn rbuf/wbuf fatal error\n");
+    return;
+}
+
+struct conn *conn_new(const int sfd, const int init_state,
+        const int event_flags, struct event_base *base)
+{
+    struct conn *c = NULL;
+
+    c = conn_get();
+    if (c == NULL) {
+        log_printf(LOGL_ERROR, "calloc(): struct conn fatal error\n");
         return NULL;
     }
 
-    if (settings.verbose > 1) {
-        if (conn_listening == init_state) {
-            fprintf(stderr, "<<<. %d server listening\n", sfd);
-        }
-        else {
-            fprintf(stderr, "<<<. %d new client connection\n", sfd);
-        }
+    if (conn_listening == init_state) {
+        log_printf(LOGL_DEBUG, "<<<. %d server listening\n", sfd);
+    }
+    else {
+        log_printf(LOGL_DEBUG, "<<<. %d new client connection\n", sfd);
     }
 
     c->sfd = sfd;
+    c->id = ++conn_ids;
     c->state = init_state;
     c->flags = sess_init;
-    c->lock_key[0] = '\0';
+    c->lock_it = NULL;
+    c->sess = NULL;
+    c->ring = NULL;
+    INIT_LIST_HEAD(&c->wait.node);
+    INIT_LIST_HEAD(&c->watch.node);
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
@@ -87,60 +291,36 @@ struct conn *conn_new(const int sfd, const int init_state,
 
     if (event_add(&c->event, NULL) == -1) {
         conn_free(c);
-        fprintf(stderr, "event_add(): fatal error\n");
+        log_printf(LOGL_ERROR, "event_add(): fatal error\n");
         return NULL;
     }
 
     return c;
 }
 
-void conn_add_to_connslist(struct conn *c)
-{
-    list_add(&c->cnode, &connslist);
-
-    return;
-}
-
-bool conn_del_from_connslist(struct conn *c)
+bool conn_add_to_connslist(struct conn *c)
 {
-    struct conn *nc = NULL;
-    struct list_head *node = NULL;
-    struct list_head *n    = NULL;
-
-    if (list_empty(&connslist)) {
+    if (c->sfd >= conns_table_size && !conn_table_grow(c->sfd)) {
+        log_printf(LOGL_ERROR, "realloc(): conns table fatal error\n");
         return false;
     }
 
-    list_for_each_safe (node, n, &connslist) {
-        nc = list_entry(node, struct conn, cnode);
-        if (nc->sfd == c->sfd) {
-            list_del(node);
-            break;
-        }
-    }
+    assert(conns_table[c->sfd] == NULL);
+    conns_table[c->sfd] = c;
+
+    list_add(&c->cnode, &connslist);
 
     return true;
 }
 
-struct conn *conn_find_blocklist(struct conn *c)
+void conn_del_from_connslist(struct conn *c)
 {
-    struct conn *nc = NULL;
-    struct list_head *node = NULL;
+    assert(conn_find(c->sfd) == c);
 
-    if (list_empty(&connslist)) {
-        return NULL;
-    }
-
-    list_for_each (node, &connslist) {
-        nc = list_entry(node, struct conn, cnode);
-        if (c->sfd != nc->sfd
-                && nc->flags == sess_block
-                && strncasecmp(c->lock_key, nc->lock_key, strlen(c->lock_key)) == 0) {
-            return nc;
-        }
-    }
+    conns_table[c->sfd] = NULL;
+    list_del(&c->cnode);
 
-    return NULL;
+    return;
 }
 
 /*
@@ -159,6 +339,48 @@ void conn_set_state(struct conn *c, int state)
     return;
 }
 
+/*
+ * give up the lock c holds or waits for, and hand the item over to the
+ * next waiters.
+ */
+void conn_unlock(struct conn *c)
+{
+    uint64_t held = 0;
+    struct item *it = c->lock_it;
+
+    if (it == NULL) {
+        return;
+    }
+
+    trace_event(TRACE_UNLOCK, c->id, c->sfd, it->k.hv, c->wait.flags);
+
+    if (c->flags == sess_lock) {
+        /* a durable grant whose reply is still held */
+        list_del_init(&c->wait.node);
+
+        held = current_usec() - c->stamp;
+        hist_record(&stats.hold_hist, held);
+        if (!list_empty(&it->waiters)) {
+            hotkeys_hold(&it->k, held);
+        }
+
+        if (hashlist_setunlock(it) > 0) {
+            notify_block_conns(it);
+        }
+    }
+    else if (c->flags == sess_block) {
+        /* leave the wait queue, readers queued behind us may go now */
+        list_del_init(&c->wait.node);
+        stats.curr_waiters--;
+        notify_block_conns(it);
+    }
+
+    c->lock_it = NULL;
+    c->flags = sess_init;
+
+    return;
+}
+
 void conn_close(struct conn *c)
 {
     assert(c != NULL);
@@ -166,29 +388,31 @@ void conn_close(struct conn *c)
     /* delete the event, the socket and the conn */
     event_del(&c->event);
 
-    if (settings.verbose > 0) {
-        fprintf(stderr, ">>>. %d connection closed.\n", c->sfd);
-    }
+    log_printf(LOGL_VERBOSE, ">>>. %d connection closed.\n", c->sfd);
 
     close(c->sfd);
+    ring_free(c);
 
-    if (c->flags == sess_lock && c->lock_key[0] != '\0') {
-        hashlist_setunlock(c->lock_key);
+    if (c->lock_it != NULL) {
+        trace_event(TRACE_CLOSE, c->id, c->sfd, c->lock_it->k.hv, c->wait.flags);
     }
-    
+
+    if (!list_empty(&c->watch.node)) {
+        list_del_init(&c->watch.node);
+        stats.watchers--;
+    }
+
+    /* a lock held under a session stays for the session to resume */
+    session_detach(c);
+    conn_unlock(c);
+
     stats.curr_conns--;
 
     conn_del_from_connslist(c);
 
-    notify_block_conns(c);
-
-    if (settings.verbose > 0) {
-        fprintf(stderr, ">>>. %d notify other %llu client.\n", c->sfd, stats.curr_conns);
-    }
+    log_printf(LOGL_VERBOSE, ">>>. %d notify other %llu client.\n", c->sfd, stats.curr_conns);
 
-    if (settings.verbose > 1) {
-        fprintf(stderr, ">>>. %d closed, hashlist count:[%d]\n", c->sfd, hashtable_count(g_hashlist));
-    }
+    log_printf(LOGL_DEBUG, ">>>. %d closed, hashlist count:[%d]\n", c->sfd, hashlist_count());
 
     conn_free(c);
 
@@ -9,14 +9,18 @@
 #ifndef _CONN_H_
 #define _CONN_H_
 
+#include <stdint.h>
+
 #include "event.h"
 #include "list.h"
+#include "item.h"
 
 enum conn_states {
     conn_listening,  /* the socket which listens for connections */
     conn_read,       /* reading in a command line */
     conn_write,      /* writing out a simple response */
     conn_wait,       /* wait block for connection */
+    conn_sync,       /* reply held until the journal is synced */
     conn_closing,    /* closing this connection */
 };
 
@@ -26,12 +30,14 @@ enum conn_session {
     sess_lock,   /* connection locked */
 };
 
+/*
+ * fields used on every event come first, buffers are only attached while
+ * there is partial input or pending output.
+ */
 struct conn {
-    struct list_head cnode;
     int    sfd;
-    int    state;  /* connection event state */
-    int    flags;  /* connection session state */
-    struct event event;
+    unsigned char state;  /* connection event state */
+    unsigned char flags;  /* connection session state */
     short  ev_flags;
     short  which;  /* which events were just triggered */
 
@@ -42,28 +48,54 @@ struct conn {
 
     char   *wbuf;  /* buffer to write commands resq */
     char   *wcurr; /* */
-    int    wsize;  /* total allocated size of wbuf */
     int    wbytes; /* how much data, starting from wcurr */
-
-    unsigned int cip;  /* client ip */
-    int    lock_cmd;   /* client cmd */
-    char   lock_key[64]; /* client cmd key */
+    int    wsize;  /* DATA_BUFFER_SIZE, unless a long reply needed more */
+
+    struct item_waiter wait; /* flags of the lock asked for, queued on the
+                                item we are blocked on or on the journal's
+                                held replies */
+    struct item_waiter watch; /* on the watchers of the item watched */
+    struct item *lock_it;    /* item locked or waited on, its key handle
+                                is reused for grant, unlock and handoff */
+    uint64_t stamp;          /* usec the lock was granted or the wait began */
+    uint32_t id;             /* unique per conn_new, for the trace */
+    uint64_t sync_lsn;       /* journal lsn a held reply waits for */
+    struct session *sess;    /* resumable session, NULL if none */
+    struct ring *ring;       /* shared memory transport, NULL on the socket */
+
+    struct list_head cnode;  /* connslist, listen_conn or the free list */
+    struct event event;
 };
 
 extern struct list_head connslist;
 
 void conn_init(void);
 
+int conn_prewarm(int num);
+
 void conn_close(struct conn *c);
 
-void conn_add_to_connslist(struct conn *c);
+void conn_unlock(struct conn *c);
+
+void conn_free(struct conn *c);
+
+bool conn_add_to_connslist(struct conn *c);
+
+void conn_del_from_connslist(struct conn *c);
+
+struct conn *conn_find(const int sfd);
 
 void conn_set_state(struct conn *c, int state);
 
 struct conn *conn_new(const int sfd, const int init_state,
-        const int event_flags, const int read_buffer_size,
-        struct event_base *base);
+        const int event_flags, struct event_base *base);
+
+bool conn_rbuf_alloc(struct conn *c);
+
+void conn_rbuf_release(struct conn *c);
+
+bool conn_wbuf_alloc(struct conn *c, int size);
 
-struct conn *conn_find_blocklist(struct conn *c);
+void conn_wbuf_release(struct conn *c);
 
 #endif
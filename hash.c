@@ -1,59 +1,263 @@
-/**
- * Copyright (c) 2012,
- *     tonglulin@gmail.com All rights reserved.
- *
- * Use, modification and distribution are subject to the "New BSD License"
- * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
- */
-
-#include <stdio.h>
-#include <string.h>
-
-unsigned int em_hash(const void * key, int len, unsigned int seed)
-{
-	/*
-     * 'm' and 'r' are mixing constants generated offline.
-	 * They're not really 'magic', they just happen to work well. 
-	 */
-	const unsigned int m = 0x5bd1e995;
-	const int r = 24;
-
-    /* Initialize the hash to a 'random' value */
-	unsigned int h = seed ^ len;
-
-	/* Mix 4 bytes at a time into the hash */
-	const unsigned char * data = (const unsigned char *)key;
-
-	while (len >= 4) {
-		unsigned int k = *(unsigned int *)data;
-
-		k *= m; 
-		k ^= k >> r; 
-		k *= m; 
-		
-		h *= m; 
-		h ^= k;
-
-		data += 4;
-		len -= 4;
-	}
-	
-    /* Handle the last few bytes of the input array */
-    switch (len) {
-        case 3: h ^= data[2] << 16;
-        case 2: h ^= data[1] << 8;
-        case 1: h ^= data[0];
-                h *= m;
-    };
-
-	/*
-     * Do a few final mixes of the hash to ensure the last few
-	 * bytes are well-incorporated. 
-	 */
-	h ^= h >> 13;
-	h *= m;
-	h ^= h >> 15;
-
-	return h;
-}
-
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hash.h"
+
+unsigned int hash_seed = 0;
+
+/*
+ * seed the table hash from the kernel, so that colliding keys can't be
+ * computed offline.
+ */
+void hash_init(void)
+{
+    int fd = -1;
+    unsigned int seed = 0;
+    struct timeval tv;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+            seed = 0;
+        }
+        close(fd);
+    }
+
+    if (seed == 0) {
+        gettimeofday(&tv, NULL);
+        seed = (unsigned int)(tv.tv_sec ^ tv.tv_usec ^ (getpid() << 16));
+    }
+
+    hash_seed = seed;
+
+    return;
+}
+
+unsigned int em_hash_murmur2(const void * key, int len, unsigned int seed)
+{
+	/*
+     * 'm' and 'r' are mixing constants generated offline.
+	 * They're not really 'magic', they just happen to work well.
+	 */
+	const unsigned int m = 0x5bd1e995;
+	const int r = 24;
+
+    /* Initialize the hash to a 'random' value */
+	unsigned int h = seed ^ len;
+
+	/* Mix 4 bytes at a time into the hash */
+	const unsigned char * data = (const unsigned char *)key;
+
+	while (len >= 4) {
+		unsigned int k = *(unsigned int *)data;
+
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+
+		h *= m;
+		h ^= k;
+
+		data += 4;
+		len -= 4;
+	}
+
+    /* Handle the last few bytes of the input array */
+    switch (len) {
+        case 3: h ^= data[2] << 16;
+        case 2: h ^= data[1] << 8;
+        case 1: h ^= data[0];
+                h *= m;
+    };
+
+	/*
+     * Do a few final mixes of the hash to ensure the last few
+	 * bytes are well-incorporated.
+	 */
+	h ^= h >> 13;
+	h *= m;
+	h ^= h >> 15;
+
+	return h;
+}
+
+/*
+ * wyhash (Wang Yi, public domain): one 64x64->128 multiply per 16 bytes,
+ * keys up to 16 bytes are read with at most four overlapping loads.
+ */
+static const uint64_t wysecret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static inline void wymum(uint64_t *a, uint64_t *b)
+{
+    __uint128_t r = *a;
+
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wyr8(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wyr4(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t wyr3(const unsigned char *p, size_t k)
+{
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+#ifdef __SSE2__
+/*
+ * keys of HASH_SIMD_MIN bytes and more: four 128-bit lanes accumulate
+ * (data ^ secret) lo32 * hi32 products over 64 byte stripes, in the
+ * manner of xxh3, then fold into the scalar state.
+ */
+#define HASH_SIMD_MIN 128
+
+static uint64_t wyhash_long_sse2(const unsigned char *p, size_t len, uint64_t seed)
+{
+    size_t i = 0;
+    uint64_t lanes[8];
+    __m128i acc[4];
+    __m128i key[4];
+
+    for (i = 0; i < 4; i++) {
+        key[i] = _mm_set_epi64x((long long)(wysecret[i] ^ seed),
+                (long long)(wysecret[3 - i] + seed));
+        acc[i] = key[i];
+    }
+
+    while (len >= 64) {
+        for (i = 0; i < 4; i++) {
+            __m128i d = _mm_loadu_si128((const __m128i *)(p + i * 16));
+            __m128i k = _mm_xor_si128(d, key[i]);
+            __m128i m = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+            acc[i] = _mm_add_epi64(acc[i], _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc[i] = _mm_add_epi64(acc[i], m);
+        }
+        p += 64;
+        len -= 64;
+    }
+
+    for (i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i *)&lanes[i * 2], acc[i]);
+    }
+
+    seed = wymix(lanes[0] ^ wysecret[0], lanes[1] ^ seed)
+         ^ wymix(lanes[2] ^ wysecret[1], lanes[3] ^ seed)
+         ^ wymix(lanes[4] ^ wysecret[2], lanes[5] ^ seed)
+         ^ wymix(lanes[6] ^ wysecret[3], lanes[7] ^ seed);
+
+    /* the tail, at most 63 bytes, goes through the scalar rounds */
+    while (len > 16) {
+        seed = wymix(wyr8(p) ^ wysecret[1], wyr8(p + 8) ^ seed);
+        p += 16;
+        len -= 16;
+    }
+
+    return seed;
+}
+#endif
+
+unsigned int em_hash_wyhash(const void *key, int len, unsigned int seed)
+{
+    const unsigned char *p = (const unsigned char *)key;
+    const unsigned char *end = p + len;
+    size_t i = (size_t)len;
+    uint64_t a = 0, b = 0;
+    uint64_t s = seed;
+
+    s ^= wymix(s ^ wysecret[0], wysecret[1]);
+
+    if (i <= 16) {
+        if (i >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((i >> 3) << 2));
+            b = (wyr4(p + i - 4) << 32) | wyr4(p + i - 4 - ((i >> 3) << 2));
+        }
+        else if (i > 0) {
+            a = wyr3(p, i);
+            b = 0;
+        }
+    }
+    else {
+#ifdef __SSE2__
+        if (i >= HASH_SIMD_MIN) {
+            /* leaves at most 16 bytes, covered by the final read below */
+            s = wyhash_long_sse2(p, i, s);
+            i = 0;
+        }
+#endif
+        if (i > 48) {
+            uint64_t see1 = s, see2 = s;
+            do {
+                s = wymix(wyr8(p) ^ wysecret[1], wyr8(p + 8) ^ s);
+                see1 = wymix(wyr8(p + 16) ^ wysecret[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ wysecret[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            s ^= see1 ^ see2;
+        }
+
+        while (i > 16) {
+            s = wymix(wyr8(p) ^ wysecret[1], wyr8(p + 8) ^ s);
+            i -= 16;
+            p += 16;
+        }
+
+        a = wyr8(end - 16);
+        b = wyr8(end - 8);
+    }
+
+    a ^= wysecret[1];
+    b ^= s;
+    wymum(&a, &b);
+
+    a = wymix(a ^ wysecret[0] ^ (uint64_t)len, b ^ wysecret[1]);
+
+    return (unsigned int)(a ^ (a >> 32));
+}
+
+unsigned int em_hash(const void *key, int len, unsigned int seed)
+{
+#ifdef HASH_MURMUR2
+    return em_hash_murmur2(key, len, seed);
+#else
+    return em_hash_wyhash(key, len, seed);
+#endif
+}
@@ -9,6 +9,16 @@
 #ifndef _HAHS_H_
 #define _HAHS_H_
 
+/* per-process random seed for the lock table, set by hash_init() */
+extern unsigned int hash_seed;
+
+void hash_init(void);
+
+/* wyhash by default, MurmurHash2 when built with -DHASH_MURMUR2 */
 unsigned int em_hash(const void * key, int len, unsigned int seed);
 
+unsigned int em_hash_murmur2(const void * key, int len, unsigned int seed);
+
+unsigned int em_hash_wyhash(const void * key, int len, unsigned int seed);
+
 #endif
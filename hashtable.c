@@ -132,9 +132,24 @@ hashtable_count(struct hashtable *h)
     return h->entrycount;
 }
 
+/*****************************************************************************/
+unsigned int
+hashtable_hash(struct hashtable *h, void *k)
+{
+    return hash(h,k);
+}
+
 /*****************************************************************************/
 int
 hashtable_insert(struct hashtable *h, void *k, void *v)
+{
+    return hashtable_insert_hashed(h,k,v,hash(h,k));
+}
+
+/*****************************************************************************/
+int
+hashtable_insert_hashed(struct hashtable *h, void *k, void *v,
+                        unsigned int hashvalue)
 {
     /* This method allows duplicate keys - but they shouldn't be used */
     unsigned int index;
@@ -149,7 +164,7 @@ hashtable_insert(struct hashtable *h, void *k, void *v)
     }
     e = (struct entry *)malloc(sizeof(struct entry));
     if (NULL == e) { --(h->entrycount); return 0; } /*oom*/
-    e->h = hash(h,k);
+    e->h = hashvalue;
     index = indexFor(h->tablelength,e->h);
     e->k = k;
     e->v = v;
@@ -161,10 +176,16 @@ hashtable_insert(struct hashtable *h, void *k, void *v)
 /*****************************************************************************/
 void * /* returns value associated with key */
 hashtable_search(struct hashtable *h, void *k)
+{
+    return hashtable_search_hashed(h,k,hash(h,k));
+}
+
+/*****************************************************************************/
+void * /* returns value associated with key */
+hashtable_search_hashed(struct hashtable *h, void *k, unsigned int hashvalue)
 {
     struct entry *e;
-    unsigned int hashvalue, index;
-    hashvalue = hash(h,k);
+    unsigned int index;
     index = indexFor(h->tablelength,hashvalue);
     e = h->table[index];
     while (NULL != e)
@@ -179,6 +200,13 @@ hashtable_search(struct hashtable *h, void *k)
 /*****************************************************************************/
 void * /* returns value associated with key */
 hashtable_remove(struct hashtable *h, void *k)
+{
+    return hashtable_remove_hashed(h,k,hash(h,k));
+}
+
+/*****************************************************************************/
+void * /* returns value associated with key */
+hashtable_remove_hashed(struct hashtable *h, void *k, unsigned int hashvalue)
 {
     /* TODO: consider compacting the table when the load factor drops enough,
      *       or provide a 'compact' method. */
@@ -186,10 +214,9 @@ hashtable_remove(struct hashtable *h, void *k)
     struct entry *e;
     struct entry **pE;
     void *v;
-    unsigned int hashvalue, index;
+    unsigned int index;
 
-    hashvalue = hash(h,k);
-    index = indexFor(h->tablelength,hash(h,k));
+    index = indexFor(h->tablelength,hashvalue);
     pE = &(h->table[index]);
     e = *pE;
     while (NULL != e)
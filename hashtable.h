@@ -81,7 +81,7 @@ create_hashtable(unsigned int minsize,
    
  * @name        hashtable_insert
  * @param   h   the hashtable to insert into
- * @param   k   the key - hashtable claims ownership and will free on removal
+ * @param   k   the key - does not claim ownership (see freekey)
  * @param   v   the value - does not claim ownership
  * @return      non-zero for successful insertion
  *
@@ -104,6 +104,26 @@ int fnname (struct hashtable *h, keytype *k, valuetype *v) \
     return hashtable_insert(h,k,v); \
 }
 
+/*****************************************************************************
+ * hashtable_hash
+   
+ * @name        hashtable_hash
+ * @param   h   the hashtable
+ * @param   k   the key
+ * @return      the hash value of k, to pass to the *_hashed functions
+ *
+ * The *_hashed variants of insert, search and remove take this value
+ * instead of hashing the key again, so a caller doing several operations
+ * on the same key only pays for the hash function once.
+ */
+
+unsigned int
+hashtable_hash(struct hashtable *h, void *k);
+
+int
+hashtable_insert_hashed(struct hashtable *h, void *k, void *v,
+                        unsigned int hashvalue);
+
 /*****************************************************************************
  * hashtable_search
    
@@ -116,6 +136,9 @@ int fnname (struct hashtable *h, keytype *k, valuetype *v) \
 void *
 hashtable_search(struct hashtable *h, void *k);
 
+void *
+hashtable_search_hashed(struct hashtable *h, void *k, unsigned int hashvalue);
+
 #define DEFINE_HASHTABLE_SEARCH(fnname, keytype, valuetype) \
 valuetype * fnname (struct hashtable *h, keytype *k) \
 { \
@@ -134,6 +157,9 @@ valuetype * fnname (struct hashtable *h, keytype *k) \
 void * /* returns value */
 hashtable_remove(struct hashtable *h, void *k);
 
+void * /* returns value */
+hashtable_remove_hashed(struct hashtable *h, void *k, unsigned int hashvalue);
+
 #define DEFINE_HASHTABLE_REMOVE(fnname, keytype, valuetype) \
 valuetype * fnname (struct hashtable *h, keytype *k) \
 { \
@@ -43,8 +43,9 @@ indexFor(unsigned int tablelength, unsigned int hashvalue)
 */
 
 /*****************************************************************************/
-#define freekey(X) free(X)
-/*define freekey(X) ; */
+/*#define freekey(X) free(X)*/
+/* keys are embedded in the values (struct item), they go with them */
+#define freekey(X) ;
 
 
 /*****************************************************************************/
@@ -0,0 +1,78 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hist.h"
+
+void hist_reset(struct histogram *h)
+{
+    memset(h, 0, sizeof(struct histogram));
+
+    return;
+}
+
+/* highest value that falls in bucket idx */
+static uint64_t hist_upper(unsigned int idx)
+{
+    unsigned int e = 0;
+    uint64_t sub = 0;
+
+    if (idx < HIST_SUB) {
+        return idx;
+    }
+
+    e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    sub = idx % HIST_SUB;
+
+    return ((HIST_SUB + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+/*
+ * value below which p percent of the recorded values fall, reported as
+ * the upper edge of its bucket and never above the recorded max.
+ */
+uint64_t hist_percentile(const struct histogram *h, double p)
+{
+    unsigned int i = 0;
+    uint64_t seen = 0, rank = 0, v = 0;
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t)(h->count * p / 100.0 + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            v = hist_upper(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+/* one line: name count mean p50 p90 p99 p99.9 max */
+int hist_format(const struct histogram *h, const char *name, char *buf, int size)
+{
+    return snprintf(buf, size,
+            "%s: count %llu mean %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu",
+            name, (unsigned long long)h->count,
+            (unsigned long long)(h->count ? h->sum / h->count : 0),
+            (unsigned long long)hist_percentile(h, 50.0),
+            (unsigned long long)hist_percentile(h, 90.0),
+            (unsigned long long)hist_percentile(h, 99.0),
+            (unsigned long long)hist_percentile(h, 99.9),
+            (unsigned long long)h->max);
+}
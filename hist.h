@@ -0,0 +1,61 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram: values below 2^HIST_SUB_BITS get a bucket each,
+ * every power of two above is split into 2^HIST_SUB_BITS linear buckets,
+ * so any value is known to within 1/16 (6.25%). Recording is a bit scan
+ * and an increment.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline unsigned int hist_index(uint64_t v)
+{
+    unsigned int e = 0;
+
+    if (v < HIST_SUB) {
+        return (unsigned int)v;
+    }
+
+    e = 63 - __builtin_clzll(v);
+
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB
+        + (unsigned int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void hist_record(struct histogram *h, uint64_t v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+void hist_reset(struct histogram *h);
+
+uint64_t hist_percentile(const struct histogram *h, double p);
+
+int hist_format(const struct histogram *h, const char *name, char *buf, int size);
+
+#endif
@@ -0,0 +1,249 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Contended keys, in bounded space: every block event bumps the key in a
+ * count-min sketch, and the HOTKEYS_TOPK keys with the highest estimates
+ * are kept in a min-heap along with their wait and hold times. Keys that
+ * never block cost nothing here.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "hotkeys.h"
+
+#define CMS_DEPTH 4
+#define CMS_WIDTH 4096  /* power of two */
+
+static unsigned int cms[CMS_DEPTH][CMS_WIDTH];
+
+static struct hotkey heap[HOTKEYS_TOPK];
+static int heap_len = 0;
+
+void hotkeys_init(void)
+{
+    memset(cms, 0, sizeof(cms));
+    heap_len = 0;
+
+    return;
+}
+
+void hotkeys_reset(void)
+{
+    int i = 0;
+
+    for (i = 0; i < heap_len; i++) {
+        free(heap[i].key);
+    }
+
+    hotkeys_init();
+
+    return;
+}
+
+/* row i uses h1 + i * h2, both derived from the key hash */
+static inline unsigned int cms_index(unsigned int hv, int i)
+{
+    unsigned int h2 = (hv * 0x9e3779b1u) | 1;
+
+    return (hv + i * h2) & (CMS_WIDTH - 1);
+}
+
+/* conservative update: only raise the counters that hold the minimum */
+static unsigned int cms_add(unsigned int hv)
+{
+    int i = 0;
+    unsigned int idx[CMS_DEPTH];
+    unsigned int min = (unsigned int)-1;
+
+    for (i = 0; i < CMS_DEPTH; i++) {
+        idx[i] = cms_index(hv, i);
+        if (cms[i][idx[i]] < min) {
+            min = cms[i][idx[i]];
+        }
+    }
+
+    min++;
+
+    for (i = 0; i < CMS_DEPTH; i++) {
+        if (cms[i][idx[i]] < min) {
+            cms[i][idx[i]] = min;
+        }
+    }
+
+    return min;
+}
+
+static int heap_find(const struct item_key *ik)
+{
+    int i = 0;
+
+    for (i = 0; i < heap_len; i++) {
+        if (heap[i].hv == ik->hv && heap[i].nkey == ik->nkey
+                && memcmp(heap[i].key, ik->key, ik->nkey) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void heap_swap(int a, int b)
+{
+    struct hotkey t = heap[a];
+
+    heap[a] = heap[b];
+    heap[b] = t;
+
+    return;
+}
+
+static void heap_down(int i)
+{
+    int l = 0, r = 0, m = 0;
+
+    for (;;) {
+        l = i * 2 + 1;
+        r = l + 1;
+        m = i;
+
+        if (l < heap_len && heap[l].waits < heap[m].waits) {
+            m = l;
+        }
+        if (r < heap_len && heap[r].waits < heap[m].waits) {
+            m = r;
+        }
+        if (m == i) {
+            return;
+        }
+
+        heap_swap(i, m);
+        i = m;
+    }
+}
+
+static void heap_up(int i)
+{
+    int p = 0;
+
+    while (i > 0) {
+        p = (i - 1) / 2;
+        if (heap[p].waits <= heap[i].waits) {
+            return;
+        }
+        heap_swap(i, p);
+        i = p;
+    }
+
+    return;
+}
+
+void hotkeys_block(const struct item_key *ik)
+{
+    int i = 0;
+    char *key = NULL;
+    unsigned int est = 0;
+
+    est = cms_add(ik->hv);
+
+    i = heap_find(ik);
+    if (i >= 0) {
+        heap[i].waits = est;
+        heap_down(i);
+        return;
+    }
+
+    if (heap_len == HOTKEYS_TOPK && est <= heap[0].waits) {
+        return;
+    }
+
+    key = (char *)malloc(ik->nkey + 1);
+    if (key == NULL) {
+        return;
+    }
+    memcpy(key, ik->key, ik->nkey);
+    key[ik->nkey] = '\0';
+
+    if (heap_len == HOTKEYS_TOPK) {
+        /* evict the coldest of the hot keys */
+        free(heap[0].key);
+        i = 0;
+    }
+    else {
+        i = heap_len++;
+    }
+
+    heap[i].key = key;
+    heap[i].nkey = ik->nkey;
+    heap[i].hv = ik->hv;
+    heap[i].waits = est;
+    heap[i].wait_usec = 0;
+    heap[i].hold_usec = 0;
+
+    if (i == 0) {
+        heap_down(0);
+    }
+    else {
+        heap_up(i);
+    }
+
+    return;
+}
+
+void hotkeys_wait(const struct item_key *ik, uint64_t usec)
+{
+    int i = heap_find(ik);
+
+    if (i >= 0) {
+        heap[i].wait_usec += usec;
+    }
+
+    return;
+}
+
+void hotkeys_hold(const struct item_key *ik, uint64_t usec)
+{
+    int i = heap_find(ik);
+
+    if (i >= 0) {
+        heap[i].hold_usec += usec;
+    }
+
+    return;
+}
+
+static int hotkey_cmp(const void *a, const void *b)
+{
+    const struct hotkey *ha = *(const struct hotkey * const *)a;
+    const struct hotkey *hb = *(const struct hotkey * const *)b;
+
+    if (ha->waits != hb->waits) {
+        return ha->waits < hb->waits ? 1 : -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fills top with up to num of the hottest keys, hottest first.
+ * the entries stay owned by the heap and are valid until the next event.
+ */
+int hotkeys_top(struct hotkey **top, int num)
+{
+    int i = 0;
+
+    for (i = 0; i < heap_len; i++) {
+        top[i] = &heap[i];
+    }
+
+    qsort(top, heap_len, sizeof(struct hotkey *), hotkey_cmp);
+
+    return heap_len < num ? heap_len : num;
+}
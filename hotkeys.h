@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _HOTKEYS_H_
+#define _HOTKEYS_H_
+
+#include <stdint.h>
+
+#include "item.h"
+
+#define HOTKEYS_TOPK 32
+
+struct hotkey {
+    char         *key;
+    unsigned int nkey;
+    unsigned int hv;
+    unsigned int waits;      /* estimated block events, from the sketch */
+    uint64_t     wait_usec;  /* time waiters spent blocked before the grant */
+    uint64_t     hold_usec;  /* time holders kept it while others waited */
+};
+
+void hotkeys_init(void);
+
+void hotkeys_reset(void);
+
+void hotkeys_block(const struct item_key *ik);
+
+void hotkeys_wait(const struct item_key *ik, uint64_t usec);
+
+void hotkeys_hold(const struct item_key *ik, uint64_t usec);
+
+int hotkeys_top(struct hotkey **top, int num);
+
+#endif
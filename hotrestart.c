@@ -0,0 +1,624 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Hot restart: a new binary takes over a running memlockd without
+ * dropping a connection or a lock.
+ *
+ * Both are started with -H <path>. The new process connects to the old
+ * one on that unix socket before it binds anything. The old one drains
+ * its journal, then sends, blocking and all at once, the lock table, the
+ * session of every connection (state, lock flags, the key held or waited
+ * on in queue order, unparsed input and unsent output) and, through
+ * SCM_RIGHTS, the listening and client sockets. Once the new process has
+ * rebuilt its conns it answers one byte, the old one leaves its event
+ * loop and exits, and the new one carries on from its own -H listener.
+ *
+ * If the new process goes away before answering, the old one keeps
+ * serving as if nothing happened; nothing it owns was touched.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "hotrestart.h"
+
+#define HOT_FDS_PER_MSG 128
+#define HOT_TIMEOUT 10  /* seconds either side waits for the other */
+
+struct hot_buf {
+    char   *p;
+    size_t len;
+    size_t size;
+};
+
+static int hot_fd = -1;
+static struct event hot_ev;
+
+static int hot_took = 0;      /* the table came from a predecessor */
+static uint64_t hot_lsn = 0;  /* journal lsn of that table */
+
+static int hot_buf_add(struct hot_buf *b, const void *data, size_t len)
+{
+    size_t ns = 0;
+    char *np = NULL;
+
+    if (b->len + len > b->size) {
+        ns = b->size ? b->size : 4096;
+        while (ns < b->len + len) {
+            ns *= 2;
+        }
+        np = (char *)realloc(b->p, ns);
+        if (np == NULL) {
+            return -1;
+        }
+        b->p = np;
+        b->size = ns;
+    }
+
+    memcpy(b->p + b->len, data, len);
+    b->len += len;
+
+    return 0;
+}
+
+static int write_all(int fd, const char *p, size_t len)
+{
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, char *p, size_t len)
+{
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int send_fds(int fd, const int *fds, int n)
+{
+    int k = 0;
+    char byte = 'F';
+    char cbuf[CMSG_SPACE(sizeof(int) * HOT_FDS_PER_MSG)];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm = NULL;
+
+    for (; n > 0; fds += k, n -= k) {
+        k = n < HOT_FDS_PER_MSG ? n : HOT_FDS_PER_MSG;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * k);
+
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * k);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * k);
+
+        if (sendmsg(fd, &msg, 0) != 1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int recv_fds(int fd, int *fds, int n)
+{
+    int k = 0;
+    char byte = 0;
+    char cbuf[CMSG_SPACE(sizeof(int) * HOT_FDS_PER_MSG)];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm = NULL;
+
+    for (; n > 0; fds += k, n -= k) {
+        k = n < HOT_FDS_PER_MSG ? n : HOT_FDS_PER_MSG;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+            return -1;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (cm == NULL || cm->cmsg_type != SCM_RIGHTS
+                || cm->cmsg_len != CMSG_LEN(sizeof(int) * k)) {
+            return -1;
+        }
+        memcpy(fds, CMSG_DATA(cm), sizeof(int) * k);
+    }
+
+    return 0;
+}
+
+static int hot_add_conn(struct hot_buf *b, struct conn *c)
+{
+    struct hot_conn hc;
+
+    memset(&hc, 0, sizeof(hc));
+    hc.state = c->state;
+    hc.flags = c->flags;
+    hc.nkey = c->lock_it != NULL ? c->lock_it->k.nkey : 0;
+    hc.lock_cmd = c->wait.flags;
+    hc.rbytes = c->rbuf != NULL ? c->rbytes : 0;
+    hc.wbytes = c->wbuf != NULL ? c->wbytes : 0;
+    hc.stamp = c->stamp;
+
+    if (hot_buf_add(b, &hc, sizeof(hc)) != 0
+            || hot_buf_add(b, c->lock_it != NULL ? c->lock_it->k.key : "", hc.nkey) != 0
+            || hot_buf_add(b, c->rcurr, hc.rbytes) != 0
+            || hot_buf_add(b, c->wcurr, hc.wbytes) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+struct hot_walk {
+    struct hot_buf *b;
+    int  *fds;
+    int  n;
+    int  err;
+};
+
+/* waiters go in queue order, so the new process queues them the same */
+static void hot_waiters_fn(struct item *it, void *arg)
+{
+    struct hot_walk *w = (struct hot_walk *)arg;
+    struct list_head *pos = NULL;
+    struct conn *c = NULL;
+
+    list_for_each(pos, &it->waiters) {
+        c = list_entry(pos, struct conn, wait.node);
+        if (hot_add_conn(w->b, c) != 0) {
+            w->err = 1;
+        }
+        w->fds[w->n++] = c->sfd;
+    }
+
+    return;
+}
+
+/* old side: hand everything to the process connected on fd */
+static int hot_handover(int fd)
+{
+    int ret = -1, nlisten = 0, nconns = 0;
+    int *fds = NULL;
+    char ack = 0;
+    char *image = NULL;
+    unsigned int count = 0;
+    size_t size = 0;
+    uint64_t lsn = 0;
+    struct hot_buf b = {NULL, 0, 0};
+    struct hot_walk w;
+    struct hot_hdr h;
+    struct list_head *pos = NULL, *n = NULL;
+    struct conn *c = NULL;
+
+    /*
+     * ring regions do not move over, their clients connect again. the
+     * items watched are rebuilt from the image without their watchers,
+     * those are told to watch again.
+     */
+    list_for_each_safe(pos, n, &connslist) {
+        c = list_entry(pos, struct conn, cnode);
+        if (c->ring != NULL) {
+            conn_close(c);
+        }
+        else if (!list_empty(&c->watch.node)) {
+            list_del_init(&c->watch.node);
+            stats.watchers--;
+            out_string(c, "-ERR, watch cancelled");
+        }
+    }
+
+    /* no held replies and nothing unsynced left behind */
+    journal_commit();
+    journal_drain();
+    lsn = journal_lsn();
+
+    list_for_each(pos, &listen_conn) {
+        nlisten++;
+    }
+    list_for_each(pos, &connslist) {
+        nconns++;
+    }
+
+    fds = (int *)malloc(sizeof(int) * (nlisten + nconns + 1));
+    size = snapshot_size(&count);
+    image = (char *)calloc(1, size);
+    if (fds == NULL || image == NULL) {
+        log_printf(LOGL_ERROR, "hot restart: out of memory\n");
+        goto done;
+    }
+
+    snapshot_fill(image, size, count, lsn);
+
+    memset(&w, 0, sizeof(w));
+    w.b = &b;
+    w.fds = fds;
+
+    list_for_each(pos, &listen_conn) {
+        c = list_entry(pos, struct conn, cnode);
+        w.fds[w.n++] = c->sfd;
+    }
+
+    list_for_each(pos, &connslist) {
+        c = list_entry(pos, struct conn, cnode);
+        if (c->flags == sess_block) {
+            continue;
+        }
+        if (hot_add_conn(&b, c) != 0) {
+            w.err = 1;
+        }
+        w.fds[w.n++] = c->sfd;
+    }
+
+    hashlist_walk(hot_waiters_fn, &w);
+
+    if (w.err || w.n != nlisten + nconns) {
+        log_printf(LOGL_ERROR, "hot restart: failed to serialize %d conns\n", nconns);
+        goto done;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, HOT_MAGIC, sizeof(h.magic));
+    h.nlisten = nlisten;
+    h.nconns = nconns;
+    h.image_size = size;
+    h.conn_size = b.len;
+
+    if (write_all(fd, (char *)&h, sizeof(h)) != 0
+            || write_all(fd, image, size) != 0
+            || write_all(fd, b.p, b.len) != 0
+            || send_fds(fd, fds, w.n) != 0) {
+        log_printf(LOGL_ERROR, "hot restart: handover failed: %s\n", strerror(errno));
+        goto done;
+    }
+
+    if (read(fd, &ack, 1) != 1) {
+        log_printf(LOGL_ERROR, "hot restart: the new process did not take over\n");
+        goto done;
+    }
+
+    log_printf(LOGL_ERROR, "hot restart: handed %d conns and %u locks over at lsn %llu\n",
+            nconns, count, (unsigned long long)lsn);
+    ret = 0;
+
+done:
+    free(fds);
+    free(image);
+    free(b.p);
+
+    return ret;
+}
+
+static void hot_accept(const int fd, const short which, void *arg)
+{
+    int sfd = -1, flags = 0;
+    struct timeval tv = {HOT_TIMEOUT, 0};
+    struct list_head *pos = NULL;
+
+    sfd = accept(fd, NULL, NULL);
+    if (sfd < 0) {
+        return;
+    }
+
+    /* the whole handover is done here, blocking, nothing else may run */
+    flags = fcntl(sfd, F_GETFL, 0);
+    fcntl(sfd, F_SETFL, flags & ~O_NONBLOCK);
+    setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv));
+    setsockopt(sfd, SOL_SOCKET, SO_SNDTIMEO, (void *)&tv, sizeof(tv));
+
+    if (hot_handover(sfd) != 0) {
+        close(sfd);
+        return;
+    }
+
+    /* not another command here, the rest of this loop iteration included */
+    list_for_each(pos, &listen_conn) {
+        event_del(&list_entry(pos, struct conn, cnode)->event);
+    }
+    list_for_each(pos, &connslist) {
+        event_del(&list_entry(pos, struct conn, cnode)->event);
+    }
+
+    /* sfd stays open, the successor waits for it to close at our exit */
+    daemon_quit = 1;
+    event_base_loopbreak(main_base);
+
+    return;
+}
+
+/* new side: rebuild one conn from its record, fd is its socket */
+static int hot_restore_conn(const struct hot_conn *hc, const char *p, int fd,
+        struct event_base *base)
+{
+    int ev = hc->state == conn_write ? EV_WRITE | EV_PERSIST : EV_READ | EV_PERSIST;
+    const char *key = p;
+    struct item_key ik;
+    struct conn *c = NULL;
+
+    c = conn_new(fd, hc->state, ev, base);
+    if (c == NULL) {
+        return -1;
+    }
+
+    if (!conn_add_to_connslist(c)) {
+        event_del(&c->event);
+        conn_free(c);
+        return -1;
+    }
+
+    stats.curr_conns++;
+
+    c->wait.flags = hc->lock_cmd;
+    c->stamp = hc->stamp;
+    p += hc->nkey;
+
+    if (hc->rbytes > 0) {
+        if (!conn_rbuf_alloc(c)) {
+            return -1;
+        }
+        if (hc->rbytes > (uint32_t)c->rsize) {
+            conn_rbuf_release(c);
+            c->rbuf = c->rcurr = (char *)malloc(hc->rbytes);
+            if (c->rbuf == NULL) {
+                return -1;
+            }
+            c->rsize = hc->rbytes;
+        }
+        memcpy(c->rbuf, p, hc->rbytes);
+        c->rbytes = hc->rbytes;
+        p += hc->rbytes;
+    }
+
+    if (hc->wbytes > 0) {
+        if (!conn_wbuf_alloc(c, hc->wbytes)) {
+            return -1;
+        }
+        memcpy(c->wbuf, p, hc->wbytes);
+        c->wbytes = hc->wbytes;
+    }
+
+    if (hc->nkey == 0 || hc->flags == sess_init) {
+        return 0;
+    }
+
+    item_key_init(&ik, key, hc->nkey);
+    c->lock_it = hashlist_findlock(&ik);
+    if (c->lock_it == NULL) {
+        return -1;
+    }
+
+    c->flags = hc->flags;
+    if (c->flags == sess_block) {
+        list_add_tail(&c->wait.node, &c->lock_it->waiters);
+        stats.curr_waiters++;
+    }
+    else {
+        /* owned, not an orphan: hidden from the adoption below */
+        c->lock_it->ref--;
+    }
+
+    return 0;
+}
+
+/*
+ * new side: take over from the process listening on path. returns 1 if
+ * it did, 0 if there is nobody to take over from, -1 on failure.
+ */
+int hotrestart_takeover(const char *path, struct event_base *base)
+{
+    int fd = -1, ret = -1, i = 0;
+    int *fds = NULL;
+    char ack = 'A';
+    char *image = NULL, *cbuf = NULL, *p = NULL;
+    long n = 0;
+    struct sockaddr_un addr;
+    struct timeval tv = {HOT_TIMEOUT, 0};
+    struct hot_hdr h;
+    struct hot_conn hc;
+    struct list_head *pos = NULL;
+    struct conn *c = NULL;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return (errno == ENOENT || errno == ECONNREFUSED) ? 0 : -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (void *)&tv, sizeof(tv));
+
+    if (read_all(fd, (char *)&h, sizeof(h)) != 0
+            || memcmp(h.magic, HOT_MAGIC, sizeof(h.magic)) != 0) {
+        fprintf(stderr, "no hot restart handover on %s\n", path);
+        goto done;
+    }
+
+    image = (char *)malloc(h.image_size);
+    cbuf = (char *)malloc(h.conn_size + 1);
+    fds = (int *)malloc(sizeof(int) * (h.nlisten + h.nconns + 1));
+    if (image == NULL || cbuf == NULL || fds == NULL) {
+        fprintf(stderr, "hot restart: out of memory\n");
+        goto done;
+    }
+
+    if (read_all(fd, image, h.image_size) != 0
+            || read_all(fd, cbuf, h.conn_size) != 0
+            || recv_fds(fd, fds, h.nlisten + h.nconns) != 0) {
+        fprintf(stderr, "hot restart: handover from %s cut short\n", path);
+        goto done;
+    }
+
+    n = snapshot_restore(image, h.image_size, &hot_lsn);
+    if (n < 0) {
+        fprintf(stderr, "hot restart: bad lock table image\n");
+        goto done;
+    }
+
+    for (i = 0; i < (int)h.nlisten; i++) {
+        c = conn_new(fds[i], conn_listening, EV_READ | EV_PERSIST, base);
+        if (c == NULL) {
+            goto done;
+        }
+        list_add(&c->cnode, &listen_conn);
+    }
+
+    for (p = cbuf; i < (int)(h.nlisten + h.nconns); i++) {
+        memcpy(&hc, p, sizeof(hc));
+        p += sizeof(hc);
+        if (hot_restore_conn(&hc, p, fds[i], base) != 0) {
+            fprintf(stderr, "hot restart: failed to restore a connection\n");
+            goto done;
+        }
+        p += hc.nkey + hc.rbytes + hc.wbytes;
+    }
+
+    /*
+     * holds no conn owns are orphans, as after a restart. a standby's are
+     * the primary's, they are adopted if it is promoted.
+     */
+    if (settings.repl_primary == NULL) {
+        snapshot_adopt();
+    }
+    list_for_each(pos, &connslist) {
+        c = list_entry(pos, struct conn, cnode);
+        if (c->flags == sess_lock) {
+            c->lock_it->ref++;
+        }
+    }
+
+    if (write(fd, &ack, 1) != 1) {
+        fprintf(stderr, "hot restart: handover from %s not acknowledged\n", path);
+        goto done;
+    }
+
+    /* the old process closes its end when it exits, its ports are free then */
+    tv.tv_sec = HOT_TIMEOUT * 3;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv));
+    while (read(fd, &ack, 1) > 0) {
+        continue;
+    }
+
+    log_printf(LOGL_ERROR, "hot restart: took over %u conns and %ld locks at lsn %llu\n",
+            h.nconns, n, (unsigned long long)hot_lsn);
+
+    hot_took = 1;
+    ret = 1;
+
+done:
+    close(fd);
+    free(image);
+    free(cbuf);
+    free(fds);
+
+    return ret;
+}
+
+/* 1 and the journal lsn of the table if it came from a predecessor */
+int hotrestart_taken(uint64_t *lsn)
+{
+    *lsn = hot_lsn;
+
+    return hot_took;
+}
+
+/* wait on path for a successor */
+int hotrestart_init(const char *path, struct event_base *base)
+{
+    int flags = 0;
+    struct sockaddr_un addr;
+
+    hot_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (hot_fd < 0) {
+        fprintf(stderr, "socket(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    unlink(path);
+
+    flags = fcntl(hot_fd, F_GETFL, 0);
+    if (fcntl(hot_fd, F_SETFL, flags | O_NONBLOCK) < 0
+            || bind(hot_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(hot_fd, 1) != 0) {
+        fprintf(stderr, "hot restart bind()/listen() %s: %s\n", path, strerror(errno));
+        close(hot_fd);
+        return -1;
+    }
+
+    event_set(&hot_ev, hot_fd, EV_READ | EV_PERSIST, hot_accept, NULL);
+    event_base_set(base, &hot_ev);
+    if (event_add(&hot_ev, NULL) == -1) {
+        fprintf(stderr, "failed to add hot restart event\n");
+        return -1;
+    }
+
+    return 0;
+}
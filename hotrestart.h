@@ -0,0 +1,49 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _HOTRESTART_H_
+#define _HOTRESTART_H_
+
+#include <stdint.h>
+
+#include "event.h"
+
+#define HOT_MAGIC "MLHOT001"
+
+/*
+ * old to new process over the unix socket: hot_hdr, the lock table as a
+ * snapshot image, nconns hot_conn records each followed by its key, the
+ * unparsed input and the unsent output, then the listening and the
+ * client fds in that order, passed with SCM_RIGHTS. the new process
+ * answers one byte once it has taken everything over.
+ */
+struct hot_hdr {
+    char     magic[8];
+    uint32_t nlisten;
+    uint32_t nconns;
+    uint64_t image_size;
+    uint64_t conn_size;   /* bytes of hot_conn records and their data */
+};
+
+struct hot_conn {
+    uint8_t  state;
+    uint8_t  flags;       /* sess_init, sess_block or sess_lock */
+    uint16_t nkey;        /* key locked or waited on, 0 for none */
+    int32_t  lock_cmd;
+    uint32_t rbytes;
+    uint32_t wbytes;
+    uint64_t stamp;
+};
+
+int hotrestart_takeover(const char *path, struct event_base *base);
+
+int hotrestart_taken(uint64_t *lsn);
+
+int hotrestart_init(const char *path, struct event_base *base);
+
+#endif
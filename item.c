@@ -13,14 +13,71 @@
 #include <time.h>
 
 #include "hash.h"
-#include "hashtable.h"
-#include "common.h"
+#include "log.h"
 #include "item.h"
+#include "keyindex.h"
 
-struct hashtable *g_hashlist = NULL;
+struct itemtable g_hashlist;
+uint64_t g_fence = 0;
 
-static struct item *item_init(const char *key, int flags)
+/* the same items in key order, kept only once hashlist_index_init() ran */
+static struct keyindex g_keyindex;
+static int ordered = 0;
+
+void (*item_change_hook)(int type, const struct item *it) = NULL;
+void (*item_watch_hook)(struct item_waiter *w, const struct item *it, int event) = NULL;
+
+/* restored holds nobody owns yet, released by hashlist_release_orphans() */
+struct orphan {
+    struct item *it;
+    int    refs;
+};
+
+/* the policy of new items: the first rule whose prefix matches, or fair */
+struct fair_rule {
+    char   *prefix;
+    size_t nprefix;
+    int    policy;
+};
+
+static struct fair_rule fair_rules[ITEM_FAIR_RULES];
+static int nfair_rules = 0;
+static int fair = ITEM_FAIR_READER;
+
+static struct orphan *orphans = NULL;
+static unsigned int norphans = 0;
+static unsigned int sorphans = 0;
+
+void item_key_init(struct item_key *ik, const char *key, size_t nkey)
+{
+    ik->key = key;
+    ik->nkey = nkey;
+    ik->hv = em_hash(key, nkey, hash_seed);
+
+    return;
+}
+
+static int item_fair_policy(const struct item_key *ik)
+{
+    int  i = 0;
+
+    for (i = 0; i < nfair_rules; i++) {
+        if (ik->nkey >= fair_rules[i].nprefix
+                && memcmp(ik->key, fair_rules[i].prefix, fair_rules[i].nprefix) == 0) {
+            return fair_rules[i].policy;
+        }
+    }
+
+    return fair;
+}
+
+/*
+ * the item carries its key handle, so the key is neither copied nor
+ * hashed again once the item exists.
+ */
+static struct item *item_init(const struct item_key *ik, int flags)
 {
+    char *k = NULL;
     struct item *it = NULL;
 
     it = (struct item *)calloc(1, sizeof(struct item));
@@ -28,29 +85,66 @@ static struct item *item_init(const char *key, int flags)
         return NULL;
     }
 
-    snprintf(it->key, sizeof(it->key), "%s", key);
-    it->val = flags;
+    if (ik->nkey < ITEM_KEY_INLINE) {
+        k = it->inl;
+    }
+    else {
+        k = (char *)malloc(ik->nkey + 1);
+        if (k == NULL) {
+            free(it);
+            return NULL;
+        }
+    }
+
+    memcpy(k, ik->key, ik->nkey);
+    k[ik->nkey] = '\0';
+
+    it->k.key = k;
+    it->k.nkey = ik->nkey;
+    it->k.hv = ik->hv;
+
+    it->val = flags & ~EM_DURABLE;  /* a property of the reply, not the lock */
     it->ref = 1;
     it->exp = time(NULL);
+    it->gen = ++g_fence;
+    it->fair = item_fair_policy(ik);
+    INIT_LIST_HEAD(&it->waiters);
+    INIT_LIST_HEAD(&it->watchers);
 
     return it;
 }
 
-static unsigned int hashfromkey(void *k)
+/* every watch on it fires once, and is done with */
+static void item_fire_watchers(struct item *it, int event)
 {
-    return em_hash(k, strlen(k), 0);
+    struct item_waiter *w = NULL;
+
+    while (!list_empty(&it->watchers)) {
+        w = list_entry(it->watchers.next, struct item_waiter, node);
+        list_del_init(&w->node);
+        if (item_watch_hook != NULL) {
+            item_watch_hook(w, it, event);
+        }
+    }
+
+    return;
 }
 
-static int equalkeys(void *k1, void *k2)
+static void item_free(struct item *it)
 {
-    return (strcmp(k1, k2) == 0);
+    if (it->k.nkey >= ITEM_KEY_INLINE) {
+        free((char *)it->k.key);
+    }
+
+    free(it);
+
+    return;
 }
 
 void hashlist_init(void)
 {
-    g_hashlist = create_hashtable(65535, hashfromkey, equalkeys);
-    if (g_hashlist == NULL) {
-        fprintf(stderr, "create_hashtable(): init fatal error\n");
+    if (itemtable_init(&g_hashlist, 65536) != 0) {
+        fprintf(stderr, "itemtable_init(): init fatal error\n");
         exit(EXIT_FAILURE);
     }
 
@@ -59,48 +153,392 @@ void hashlist_init(void)
 
 void hashlist_close(void)
 {
-    hashtable_destroy(g_hashlist, 1);
+    keyindex_destroy(&g_keyindex);
+    itemtable_destroy(&g_hashlist, item_free);
+
+    /* the orphans went with the table */
+    free(orphans);
+    orphans = NULL;
+    norphans = sorphans = 0;
+
+    return;
 }
 
 /*
+ * keep the items in key order as well, for hashlist_scan(). call it
+ * before the table is filled, items already in it are not indexed.
+ */
+void hashlist_index_init(void)
+{
+    ordered = 1;
+
+    return;
+}
+
+/*
+ * the ITEM_FAIR_* policy of keys under prefix, or of all others with a
+ * NULL prefix. rules are tried in the order they were added. items that
+ * exist keep the policy they were created with.
+ * returns 0, or -1 if there are too many rules or no memory.
+ */
+int hashlist_fairness(const char *prefix, size_t nprefix, int policy)
+{
+    char *p = NULL;
+
+    if (prefix == NULL) {
+        fair = policy;
+        return 0;
+    }
+
+    if (nfair_rules == ITEM_FAIR_RULES) {
+        return -1;
+    }
+
+    p = (char *)malloc(nprefix + 1);
+    if (p == NULL) {
+        return -1;
+    }
+
+    memcpy(p, prefix, nprefix);
+    p[nprefix] = '\0';
+
+    fair_rules[nfair_rules].prefix = p;
+    fair_rules[nfair_rules].nprefix = nprefix;
+    fair_rules[nfair_rules].policy = policy;
+    nfair_rules++;
+
+    return 0;
+}
+
+/* put a new item in the table, and in the index if there is one */
+static int hashlist_insert(struct item *it)
+{
+    if (ordered && keyindex_insert(&g_keyindex, it) != 0) {
+        return -1;
+    }
+
+    itemtable_insert(&g_hashlist, it);
+
+    return 0;
+}
+
+unsigned int hashlist_count(void)
+{
+    return itemtable_count(&g_hashlist);
+}
+
+/* grow the table ahead of inserting count items */
+void hashlist_reserve(unsigned int count)
+{
+    while (g_hashlist.loadlimit < count && g_hashlist.loadlimit != (unsigned int)-1) {
+        itemtable_expand(&g_hashlist);
+    }
+
+    return;
+}
+
+/*
+ * recreate an item from a snapshot or journal, held ref times by nobody.
+ * the caller checks that the key is not in the table yet. nothing is
+ * journaled.
+ */
+struct item *hashlist_restore(const struct item_key *ik, int val, int ref,
+        time_t exp, uint64_t gen)
+{
+    struct item *it = NULL;
+
+    it = item_init(ik, val);
+    if (it == NULL) {
+        return NULL;
+    }
+
+    it->ref = ref;
+    it->exp = exp;
+    it->gen = gen;
+    if (gen > g_fence) {
+        g_fence = gen;
+    }
+
+    if (hashlist_insert(it) != 0) {
+        item_free(it);
+        return NULL;
+    }
+
+    return it;
+}
+
+static void hashlist_adopt_fn(struct item *it, void *arg)
+{
+    unsigned int ns = 0;
+    struct orphan *no = NULL;
+
+    if (it->ref <= 0) {
+        return;
+    }
+
+    if (norphans == sorphans) {
+        ns = sorphans ? sorphans * 2 : 1024;
+        no = (struct orphan *)realloc(orphans, ns * sizeof(struct orphan));
+        if (no == NULL) {
+            /* left held for good rather than released early */
+            return;
+        }
+        orphans = no;
+        sorphans = ns;
+    }
+
+    orphans[norphans].it = it;
+    orphans[norphans].refs = it->ref;
+    norphans++;
+
+    return;
+}
+
+/*
+ * after a restore every hold in the table belongs to nobody, remember
+ * them for hashlist_release_orphans(). returns how many items.
+ */
+unsigned int hashlist_adopt_orphans(void)
+{
+    hashlist_walk(hashlist_adopt_fn, NULL);
+
+    return norphans;
+}
+
+/*
+ * drop the holds restored by hashlist_restore() and hand the items over
+ * to whoever queued on them meanwhile with notify(). returns the number
+ * released.
+ */
+unsigned int hashlist_release_orphans(void (*notify)(struct item *it))
+{
+    int k = 0;
+    unsigned int i = 0, n = norphans;
+    struct item *it = NULL;
+
+    for (i = 0; i < n; i++) {
+        it = orphans[i].it;
+        for (k = 0; k < orphans[i].refs; k++) {
+            ITEM_CHANGE(ITEM_EXPIRE, it);
+            if (hashlist_unref(it) == 0) {
+                it = NULL;
+                break;
+            }
+        }
+        if (it != NULL) {
+            notify(it);
+        }
+    }
+
+    free(orphans);
+    orphans = NULL;
+    norphans = sorphans = 0;
+
+    return n;
+}
+
+/* calls fn on every item, fn must not add or remove items */
+void hashlist_walk(void (*fn)(struct item *it, void *arg), void *arg)
+{
+    unsigned int i = 0;
+    struct item *it = NULL;
+
+    for (i = 0; g_hashlist.buckets != NULL && i <= g_hashlist.mask; i++) {
+        for (it = g_hashlist.buckets[i]; it != NULL; it = it->h_next) {
+            fn(it, arg);
+        }
+    }
+
+    return;
+}
+
+/* the first writer queued on it, NULL if only readers wait */
+static struct item_waiter *item_writer_waiting(struct item *it)
+{
+    struct list_head *pos = NULL;
+    struct item_waiter *w = NULL;
+
+    list_for_each(pos, &it->waiters) {
+        w = list_entry(pos, struct item_waiter, node);
+        if (EM_WRITE & w->flags) {
+            return w;
+        }
+    }
+
+    return NULL;
+}
+
+/* one more reference on it in the mode of flags, admitted already */
+static void item_grant(struct item *it, int flags)
+{
+    int  mode = 0;
+
+    if (it->ref == 0) {
+        mode = (it->val ^ flags) & EM_WRITE;
+        it->val = flags & ~EM_DURABLE;
+        it->ref = 1;
+        it->gen = ++g_fence;
+        ITEM_CHANGE(ITEM_GRANT, it);
+        if (mode) {
+            item_fire_watchers(it, ITEM_WATCH_MODE);
+        }
+        return;
+    }
+
+    it->ref++;
+    it->gen = ++g_fence;
+    ITEM_CHANGE(ITEM_GRANT, it);
+
+    return;
+}
+
+/*
+ * try to take one more reference on an existing item.
+ * an item left with ref 0 is being handed over to its waiters and is
+ * granted in whatever mode the first taker asks for. a reader only joins
+ * other readers past waiting writers under ITEM_FAIR_READER.
+ * return:
+ *         0  success
+ *         1  wait
+ */
+int hashlist_grantlock(struct item *it, int flags)
+{
+    assert(it != NULL);
+
+    if (it->ref > 0) {
+        if (EM_WRITE & flags) {
+            return 1;
+        }
+
+        if (EM_WRITE & it->val) {
+            return 1;
+        }
+
+        if (it->fair != ITEM_FAIR_READER && item_writer_waiting(it) != NULL) {
+            return 1;
+        }
+    }
+
+    item_grant(it, flags);
+
+    return 0;
+}
+
+/* grant every reader queued on it, skipping the writers */
+static void item_grant_readers(struct item *it,
+        void (*granted)(struct item_waiter *w, struct item *it, void *arg), void *arg)
+{
+    struct list_head *pos = NULL, *n = NULL;
+    struct item_waiter *w = NULL;
+
+    list_for_each_safe(pos, n, &it->waiters) {
+        w = list_entry(pos, struct item_waiter, node);
+        if (EM_WRITE & w->flags) {
+            continue;
+        }
+
+        item_grant(it, w->flags);
+        list_del_init(&w->node);
+        granted(w, it, arg);
+    }
+
+    return;
+}
+
+/*
+ * hand it over to its waiters as its policy says: in arrival order for
+ * as long as the head of the queue can be granted, or to the first
+ * writer, or to all the readers. granted() is called for each new
+ * holder, once it is off the queue.
+ */
+void hashlist_handoff(struct item *it,
+        void (*granted)(struct item_waiter *w, struct item *it, void *arg), void *arg)
+{
+    struct item_waiter *w = NULL;
+
+    assert(it != NULL);
+
+    if (it->fair == ITEM_FAIR_READER) {
+        while (!list_empty(&it->waiters)) {
+            w = list_entry(it->waiters.next, struct item_waiter, node);
+            if (hashlist_grantlock(it, w->flags) != 0) {
+                break;
+            }
+
+            list_del_init(&w->node);
+            granted(w, it, arg);
+        }
+        return;
+    }
+
+    if (it->ref > 0 && (EM_WRITE & it->val)) {
+        return;
+    }
+
+    w = item_writer_waiting(it);
+    if (w == NULL) {
+        item_grant_readers(it, granted, arg);
+        return;
+    }
+
+    if (it->ref > 0) {
+        /* readers still hold it, the writer is next */
+        return;
+    }
+
+    if (it->fair == ITEM_FAIR_PHASE && (EM_WRITE & it->val)) {
+        /* after a write phase, the readers that waited it out go first */
+        item_grant_readers(it, granted, arg);
+        if (it->ref > 0) {
+            return;
+        }
+    }
+
+    item_grant(it, w->flags);
+    list_del_init(&w->node);
+    granted(w, it, arg);
+
+    return;
+}
+
+/*
+ * on wait, w is queued at the tail of the item's waiters with flags.
  * return:
  *        -1  failed
  *         0  success
  *         1  wait
  */
-int hashlist_setlock(const char *key, int flags)
+int hashlist_setlock(const struct item_key *ik, int flags,
+        struct item_waiter *w, struct item **itp)
 {
-    int ret = 0;
-    char *k = NULL;
     struct item *it = NULL;
 
-    assert(key != NULL);
+    assert(ik != NULL && ik->key != NULL);
 
-    if (settings.verbose > 1) {
-        fprintf(stderr, ">>>. hashlist_setlock(): set lock key:[%s] flags:[%d]\n", key, flags);
-    }
-    
-    it = (struct item *)hashtable_search(g_hashlist, (void *)key);
+    log_printf(LOGL_DEBUG, ">>>. hashlist_setlock(): set lock key:[%s] flags:[%d]\n", ik->key, flags);
+
+    it = itemtable_search(&g_hashlist, ik);
     if (it == NULL) {
-        it = item_init(key, flags);
+        it = item_init(ik, flags);
         if (it == NULL) {
-            fprintf(stderr, "hash_init(): out of memory\n");
+            log_printf(LOGL_ERROR, "hash_init(): out of memory\n");
             return -1;
         }
 
-        k = strdup(key);
-        ret = hashtable_insert(g_hashlist, (void *)k, (void *)it);
-        assert(ret != 0);
-        if (settings.verbose > 1) {
-            fprintf(stderr, ">>>. hashlist_setlock(): insert key:[%s]\n", key);
+        if (hashlist_insert(it) != 0) {
+            log_printf(LOGL_ERROR, "keyindex_insert(): out of memory\n");
+            item_free(it);
+            return -1;
         }
+        ITEM_CHANGE(ITEM_GRANT, it);
 
+        log_printf(LOGL_DEBUG, ">>>. hashlist_setlock(): insert key:[%s]\n", ik->key);
+
+        *itp = it;
         return 0;
     }
 
-    if (settings.verbose > 1) {
-        fprintf(stderr, ">>>. hashlist_setlock(): find key:[%s] flags:[%d]\n", key, it->val);
-    }
+    log_printf(LOGL_DEBUG, ">>>. hashlist_setlock(): find key:[%s] flags:[%d]\n", ik->key, it->val);
 
     if (EM_NONBLOCK & flags) {
         if (EM_WRITE & flags) {
@@ -111,70 +549,140 @@ int hashlist_setlock(const char *key, int flags)
             return -1;
         }
 
+        if (it->fair != ITEM_FAIR_READER && item_writer_waiting(it) != NULL) {
+            return -1;
+        }
+
         it->ref++;
+        it->gen = ++g_fence;
+        ITEM_CHANGE(ITEM_GRANT, it);
+        *itp = it;
         return 0;
     }
 
-    if (EM_WRITE & flags) {
-        return 1;
+    *itp = it;
+
+    if (hashlist_grantlock(it, flags) == 0) {
+        return 0;
     }
 
-    if (EM_WRITE & it->val) {
+    w->flags = flags;
+    list_add_tail(&w->node, &it->waiters);
+    return 1;
+}
+
+/*
+ * drop one reference on it.
+ * return:
+ *         0  the item is gone
+ *         1  the item is still there, the caller is expected to hand it
+ *            over to its waiters with hashlist_handoff()
+ */
+int hashlist_setunlock(struct item *it)
+{
+    assert(it != NULL);
+
+    log_printf(LOGL_DEBUG, ">>>. hashlist_setunlock(): set unlock key:[%s]\n", ITEM_key(it));
+
+    ITEM_CHANGE(ITEM_RELEASE, it);
+
+    return hashlist_unref(it);
+}
+
+/* hashlist_setunlock() without the journal record */
+int hashlist_unref(struct item *it)
+{
+    it->ref--;
+
+    if (it->ref > 0 || !list_empty(&it->waiters)) {
         return 1;
     }
 
-    it->ref++;
+    itemtable_remove(&g_hashlist, it);
+    if (ordered) {
+        keyindex_remove(&g_keyindex, it);
+    }
+
+    log_printf(LOGL_DEBUG, ">>>. hashlist_setunlock(): remove key:[%s]\n", ITEM_key(it));
+
+    item_fire_watchers(it, ITEM_WATCH_FREE);
+
+    item_free(it);
+
     return 0;
 }
 
-int hashlist_setunlock(const char *key)
+/*
+ * w is told through item_watch_hook when it is next released for good
+ * or handed over in the other mode, whichever comes first.
+ */
+void hashlist_watch(struct item *it, struct item_waiter *w)
+{
+    assert(it != NULL && it->ref > 0);
+
+    list_add_tail(&w->node, &it->watchers);
+
+    return;
+}
+
+struct item *hashlist_findlock(const struct item_key *ik)
 {
     struct item *it = NULL;
-    struct item *itm = NULL;
 
-    assert(key != NULL);
+    assert(ik != NULL && ik->key != NULL);
 
-    if (settings.verbose > 1) {
-        fprintf(stderr, ">>>. hashlist_setunlock(): set unlock key:[%s]\n", key);
-    }
+    log_printf(LOGL_DEBUG, ">>>. hashlist_findlock(): find lock key:[%s]\n", ik->key);
 
-    it = (struct item *)hashtable_search(g_hashlist, (void *)key);
+    it = itemtable_search(&g_hashlist, ik);
     if (it == NULL) {
-        return -1;
+        return NULL;
     }
 
-    if (settings.verbose > 1) {
-        fprintf(stderr, ">>>. hashlist_setunlock(): find key:[%s]\n", key);
-    }
+    return it;
+}
 
-    it->ref--;
+/* the order of the index: bytes compared unsigned, a prefix first */
+static int key_cmp(const char *a, size_t na, const char *b, size_t nb)
+{
+    int  r = memcmp(a, b, na < nb ? na : nb);
 
-    if (it->ref <= 0) {
-        itm = hashtable_remove(g_hashlist, (void *)key);
-        free(itm);
-        if (settings.verbose > 1) {
-            fprintf(stderr, ">>>. hashlist_setunlock(): remove key:[%s]\n", key);
-        }
+    if (r != 0) {
+        return r;
     }
 
-    return 0;
+    return na < nb ? -1 : na > nb;
 }
 
-struct item *hashlist_findlock(const char *key)
+/*
+ * up to max items whose keys start with prefix, in key order, into out.
+ * with a cursor, the key last returned, the scan carries on after it.
+ * return:
+ *        -1  there is no index
+ *       >=0  the number of items
+ */
+int hashlist_scan(const char *prefix, size_t nprefix,
+        const char *cursor, size_t ncursor, struct item **out, int max)
 {
+    int  n = 0;
     struct item *it = NULL;
 
-    assert(key != NULL);
+    if (!ordered) {
+        return -1;
+    }
 
-    if (settings.verbose > 1) {
-        fprintf(stderr, ">>>. hashlist_findlock(): find lock key:[%s]\n", key);
+    if (cursor != NULL && key_cmp(cursor, ncursor, prefix, nprefix) >= 0) {
+        it = keyindex_ceiling(&g_keyindex, cursor, ncursor, 1);
+    }
+    else {
+        it = keyindex_ceiling(&g_keyindex, prefix, nprefix, 0);
     }
 
-    it = (struct item *)hashtable_search(g_hashlist, (void *)key);
-    if (it == NULL) {
-        return NULL;
+    /* the keys under prefix are next to each other, stop at the first other */
+    while (n < max && it != NULL && it->k.nkey >= nprefix
+            && memcmp(it->k.key, prefix, nprefix) == 0) {
+        out[n++] = it;
+        it = keyindex_ceiling(&g_keyindex, it->k.key, it->k.nkey, 1);
     }
 
-    return it;
+    return n;
 }
-
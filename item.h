@@ -9,30 +9,152 @@
 #ifndef _ITEM_H_
 #define _ITEM_H_
 
-#include "hashtable.h"
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "list.h"
+#include "locktable.h"
+
+/* keys shorter than this are stored in the item itself, '\0' included */
+#define ITEM_KEY_INLINE 24
+
+/*
+ * key handle: the parser fills it in once with item_key_init() and the
+ * same hash and length are used for search, insert, grant and remove.
+ */
+struct item_key {
+    const char   *key;
+    unsigned int nkey;  /* key length, without the '\0' */
+    unsigned int hv;    /* em_hash() of the key */
+};
+
+/*
+ * a lock request queued on an item, embedded in whoever waits: a conn in
+ * the daemon, a thread or a callback in the library.
+ */
+struct item_waiter {
+    struct list_head node;  /* the item's waiters, in arrival order */
+    int    flags;           /* EM_* asked for */
+};
 
 struct item {
-    char   key[64];
+    struct item_key k;  /* k.key points at inl or at an allocated copy */
+    struct item *h_next;  /* hash bucket chain */
     int    val;
     int    ref;
     time_t exp;
-    unsigned int cip;
+    uint64_t gen;  /* fencing generation, new on every grant */
+    struct list_head waiters;  /* item_waiters, in arrival order */
+    struct list_head watchers; /* item_waiters of watches, fired once */
+    int    fair;   /* ITEM_FAIR_*, chosen when the item is created */
+    char   inl[ITEM_KEY_INLINE];
 };
 
+#define ITEM_key(it) ((it)->k.key)
+
 #define EM_READ     0x00
 #define EM_WRITE    0x01
 #define EM_NONBLOCK 0x10
+#define EM_DURABLE  0x20  /* reply only once the grant is journaled */
+
+#define ITEM_HASH(it)       ((it)->k.hv)
+#define ITEM_KEY_HASH(ik)   ((ik)->hv)
+#define ITEM_KEY_EQ(it, ik) ((it)->k.hv == (ik)->hv \
+        && (it)->k.nkey == (ik)->nkey \
+        && memcmp((it)->k.key, (ik)->key, (ik)->nkey) == 0)
+
+/* changes to the table, for item_change_hook */
+enum item_changes {
+    ITEM_GRANT = 1,  /* one more hold on the key, created if needed */
+    ITEM_RELEASE,    /* one hold dropped by unlock or close */
+    ITEM_EXPIRE,     /* one restored hold dropped after the grace */
+};
+
+/* what fired a watch, for item_watch_hook */
+enum item_watch_events {
+    ITEM_WATCH_FREE = 1,  /* the last hold is gone, so is the item */
+    ITEM_WATCH_MODE,      /* handed over in the other mode */
+};
+
+/*
+ * who goes first on a contended item.
+ * reader: a new reader joins the readers holding it even if writers
+ *         wait, a released item goes to its waiters in arrival order.
+ * writer: no reader gets in while a writer waits, a released item goes
+ *         to the first writer waiting.
+ * phase:  no reader gets in while a writer waits, a writer's release
+ *         lets every reader waiting in at once, the last reader's lets
+ *         the first writer in. neither side waits more than one phase
+ *         of the other.
+ */
+enum item_fairness {
+    ITEM_FAIR_READER = 0,
+    ITEM_FAIR_WRITER,
+    ITEM_FAIR_PHASE,
+};
+
+#define ITEM_FAIR_RULES 16
 
-extern struct hashtable *g_hashlist;
+#define ITEM_CHANGE(type, it)                                               \
+    do {                                                                    \
+        if (item_change_hook != NULL) {                                     \
+            item_change_hook((type), (it));                                 \
+        }                                                                   \
+    } while (0)
+
+DEFINE_LOCKTABLE(itemtable, struct item, struct item_key, h_next,
+        ITEM_HASH, ITEM_KEY_HASH, ITEM_KEY_EQ)
+
+extern struct itemtable g_hashlist;
+extern uint64_t g_fence;  /* last fencing generation handed out */
+
+/* called with every change when set, the daemon journals them */
+extern void (*item_change_hook)(int type, const struct item *it);
+
+/* called for every watcher fired, it is off the watchers by then */
+extern void (*item_watch_hook)(struct item_waiter *w, const struct item *it, int event);
 
 void hashlist_init(void);
 
 void hashlist_close(void);
 
-int hashlist_setlock(const char *key, int flags);
+void item_key_init(struct item_key *ik, const char *key, size_t nkey);
+
+int hashlist_setlock(const struct item_key *ik, int flags,
+        struct item_waiter *w, struct item **itp);
+
+int hashlist_grantlock(struct item *it, int flags);
+
+void hashlist_handoff(struct item *it,
+        void (*granted)(struct item_waiter *w, struct item *it, void *arg), void *arg);
+
+int hashlist_setunlock(struct item *it);
+
+void hashlist_watch(struct item *it, struct item_waiter *w);
+
+int hashlist_unref(struct item *it);
+
+struct item *hashlist_findlock(const struct item_key *ik);
+
+unsigned int hashlist_count(void);
+
+void hashlist_reserve(unsigned int count);
+
+struct item *hashlist_restore(const struct item_key *ik, int val, int ref,
+        time_t exp, uint64_t gen);
+
+unsigned int hashlist_adopt_orphans(void);
+
+unsigned int hashlist_release_orphans(void (*notify)(struct item *it));
+
+void hashlist_walk(void (*fn)(struct item *it, void *arg), void *arg);
+
+void hashlist_index_init(void);
 
-int hashlist_setunlock(const char *key);
+int hashlist_fairness(const char *prefix, size_t nprefix, int policy);
 
-struct item *hashlist_findlock(const char *key);
+int hashlist_scan(const char *prefix, size_t nprefix,
+        const char *cursor, size_t ncursor, struct item **out, int max);
 
 #endif
@@ -0,0 +1,746 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * The event loop appends records to cur. journal_commit() and
+ * journal_rotate() seal cur onto the queue, the flusher thread takes the
+ * whole queue at once, writes it and syncs, then posts the last synced
+ * lsn through a pipe. While it syncs the loop keeps filling the next
+ * batch, so the busier the server the bigger the commits.
+ *
+ * A segment holds the records between two snapshots. journal_rotate()
+ * starts a new segment when a snapshot is forked, and once the snapshot
+ * is written the segments before it are removed by journal_compact().
+ *
+ * Every sealed batch is also handed to repl_ship() for the standbys.
+ * Without a file (replication only) the records are built and shipped
+ * but there is no flusher, and cur is reused right away.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "hash.h"
+#include "common.h"
+#include "journal.h"
+#include "repl.h"
+
+#define JOURNAL_BUF_SIZE (64 * 1024)
+#define JOURNAL_IOV_MAX 64
+#define JOURNAL_RETRY_USEC 100000  /* pause before writing failed batches again */
+
+struct jbuf {
+    char     *data;
+    size_t   len;
+    size_t   size;
+    uint64_t last_lsn;  /* lsn of the last record in data */
+    unsigned int seg;   /* segment the records belong to */
+    struct jbuf *next;
+};
+
+static int journal_on = 0;
+
+static char *jpath = NULL;        /* NULL: no file, records only shipped */
+static uint64_t jlsn = 0;           /* last lsn handed out */
+static uint64_t jsynced = 0;        /* last lsn on disk, loop side */
+static unsigned int jseg = 0;       /* segment cur belongs to */
+static unsigned int jfirst = 0;     /* oldest segment still needed */
+static struct jbuf *cur = NULL;
+
+static struct list_head held;       /* conns whose reply waits for a sync */
+
+/* shared with the flusher */
+static pthread_mutex_t jlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jcond = PTHREAD_COND_INITIALIZER;
+static struct jbuf *queue_head = NULL, *queue_tail = NULL;
+static struct jbuf *free_bufs = NULL;
+static uint64_t flushed_lsn = 0;
+static uint64_t failed_lsn = 0;     /* last lsn of a batch that failed, retried */
+static int notify_pipe[2] = {-1, -1};
+static struct event notify_ev;
+
+static char *segment_path(char *buf, size_t size, unsigned int seg)
+{
+    snprintf(buf, size, "%s.%u", jpath, seg);
+
+    return buf;
+}
+
+static struct jbuf *jbuf_get(void)
+{
+    struct jbuf *b = NULL;
+
+    pthread_mutex_lock(&jlock);
+    b = free_bufs;
+    if (b != NULL) {
+        free_bufs = b->next;
+    }
+    pthread_mutex_unlock(&jlock);
+
+    if (b == NULL) {
+        b = (struct jbuf *)calloc(1, sizeof(struct jbuf));
+        if (b == NULL) {
+            return NULL;
+        }
+    }
+
+    if (b->data == NULL) {
+        b->data = (char *)malloc(JOURNAL_BUF_SIZE);
+        if (b->data == NULL) {
+            free(b);
+            return NULL;
+        }
+        b->size = JOURNAL_BUF_SIZE;
+    }
+
+    b->len = 0;
+    b->next = NULL;
+
+    return b;
+}
+
+void journal_append(int type, const struct item *it)
+{
+    size_t need = JOURNAL_REC_SIZE(it->k.nkey);
+    char *nd = NULL;
+    struct journal_rec *r = NULL;
+
+    if (cur->len + need > cur->size) {
+        nd = (char *)realloc(cur->data, (cur->size + need) * 2);
+        if (nd == NULL) {
+            log_printf(LOGL_ERROR, "journal_append(): out of memory\n");
+            return;
+        }
+        cur->data = nd;
+        cur->size = (cur->size + need) * 2;
+    }
+
+    r = (struct journal_rec *)(cur->data + cur->len);
+    memset(r, 0, need);
+    r->len = need;
+    r->lsn = ++jlsn;
+    r->gen = it->gen;
+    r->exp = it->exp;
+    r->val = it->val;
+    r->nkey = it->k.nkey;
+    r->type = (uint8_t)type;
+    memcpy((char *)r + sizeof(struct journal_rec), it->k.key, it->k.nkey);
+    r->sum = em_hash_wyhash((char *)r + 8, need - 8, 0);
+
+    cur->len += need;
+    cur->last_lsn = jlsn;
+
+    stats.journal_records++;
+
+    return;
+}
+
+/* queue cur for the flusher and start a new one */
+static void journal_seal(void)
+{
+    struct jbuf *b = NULL;
+
+    if (cur->len == 0) {
+        return;
+    }
+
+    if (jpath == NULL) {
+        repl_ship(cur->data, cur->len, cur->last_lsn);
+        cur->len = 0;
+        return;
+    }
+
+    b = jbuf_get();
+    if (b == NULL) {
+        /* keep appending to cur, it goes out with the next commit */
+        return;
+    }
+
+    repl_ship(cur->data, cur->len, cur->last_lsn);
+
+    cur->seg = jseg;
+
+    pthread_mutex_lock(&jlock);
+    if (queue_tail != NULL) {
+        queue_tail->next = cur;
+    }
+    else {
+        queue_head = cur;
+    }
+    queue_tail = cur;
+    pthread_cond_signal(&jcond);
+    pthread_mutex_unlock(&jlock);
+
+    cur = b;
+
+    return;
+}
+
+/* end of an event loop iteration: everything appended goes in one batch */
+void journal_commit(void)
+{
+    if (journal_on) {
+        journal_seal();
+    }
+
+    return;
+}
+
+/*
+ * start a new segment, returns the last lsn of the old ones and the
+ * first segment a snapshot taken now depends on.
+ */
+uint64_t journal_rotate(unsigned int *seg)
+{
+    if (!journal_on || jpath == NULL) {
+        *seg = 0;
+        return 0;
+    }
+
+    journal_seal();
+    jseg++;
+    *seg = jseg;
+
+    return jlsn;
+}
+
+/* a snapshot covering everything before segment seg is on disk */
+void journal_compact(unsigned int seg)
+{
+    char path[PATH_MAX];
+
+    if (!journal_on || jpath == NULL) {
+        return;
+    }
+
+    for (; jfirst < seg; jfirst++) {
+        if (unlink(segment_path(path, sizeof(path), jfirst)) != 0 && errno != ENOENT) {
+            log_printf(LOGL_ERROR, "unlink(%s): %s\n", path, strerror(errno));
+        }
+    }
+
+    return;
+}
+
+/*
+ * hold the reply of durable lock c until its grant is synced.
+ * returns false if there is no journal and the reply can go now.
+ */
+bool journal_hold(struct conn *c)
+{
+    if (!journal_on || jpath == NULL || jsynced >= jlsn) {
+        return false;
+    }
+
+    c->sync_lsn = jlsn;
+    list_add_tail(&c->wait.node, &held);
+    conn_set_state(c, conn_sync);
+
+    if (!update_event(c, 0)) {
+        log_printf(LOGL_VERBOSE, "journal_hold(): Couldn't update event\n");
+        list_del_init(&c->wait.node);
+        conn_set_state(c, conn_closing);
+    }
+
+    return true;
+}
+
+/*
+ * the flusher posted a sync, let the replies it covers go. the grants
+ * of a batch that failed are not on disk: their holders get an error
+ * instead and lose the lock, the flusher retries the records.
+ */
+static void journal_synced(const int fd, const short which, void *arg)
+{
+    char drain[64];
+    uint64_t failed = 0;
+    struct conn *c = NULL;
+
+    while (read(fd, drain, sizeof(drain)) > 0) {
+        continue;
+    }
+
+    jsynced = __atomic_load_n(&flushed_lsn, __ATOMIC_ACQUIRE);
+    failed = __atomic_load_n(&failed_lsn, __ATOMIC_ACQUIRE);
+
+    while (!list_empty(&held)) {
+        c = list_entry(held.next, struct conn, wait.node);
+        if (c->sync_lsn <= jsynced) {
+            list_del_init(&c->wait.node);
+            conn_set_state(c, conn_write);
+        }
+        else if (c->sync_lsn <= failed) {
+            list_del_init(&c->wait.node);
+            conn_unlock(c);
+            out_string(c, "-ERR, journal write failed");
+        }
+        else {
+            break;
+        }
+
+        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+            log_printf(LOGL_VERBOSE, "journal_synced(): Couldn't update event\n");
+            conn_set_state(c, conn_closing);
+        }
+    }
+
+    return;
+}
+
+/*
+ * commit what is pending and wait for the flusher to sync it, then let
+ * the held replies go. for a clean handover of the process.
+ */
+void journal_drain(void)
+{
+    if (!journal_on || jpath == NULL) {
+        return;
+    }
+
+    while (__atomic_load_n(&flushed_lsn, __ATOMIC_ACQUIRE) < jlsn) {
+        if (__atomic_load_n(&failed_lsn, __ATOMIC_ACQUIRE) >= jlsn) {
+            log_printf(LOGL_ERROR, "journal_drain(): records up to %llu are not on disk\n",
+                    (unsigned long long)jlsn);
+            break;
+        }
+        journal_seal();
+        usleep(1000);
+    }
+
+    journal_synced(notify_pipe[0], EV_READ, NULL);
+
+    return;
+}
+
+static int segment_open(unsigned int seg)
+{
+    int fd = -1, dfd = -1;
+    char path[PATH_MAX];
+    char dir[PATH_MAX];
+
+    fd = open(segment_path(path, sizeof(path), seg), O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) {
+        log_printf(LOGL_ERROR, "open(%s): %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* make the new name durable too */
+    snprintf(dir, sizeof(dir), "%s", path);
+    dfd = open(dirname(dir), O_RDONLY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+
+    return fd;
+}
+
+/*
+ * write and sync the queued batches. on an error the segment is cut back
+ * to where this round's unsynced data began, so no torn record is left
+ * for replay to stop at, and those batches go back to the head of the
+ * queue to be tried again. only the batches synced before count.
+ */
+static void *journal_thread(void *arg)
+{
+    int fd = -1, n = 0, ok = 0;
+    unsigned int seg = 0;
+    uint64_t start = 0, synced = 0;
+    off_t pend_off = 0;
+    ssize_t want = 0;
+    struct jbuf *list = NULL, *pending = NULL, *last = NULL, *b = NULL, *next = NULL;
+    struct iovec iov[JOURNAL_IOV_MAX];
+
+    for (;;) {
+        pthread_mutex_lock(&jlock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&jcond, &jlock);
+        }
+        list = queue_head;
+        queue_head = queue_tail = NULL;
+        pthread_mutex_unlock(&jlock);
+
+        start = current_usec();
+        ok = 1;
+
+        /* the first batch not known to be on disk, and where it starts */
+        pending = list;
+        if (fd >= 0) {
+            pend_off = lseek(fd, 0, SEEK_END);
+        }
+
+        for (b = list; b != NULL; ) {
+            if (fd < 0 || b->seg != seg) {
+                if (fd >= 0) {
+                    if (fdatasync(fd) != 0) {
+                        log_printf(LOGL_ERROR, "journal fdatasync(): %s\n", strerror(errno));
+                        ok = 0;
+                        break;
+                    }
+                    close(fd);
+                    fd = -1;
+                    pending = b;
+                }
+                seg = b->seg;
+                fd = segment_open(seg);
+                if (fd < 0) {
+                    ok = 0;
+                    break;
+                }
+                pend_off = lseek(fd, 0, SEEK_END);
+            }
+
+            /* one writev for the run of batches of this segment */
+            for (n = 0, want = 0; b != NULL && b->seg == seg && n < JOURNAL_IOV_MAX; b = b->next) {
+                iov[n].iov_base = b->data;
+                iov[n].iov_len = b->len;
+                want += b->len;
+                n++;
+            }
+
+            if (writev(fd, iov, n) != want) {
+                log_printf(LOGL_ERROR, "journal writev(): %s\n", strerror(errno));
+                ok = 0;
+                break;
+            }
+        }
+
+        if (ok && fd >= 0 && fdatasync(fd) != 0) {
+            log_printf(LOGL_ERROR, "journal fdatasync(): %s\n", strerror(errno));
+            ok = 0;
+        }
+
+        if (ok) {
+            pending = NULL;
+        }
+        else if (fd >= 0) {
+            if (pend_off < 0 || ftruncate(fd, pend_off) != 0) {
+                log_printf(LOGL_ERROR, "journal ftruncate(): %s\n", strerror(errno));
+            }
+            close(fd);
+            fd = -1;
+        }
+
+        hist_record(&stats.sync_hist, current_usec() - start);
+        __atomic_fetch_add(&stats.journal_batches, 1, __ATOMIC_RELAXED);
+
+        /* the batches before pending are on disk */
+        synced = 0;
+        for (b = list; b != pending; b = b->next) {
+            synced = b->last_lsn;
+        }
+        if (synced != 0) {
+            __atomic_store_n(&flushed_lsn, synced, __ATOMIC_RELEASE);
+        }
+
+        if (pending != NULL) {
+            __atomic_fetch_add(&stats.journal_fails, 1, __ATOMIC_RELAXED);
+            for (last = pending; last->next != NULL; last = last->next) {
+                continue;
+            }
+            __atomic_store_n(&failed_lsn, last->last_lsn, __ATOMIC_RELEASE);
+        }
+
+        if (write(notify_pipe[1], "s", 1) < 0 && errno != EAGAIN) {
+            log_printf(LOGL_ERROR, "journal notify: %s\n", strerror(errno));
+        }
+
+        pthread_mutex_lock(&jlock);
+        for (b = list; b != pending; b = next) {
+            next = b->next;
+            b->next = free_bufs;
+            free_bufs = b;
+        }
+        if (pending != NULL) {
+            /* they go before anything sealed since */
+            last->next = queue_head;
+            queue_head = pending;
+            if (queue_tail == NULL) {
+                queue_tail = last;
+            }
+        }
+        pthread_mutex_unlock(&jlock);
+
+        if (pending != NULL) {
+            usleep(JOURNAL_RETRY_USEC);
+        }
+    }
+
+    return NULL;
+}
+
+/* last lsn handed out or applied */
+uint64_t journal_lsn(void)
+{
+    return jlsn;
+}
+
+/* the table was replaced by a snapshot image taken at lsn */
+void journal_reset(uint64_t lsn)
+{
+    jlsn = lsn;
+    jsynced = lsn;
+
+    return;
+}
+
+/* 0 if a whole, intact record starts at r, avail bytes are readable */
+int journal_check(const struct journal_rec *r, size_t avail)
+{
+    if (avail < sizeof(struct journal_rec) || r->len < sizeof(struct journal_rec)
+            || r->len > avail || r->len != JOURNAL_REC_SIZE(r->nkey)
+            || r->sum != em_hash_wyhash((const char *)r + 8, r->len - 8, 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* apply one record to the table, nobody owns the holds */
+void journal_apply(const struct journal_rec *r)
+{
+    struct item *it = NULL;
+    struct item_key ik;
+
+    item_key_init(&ik, (const char *)r + sizeof(struct journal_rec), r->nkey);
+
+    it = hashlist_findlock(&ik);
+
+    if (r->type == JOURNAL_GRANT) {
+        if (it == NULL) {
+            hashlist_restore(&ik, r->val, 1, r->exp, r->gen);
+        }
+        else {
+            it->ref++;
+            it->val = r->val;
+            it->gen = r->gen;
+            if (r->gen > g_fence) {
+                g_fence = r->gen;
+            }
+        }
+    }
+    else if (it != NULL) {
+        hashlist_unref(it);
+    }
+
+    if (r->lsn > jlsn) {
+        jlsn = r->lsn;
+    }
+
+    return;
+}
+
+/*
+ * replay one segment, records up to lsn are already in the snapshot.
+ * stops at the first torn or corrupt record, the tail a crash cut off.
+ */
+static long journal_replay(const char *path, uint64_t lsn)
+{
+    int fd = -1;
+    long n = 0;
+    char *p = NULL;
+    size_t off = 0;
+    struct stat st;
+    const struct journal_rec *r = NULL;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    p = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+
+    while (off + sizeof(struct journal_rec) <= (size_t)st.st_size) {
+        r = (const struct journal_rec *)(p + off);
+        if (journal_check(r, st.st_size - off) != 0) {
+            log_printf(LOGL_ERROR, "%s: journal ends in a torn record at %zu\n", path, off);
+            break;
+        }
+
+        if (r->lsn > lsn) {
+            journal_apply(r);
+            n++;
+        }
+        if (r->lsn > jlsn) {
+            jlsn = r->lsn;
+        }
+
+        off += r->len;
+    }
+
+    munmap(p, st.st_size);
+
+    return n;
+}
+
+/* segment numbers of path.N, in *first .. *last, returns how many */
+static int segment_scan(unsigned int *first, unsigned int *last)
+{
+    int n = 0;
+    char *end = NULL;
+    char dir[PATH_MAX], base[PATH_MAX];
+    unsigned long seg = 0;
+    size_t blen = 0;
+    DIR *d = NULL;
+    struct dirent *de = NULL;
+
+    snprintf(dir, sizeof(dir), "%s", jpath);
+    snprintf(base, sizeof(base), "%s", jpath);
+    d = opendir(dirname(dir));
+    if (d == NULL) {
+        return -1;
+    }
+
+    snprintf(base, sizeof(base), "%s", basename(base));
+    blen = strlen(base);
+
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, base, blen) != 0 || de->d_name[blen] != '.'
+                || de->d_name[blen + 1] < '0' || de->d_name[blen + 1] > '9') {
+            continue;
+        }
+
+        seg = strtoul(de->d_name + blen + 1, &end, 10);
+        if (*end != '\0') {
+            continue;
+        }
+
+        if (n == 0 || seg < *first) {
+            *first = seg;
+        }
+        if (n == 0 || seg > *last) {
+            *last = seg;
+        }
+        n++;
+    }
+
+    closedir(d);
+
+    return n;
+}
+
+/*
+ * replay the segments of path over the snapshot taken at lsn, then start
+ * a new segment and the flusher. with path NULL records are only built
+ * for replication.
+ */
+int journal_open(const char *path, uint64_t lsn, struct event_base *base)
+{
+    int n = 0, flags = 0;
+    long r = 0, total = 0;
+    unsigned int seg = 0, first = 0, last = 0;
+    char spath[PATH_MAX];
+    pthread_t tid;
+    pthread_attr_t attr;
+    sigset_t all, old;
+
+    jlsn = lsn;
+    jsynced = lsn;
+    INIT_LIST_HEAD(&held);
+
+    if (path == NULL) {
+        cur = jbuf_get();
+        if (cur == NULL) {
+            fprintf(stderr, "failed to set up the journal\n");
+            return -1;
+        }
+        journal_on = 1;
+        item_change_hook = journal_append;
+        return 0;
+    }
+
+    jpath = strdup(path);
+
+    n = segment_scan(&first, &last);
+    if (n < 0) {
+        fprintf(stderr, "failed to scan journal directory for %s\n", path);
+        return -1;
+    }
+
+    for (seg = first; n > 0 && seg <= last; seg++) {
+        r = journal_replay(segment_path(spath, sizeof(spath), seg), lsn);
+        if (r < 0 && errno != ENOENT) {
+            fprintf(stderr, "failed to replay journal %s\n", spath);
+            return -1;
+        }
+        total += r > 0 ? r : 0;
+    }
+
+    if (total > 0) {
+        log_printf(LOGL_VERBOSE, "replayed %ld journal records from %s\n", total, path);
+    }
+
+    jfirst = n > 0 ? first : 0;
+    jseg = n > 0 ? last + 1 : 0;
+    jsynced = jlsn;
+    flushed_lsn = jlsn;
+
+    cur = jbuf_get();
+    if (cur == NULL || pipe(notify_pipe) != 0) {
+        fprintf(stderr, "failed to set up the journal\n");
+        return -1;
+    }
+
+    flags = fcntl(notify_pipe[0], F_GETFL, 0);
+    fcntl(notify_pipe[0], F_SETFL, flags | O_NONBLOCK);
+    flags = fcntl(notify_pipe[1], F_GETFL, 0);
+    fcntl(notify_pipe[1], F_SETFL, flags | O_NONBLOCK);
+
+    event_set(&notify_ev, notify_pipe[0], EV_READ | EV_PERSIST, journal_synced, NULL);
+    event_base_set(base, &notify_ev);
+    if (event_add(&notify_ev, NULL) == -1) {
+        fprintf(stderr, "failed to add journal notify event\n");
+        return -1;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    n = pthread_create(&tid, &attr, journal_thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (n != 0) {
+        fprintf(stderr, "failed to create journal thread\n");
+        return -1;
+    }
+
+    journal_on = 1;
+    item_change_hook = journal_append;
+
+    return 0;
+}
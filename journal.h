@@ -0,0 +1,74 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+
+#include "event.h"
+#include "item.h"
+
+/*
+ * Write-ahead journal of lock state changes, in segment files path.N.
+ *
+ * Records are appended to a buffer as the table changes. At the end of
+ * each event loop iteration journal_commit() hands the buffer to the
+ * flusher thread, which writes everything handed to it since its last
+ * round with one writev() and one fdatasync(). Replies to durable ('d')
+ * lock requests are held until the record of their grant is on disk.
+ *
+ * The same batches are streamed to standbys by repl.c, and applied there
+ * with journal_apply().
+ */
+
+enum journal_types {
+    JOURNAL_GRANT = ITEM_GRANT,
+    JOURNAL_RELEASE = ITEM_RELEASE,
+    JOURNAL_EXPIRE = ITEM_EXPIRE,
+};
+
+struct journal_rec {
+    uint32_t len;   /* whole record, key and padding to 8 bytes included */
+    uint32_t sum;   /* em_hash_wyhash() of the record after this field */
+    uint64_t lsn;
+    uint64_t gen;
+    int64_t  exp;
+    int32_t  val;
+    uint16_t nkey;
+    uint8_t  type;
+    uint8_t  pad;
+};
+
+#define JOURNAL_REC_SIZE(nkey) ((sizeof(struct journal_rec) + (nkey) + 7) & ~(size_t)7)
+
+void journal_append(int type, const struct item *it);
+
+int journal_open(const char *path, uint64_t lsn, struct event_base *base);
+
+void journal_commit(void);
+
+void journal_drain(void);
+
+uint64_t journal_rotate(unsigned int *seg);
+
+void journal_compact(unsigned int seg);
+
+uint64_t journal_lsn(void);
+
+void journal_reset(uint64_t lsn);
+
+int journal_check(const struct journal_rec *r, size_t avail);
+
+void journal_apply(const struct journal_rec *r);
+
+struct conn;
+
+bool journal_hold(struct conn *c);
+
+#endif
@@ -0,0 +1,254 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Crit-bit tree over the keys of the items.
+ *
+ * A node holds the first bit two groups of keys differ in, as the byte
+ * and a mask of every other bit in it; keys with the bit clear go left,
+ * so an in order walk is in key order. Bytes past the end of a key read
+ * as 0, which sorts a key before the longer keys it is a prefix of.
+ * Keys never contain a '\0', so no two of them read the same.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "item.h"
+#include "keyindex.h"
+
+struct kx_node {
+    void     *child[2];
+    uint32_t byte;
+    uint8_t  otherbits;
+};
+
+#define IS_NODE(p) ((uintptr_t)(p) & 1)
+#define NODE(p)    ((struct kx_node *)((uintptr_t)(p) - 1))
+
+/* q is above a node parting keys at byte, otherbits */
+#define ABOVE(q, b, o) ((q)->byte < (b) || ((q)->byte == (b) && (q)->otherbits < (o)))
+
+static inline int key_byte(const char *key, size_t nkey, uint32_t i)
+{
+    return i < nkey ? (uint8_t)key[i] : 0;
+}
+
+static inline int direction(const struct kx_node *q, const char *key, size_t nkey)
+{
+    return (1 + (q->otherbits | key_byte(key, nkey, q->byte))) >> 8;
+}
+
+/* the item a lookup for key ends on */
+static struct item *best_leaf(void *p, const char *key, size_t nkey)
+{
+    struct kx_node *q = NULL;
+
+    while (IS_NODE(p)) {
+        q = NODE(p);
+        p = q->child[direction(q, key, nkey)];
+    }
+
+    return (struct item *)p;
+}
+
+static struct item *leftmost(void *p)
+{
+    while (IS_NODE(p)) {
+        p = NODE(p)->child[0];
+    }
+
+    return (struct item *)p;
+}
+
+/* the first bit key and it's key differ in. returns 0 if they do not */
+static int crit_bit(const struct item *it, const char *key, size_t nkey,
+        uint32_t *byte, uint8_t *otherbits)
+{
+    uint32_t i = 0, x = 0;
+    size_t len = nkey > it->k.nkey ? nkey : it->k.nkey;
+
+    for (i = 0; i < len; i++) {
+        x = key_byte(key, nkey, i) ^ key_byte(it->k.key, it->k.nkey, i);
+        if (x != 0) {
+            break;
+        }
+    }
+
+    if (x == 0) {
+        return 0;
+    }
+
+    while (x & (x - 1)) {
+        x &= x - 1;
+    }
+
+    *byte = i;
+    *otherbits = (uint8_t)(x ^ 255);
+
+    return 1;
+}
+
+/* returns 0, or -1 out of memory */
+int keyindex_insert(struct keyindex *t, struct item *it)
+{
+    int  newdir = 0;
+    uint8_t otherbits = 0;
+    uint32_t byte = 0;
+    void **wherep = &t->root;
+    struct item *leaf = NULL;
+    struct kx_node *node = NULL, *q = NULL;
+
+    if (t->root == NULL) {
+        t->root = it;
+        t->count++;
+        return 0;
+    }
+
+    leaf = best_leaf(t->root, it->k.key, it->k.nkey);
+    if (!crit_bit(leaf, it->k.key, it->k.nkey, &byte, &otherbits)) {
+        return 0;
+    }
+
+    node = (struct kx_node *)malloc(sizeof(struct kx_node));
+    if (node == NULL) {
+        return -1;
+    }
+
+    /* the side the keys already there are on */
+    newdir = (1 + (otherbits | key_byte(leaf->k.key, leaf->k.nkey, byte))) >> 8;
+
+    node->byte = byte;
+    node->otherbits = otherbits;
+    node->child[1 - newdir] = it;
+
+    while (IS_NODE(*wherep)) {
+        q = NODE(*wherep);
+        if (!ABOVE(q, byte, otherbits)) {
+            break;
+        }
+        wherep = &q->child[direction(q, it->k.key, it->k.nkey)];
+    }
+
+    node->child[newdir] = *wherep;
+    *wherep = (void *)((uintptr_t)node + 1);
+    t->count++;
+
+    return 0;
+}
+
+void keyindex_remove(struct keyindex *t, struct item *it)
+{
+    int  dir = 0;
+    void *p = t->root;
+    void **wherep = &t->root, **whereq = NULL;
+    struct kx_node *q = NULL;
+
+    while (IS_NODE(p)) {
+        whereq = wherep;
+        q = NODE(p);
+        dir = direction(q, it->k.key, it->k.nkey);
+        wherep = &q->child[dir];
+        p = *wherep;
+    }
+
+    if (p != it) {
+        return;
+    }
+
+    if (whereq == NULL) {
+        t->root = NULL;
+    }
+    else {
+        *whereq = q->child[1 - dir];
+        free(q);
+    }
+
+    t->count--;
+
+    return;
+}
+
+/*
+ * the first item in key order from key on, or after key if strict.
+ * NULL if there is none.
+ */
+struct item *keyindex_ceiling(const struct keyindex *t, const char *key, size_t nkey, int strict)
+{
+    int  dir = 0, newdir = 0;
+    uint8_t otherbits = 0;
+    uint32_t byte = 0;
+    void *p = t->root, *next = NULL;
+    struct item *leaf = NULL;
+    struct kx_node *q = NULL;
+
+    if (p == NULL) {
+        return NULL;
+    }
+
+    leaf = best_leaf(p, key, nkey);
+
+    if (!crit_bit(leaf, key, nkey, &byte, &otherbits)) {
+        if (!strict) {
+            return leaf;
+        }
+        /* the leaf after it: the right side of the last left turn */
+        byte = UINT32_MAX;
+        otherbits = 0;
+        newdir = 0;
+    }
+    else {
+        newdir = (1 + (otherbits | key_byte(leaf->k.key, leaf->k.nkey, byte))) >> 8;
+    }
+
+    /* down to where key would go, remembering what would follow it */
+    while (IS_NODE(p)) {
+        q = NODE(p);
+        if (!ABOVE(q, byte, otherbits)) {
+            break;
+        }
+        dir = direction(q, key, nkey);
+        if (dir == 0) {
+            next = q->child[1];
+        }
+        p = q->child[dir];
+    }
+
+    if (newdir == 1) {
+        /* everything under p sorts after key */
+        return leftmost(p);
+    }
+
+    return next != NULL ? leftmost(next) : NULL;
+}
+
+static void keyindex_free(void *p)
+{
+    if (IS_NODE(p)) {
+        keyindex_free(NODE(p)->child[0]);
+        keyindex_free(NODE(p)->child[1]);
+        free(NODE(p));
+    }
+
+    return;
+}
+
+/* frees the nodes, the items are the table's */
+void keyindex_destroy(struct keyindex *t)
+{
+    if (t->root != NULL) {
+        keyindex_free(t->root);
+    }
+
+    t->root = NULL;
+    t->count = 0;
+
+    return;
+}
@@ -0,0 +1,35 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _KEYINDEX_H_
+#define _KEYINDEX_H_
+
+#include <stddef.h>
+
+struct item;
+
+/*
+ * The items of the table in key order: a crit-bit tree, a binary radix
+ * tree that only has nodes where two keys part. Insert and remove
+ * touch one node, found in at most key length * 8 steps, and the hash
+ * table stays the way to look a single key up.
+ */
+struct keyindex {
+    void *root;       /* an item, a node with the low bit set, or NULL */
+    unsigned int count;
+};
+
+int keyindex_insert(struct keyindex *t, struct item *it);
+
+void keyindex_remove(struct keyindex *t, struct item *it);
+
+struct item *keyindex_ceiling(const struct keyindex *t, const char *key, size_t nkey, int strict);
+
+void keyindex_destroy(struct keyindex *t);
+
+#endif
@@ -0,0 +1,156 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _LOCKTABLE_H_
+#define _LOCKTABLE_H_
+
+#include <stdlib.h>
+
+/*
+ * Type specialized chained hash table.
+ *
+ * DEFINE_LOCKTABLE(name, etype, ktype, next, ehash, khash, keyeq) defines
+ * struct name and static inline name_init(), name_search(), name_insert(),
+ * name_remove(), name_count() and name_destroy() for entries of etype
+ * looked up by keys of ktype:
+ *
+ *   next          the member of etype chaining entries in a bucket
+ *   ehash(e)      hash value stored in entry e
+ *   khash(k)      hash value of key k
+ *   keyeq(e, k)   non-zero when entry e has key k
+ *
+ * Unlike hashtable.c the table is intrusive (no struct entry per insert),
+ * hash and compare are expanded inline instead of called through function
+ * pointers, and the bucket count is a power of two so the index is a mask
+ * instead of a modulo by a prime. The hash must be good in its low bits,
+ * em_hash() is.
+ */
+
+#define LOCKTABLE_MAX_LOAD(size) ((size) - ((size) >> 2))  /* 0.75 */
+
+#define DEFINE_LOCKTABLE(name, etype, ktype, next, ehash, khash, keyeq)      \
+                                                                            \
+struct name {                                                               \
+    etype        **buckets;                                                 \
+    unsigned int mask;                                                      \
+    unsigned int count;                                                     \
+    unsigned int loadlimit;                                                 \
+};                                                                          \
+                                                                            \
+static inline int name##_init(struct name *t, unsigned int minsize)         \
+{                                                                           \
+    unsigned int size = 16;                                                 \
+                                                                            \
+    while (size < minsize && size < (1u << 30)) {                           \
+        size <<= 1;                                                         \
+    }                                                                       \
+                                                                            \
+    t->buckets = (etype **)calloc(size, sizeof(etype *));                   \
+    if (t->buckets == NULL) {                                               \
+        return -1;                                                          \
+    }                                                                       \
+                                                                            \
+    t->mask = size - 1;                                                     \
+    t->count = 0;                                                           \
+    t->loadlimit = LOCKTABLE_MAX_LOAD(size);                                \
+                                                                            \
+    return 0;                                                               \
+}                                                                           \
+                                                                            \
+static inline unsigned int name##_count(struct name *t)                     \
+{                                                                           \
+    return t->count;                                                        \
+}                                                                           \
+                                                                            \
+static inline etype *name##_search(struct name *t, const ktype *k)          \
+{                                                                           \
+    etype *e = t->buckets[khash(k) & t->mask];                              \
+                                                                            \
+    while (e != NULL && !(keyeq(e, k))) {                                   \
+        e = e->next;                                                        \
+    }                                                                       \
+                                                                            \
+    return e;                                                               \
+}                                                                           \
+                                                                            \
+/* doubles the table, on failure it just stays more loaded */              \
+static inline void name##_expand(struct name *t)                            \
+{                                                                           \
+    unsigned int i = 0, size = (t->mask + 1) << 1, mask = size - 1;         \
+    etype **nb = NULL;                                                      \
+    etype *e = NULL, *n = NULL;                                             \
+                                                                            \
+    if (size == 0 || (nb = (etype **)calloc(size, sizeof(etype *))) == NULL) { \
+        t->loadlimit = (unsigned int)-1;                                    \
+        return;                                                             \
+    }                                                                       \
+                                                                            \
+    for (i = 0; i <= t->mask; i++) {                                        \
+        for (e = t->buckets[i]; e != NULL; e = n) {                         \
+            n = e->next;                                                    \
+            e->next = nb[ehash(e) & mask];                                  \
+            nb[ehash(e) & mask] = e;                                        \
+        }                                                                   \
+    }                                                                       \
+                                                                            \
+    free(t->buckets);                                                       \
+    t->buckets = nb;                                                        \
+    t->mask = mask;                                                         \
+    t->loadlimit = LOCKTABLE_MAX_LOAD(size);                                \
+}                                                                           \
+                                                                            \
+/* does not check for duplicates, search first */                          \
+static inline void name##_insert(struct name *t, etype *e)                  \
+{                                                                           \
+    etype **b = NULL;                                                       \
+                                                                            \
+    if (++t->count > t->loadlimit) {                                        \
+        name##_expand(t);                                                   \
+    }                                                                       \
+                                                                            \
+    b = &t->buckets[ehash(e) & t->mask];                                    \
+    e->next = *b;                                                           \
+    *b = e;                                                                 \
+}                                                                           \
+                                                                            \
+/* unlinks e itself, no key compare */                                      \
+static inline etype *name##_remove(struct name *t, etype *e)                \
+{                                                                           \
+    etype **pe = &t->buckets[ehash(e) & t->mask];                           \
+                                                                            \
+    while (*pe != NULL) {                                                   \
+        if (*pe == e) {                                                     \
+            *pe = e->next;                                                  \
+            e->next = NULL;                                                 \
+            t->count--;                                                     \
+            return e;                                                       \
+        }                                                                   \
+        pe = &(*pe)->next;                                                  \
+    }                                                                       \
+                                                                            \
+    return NULL;                                                            \
+}                                                                           \
+                                                                            \
+static inline void name##_destroy(struct name *t, void (*efree)(etype *))   \
+{                                                                           \
+    unsigned int i = 0;                                                     \
+    etype *e = NULL, *n = NULL;                                             \
+                                                                            \
+    for (i = 0; efree != NULL && i <= t->mask; i++) {                       \
+        for (e = t->buckets[i]; e != NULL; e = n) {                         \
+            n = e->next;                                                    \
+            efree(e);                                                       \
+        }                                                                   \
+    }                                                                       \
+                                                                            \
+    free(t->buckets);                                                       \
+    t->buckets = NULL;                                                      \
+    t->count = 0;                                                           \
+}
+
+#endif
@@ -0,0 +1,371 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#define LOG_QUEUES 16
+#define LOG_OUT_SIZE (64 * 1024)
+#define LOG_IDLE_MAX_NS 2000000  /* writer sleeps at most 2ms when idle */
+
+int log_level = 0;
+
+struct log_entry {
+    uint64_t ts;  /* CLOCK_REALTIME nsec */
+    int      level;
+    int      len;
+    char     line[LOG_LINE_MAX];
+};
+
+/*
+ * single producer, single consumer: only the owning thread moves tail,
+ * only the writer moves head.
+ */
+struct log_queue {
+    uint64_t head;
+    char     pad1[56];
+    uint64_t tail;
+    uint64_t dropped;
+    char     pad2[48];
+    struct log_entry e[LOG_QUEUE_SIZE];
+};
+
+static struct log_queue *queues[LOG_QUEUES];
+static int nqueues = 0;
+static __thread struct log_queue *my_queue = NULL;
+
+static int log_running = 0;
+static int log_stop = 0;
+static pthread_t log_tid;
+
+static int log_fd = STDERR_FILENO;
+static char *log_path = NULL;
+static unsigned long log_rotate = 0;
+static unsigned long log_written = 0;
+
+static uint64_t log_dropped_seen = 0;
+
+static struct log_queue *log_queue_get(void)
+{
+    int i = 0;
+    struct log_queue *q = NULL;
+
+    if (my_queue != NULL) {
+        return my_queue;
+    }
+
+    q = (struct log_queue *)calloc(1, sizeof(struct log_queue));
+    if (q == NULL) {
+        return NULL;
+    }
+
+    i = __atomic_fetch_add(&nqueues, 1, __ATOMIC_RELAXED);
+    if (i >= LOG_QUEUES) {
+        free(q);
+        return NULL;
+    }
+
+    __atomic_store_n(&queues[i], q, __ATOMIC_RELEASE);
+    my_queue = q;
+
+    return q;
+}
+
+static uint64_t log_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+    int n = 0;
+    uint64_t tail = 0;
+    va_list ap;
+    struct log_entry *e = NULL;
+    struct log_queue *q = NULL;
+
+    va_start(ap, fmt);
+
+    /* before log_init() and after log_close(), straight to stderr */
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)
+            || (q = log_queue_get()) == NULL) {
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    tail = q->tail;
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= LOG_QUEUE_SIZE) {
+        __atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+
+    e = &q->e[tail & (LOG_QUEUE_SIZE - 1)];
+    e->ts = log_clock();
+    e->level = level;
+
+    n = vsnprintf(e->line, LOG_LINE_MAX, fmt, ap);
+    if (n < 0) {
+        n = 0;
+    }
+    else if (n >= LOG_LINE_MAX) {
+        n = LOG_LINE_MAX - 1;
+    }
+    e->len = n;
+
+    va_end(ap);
+
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return;
+}
+
+static void log_rotate_file(void)
+{
+    int i = LOG_KEEP;
+    size_t size = strlen(log_path) + 16;
+    char *from = (char *)malloc(size);
+    char *to = (char *)malloc(size);
+
+    if (from != NULL && to != NULL) {
+        for (i = LOG_KEEP; i > 1; i--) {
+            snprintf(from, size, "%s.%d", log_path, i - 1);
+            snprintf(to, size, "%s.%d", log_path, i);
+            rename(from, to);
+        }
+        snprintf(to, size, "%s.1", log_path);
+        rename(log_path, to);
+    }
+
+    free(from);
+    free(to);
+
+    close(log_fd);
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0) {
+        log_fd = STDERR_FILENO;
+    }
+    log_written = 0;
+
+    return;
+}
+
+static void log_flush(const char *buf, size_t len)
+{
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = write(log_fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        buf += n;
+        len -= n;
+        log_written += n;
+    }
+
+    if (log_path != NULL && log_rotate > 0 && log_written >= log_rotate) {
+        log_rotate_file();
+    }
+
+    return;
+}
+
+/* drains every queue once, returns the number of lines written */
+static int log_drain(char *out)
+{
+    int i = 0, n = 0, lines = 0;
+    size_t off = 0;
+    uint64_t head = 0, tail = 0, dropped = 0;
+    time_t secs = 0, last = 0;
+    char stamp[32] = {0};
+    struct tm tm;
+    struct log_entry *e = NULL;
+    struct log_queue *q = NULL;
+    int count = __atomic_load_n(&nqueues, __ATOMIC_ACQUIRE);
+
+    if (count > LOG_QUEUES) {
+        count = LOG_QUEUES;
+    }
+
+    for (i = 0; i < count; i++) {
+        q = __atomic_load_n(&queues[i], __ATOMIC_ACQUIRE);
+        if (q == NULL) {
+            continue;
+        }
+
+        head = q->head;
+        tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            e = &q->e[head & (LOG_QUEUE_SIZE - 1)];
+
+            if (off + LOG_LINE_MAX + 64 > LOG_OUT_SIZE) {
+                log_flush(out, off);
+                off = 0;
+            }
+
+            secs = (time_t)(e->ts / 1000000000);
+            if (secs != last) {
+                localtime_r(&secs, &tm);
+                strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+                last = secs;
+            }
+
+            n = sprintf(out + off, "[%s.%03u] ", stamp,
+                    (unsigned int)(e->ts % 1000000000 / 1000000));
+            off += n;
+            memcpy(out + off, e->line, e->len);
+            off += e->len;
+            if (e->len == 0 || e->line[e->len - 1] != '\n') {
+                out[off++] = '\n';
+            }
+
+            lines++;
+        }
+
+        __atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+
+        dropped += __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+    }
+
+    if (dropped != log_dropped_seen) {
+        /* the notice is up to 53 bytes, the last entry may have left less */
+        if (off + 64 > LOG_OUT_SIZE) {
+            log_flush(out, off);
+            off = 0;
+        }
+
+        n = snprintf(out + off, LOG_OUT_SIZE - off, "[log] %llu lines dropped, queue full\n",
+                (unsigned long long)(dropped - log_dropped_seen));
+        if (n > 0 && (size_t)n < LOG_OUT_SIZE - off) {
+            off += n;
+        }
+        log_dropped_seen = dropped;
+    }
+
+    if (off > 0) {
+        log_flush(out, off);
+    }
+
+    return lines;
+}
+
+static void *log_thread(void *arg)
+{
+    char *out = (char *)arg;
+    long idle = 1000000;
+    struct timespec ts;
+
+    while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+        if (log_drain(out) > 0) {
+            idle = 1000000;
+            continue;
+        }
+
+        /* back off up to LOG_IDLE_MAX_NS while there is nothing to write */
+        ts.tv_sec = 0;
+        ts.tv_nsec = idle;
+        nanosleep(&ts, NULL);
+        if (idle < LOG_IDLE_MAX_NS) {
+            idle <<= 1;
+        }
+    }
+
+    log_drain(out);
+
+    free(out);
+
+    return NULL;
+}
+
+/*
+ * start the writer thread, logging to path (stderr when NULL) and
+ * rotating it every rotate_size bytes (never when 0).
+ */
+int log_init(const char *path, unsigned long rotate_size)
+{
+    int ret = 0;
+    char *out = NULL;
+    sigset_t all, old;
+
+    if (path != NULL) {
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (log_fd < 0) {
+            fprintf(stderr, "open(%s): %s\n", path, strerror(errno));
+            log_fd = STDERR_FILENO;
+            return -1;
+        }
+        log_path = strdup(path);
+        log_written = (unsigned long)lseek(log_fd, 0, SEEK_END);
+    }
+    log_rotate = rotate_size;
+
+    out = (char *)malloc(LOG_OUT_SIZE);
+    if (out == NULL) {
+        return -1;
+    }
+
+    /* signals are for the event loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+
+    ret = pthread_create(&log_tid, NULL, log_thread, out);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0) {
+        __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+        free(out);
+        fprintf(stderr, "failed to create log thread\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* writes out what is queued and stops the writer */
+void log_close(void)
+{
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+
+    pthread_join(log_tid, NULL);
+
+    if (log_fd != STDERR_FILENO) {
+        close(log_fd);
+        log_fd = STDERR_FILENO;
+    }
+
+    return;
+}
@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+/*
+ * Asynchronous logging. log_printf() formats into a queue owned by the
+ * calling thread and returns, a writer thread stamps the lines and
+ * writes them to stderr or to a size-rotated file. When a queue is full
+ * the line is dropped and counted rather than waited for.
+ */
+
+#define LOGL_ERROR   0  /* always logged */
+#define LOGL_VERBOSE 1  /* -v */
+#define LOGL_DEBUG   2  /* -vv, client commands and replies */
+
+/* levels above this are compiled out */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOGL_DEBUG
+#endif
+
+#define LOG_QUEUE_SIZE 8192  /* lines per thread, power of two */
+#define LOG_LINE_MAX 240
+#define LOG_KEEP 4           /* rotated files kept, file.1 .. file.4 */
+
+extern int log_level;
+
+#define log_printf(level, ...)                                              \
+    do {                                                                    \
+        if ((level) <= LOG_MAX_LEVEL && (level) <= log_level) {             \
+            log_write((level), __VA_ARGS__);                                \
+        }                                                                   \
+    } while (0)
+
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+int log_init(const char *path, unsigned long rotate_size);
+
+void log_close(void);
+
+#endif
@@ -0,0 +1,436 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Thread safe API over the lock engine of item.c.
+ *
+ * The engine is the daemon's: one table, changed by one thread at a
+ * time. Here that thread is whichever caller holds the engine mutex. A
+ * blocked memlock_lock() sleeps on the condition variable of its own
+ * request and is woken by the unlock that grants it; grants to
+ * memlock_lock_async() callers are collected under the mutex and their
+ * callbacks run once it is dropped, so a callback may call back in.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "hash.h"
+#include "item.h"
+#include "memlock.h"
+
+enum memlock_states {
+    ml_idle,
+    ml_waiting,
+    ml_held,
+};
+
+struct memlock {
+    struct item_waiter w;   /* queued on it while waiting */
+    struct item *it;        /* item held or waited on */
+    int    state;
+    uint64_t gen;           /* fencing generation of our grant */
+    pthread_cond_t cond;    /* memlock_lock() sleeps here */
+    memlock_granted_fn fn;  /* NULL for memlock_lock() */
+    void   *arg;
+};
+
+/* an async grant whose callback is due, as it was when granted */
+struct memlock_grant {
+    struct memlock *l;
+    memlock_granted_fn fn;
+    void   *arg;
+};
+
+#define MEMLOCK_DUE_LOCAL 8
+
+/*
+ * async grants of one handoff, run once the engine is unlocked. they are
+ * copied out under the mutex: by the time a callback runs another may
+ * have unlocked and requeued the same memlock.
+ */
+struct memlock_due {
+    struct memlock_grant *g;    /* NULL while local is big enough */
+    unsigned int n;
+    unsigned int size;
+    struct memlock_grant local[MEMLOCK_DUE_LOCAL];
+};
+
+static pthread_mutex_t engine = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+
+static void memlock_init_once(void)
+{
+    hash_init();
+    hashlist_init();
+
+    return;
+}
+
+int memlock_init(void)
+{
+    return pthread_once(&engine_once, memlock_init_once) == 0 ? 0 : -1;
+}
+
+struct memlock *memlock_new(void)
+{
+    struct memlock *l = NULL;
+
+    if (memlock_init() != 0) {
+        return NULL;
+    }
+
+    l = (struct memlock *)calloc(1, sizeof(struct memlock));
+    if (l == NULL) {
+        return NULL;
+    }
+
+    INIT_LIST_HEAD(&l->w.node);
+    l->state = ml_idle;
+
+    if (pthread_cond_init(&l->cond, NULL) != 0) {
+        free(l);
+        return NULL;
+    }
+
+    return l;
+}
+
+static void memlock_granted(struct item_waiter *w, struct item *it, void *arg)
+{
+    struct memlock_due *due = (struct memlock_due *)arg;
+    struct memlock *l = list_entry(w, struct memlock, w);
+    struct memlock_grant *g = NULL;
+
+    l->state = ml_held;
+    l->gen = it->gen;
+
+    if (l->fn == NULL) {
+        pthread_cond_signal(&l->cond);
+        return;
+    }
+
+    /* memlock_due_reserve() made room */
+    g = due->g != NULL ? &due->g[due->n] : &due->local[due->n];
+    g->l = l;
+    g->fn = l->fn;
+    g->arg = l->arg;
+    due->n++;
+
+    return;
+}
+
+/*
+ * room in due for a grant to every waiter of it, before it is handed
+ * off. returns 0, or -1 out of memory.
+ */
+static int memlock_due_reserve(struct memlock_due *due, const struct item *it)
+{
+    unsigned int want = due->n;
+    struct list_head *pos = NULL;
+    struct memlock_grant *g = NULL;
+
+    list_for_each(pos, &it->waiters) {
+        want++;
+    }
+
+    if (want <= MEMLOCK_DUE_LOCAL || want <= due->size) {
+        return 0;
+    }
+
+    g = (struct memlock_grant *)realloc(due->g, want * sizeof(struct memlock_grant));
+    if (g == NULL) {
+        return -1;
+    }
+
+    if (due->g == NULL) {
+        memcpy(g, due->local, due->n * sizeof(struct memlock_grant));
+    }
+    due->g = g;
+    due->size = want;
+
+    return 0;
+}
+
+static void memlock_run_due(struct memlock_due *due)
+{
+    unsigned int i = 0;
+    struct memlock_grant *g = due->g != NULL ? due->g : due->local;
+
+    for (i = 0; i < due->n; i++) {
+        g[i].fn(g[i].l, g[i].arg);
+    }
+
+    free(due->g);
+
+    return;
+}
+
+/*
+ * queue or grant l on ik, with the engine mutex held.
+ * returns 0 granted, 1 waiting, -1 failed.
+ */
+static int memlock_request(struct memlock *l, const struct item_key *ik, int flags)
+{
+    int ret = 0;
+
+    if (l->state != ml_idle) {
+        return -1;
+    }
+
+    ret = hashlist_setlock(ik, flags, &l->w, &l->it);
+    if (ret < 0) {
+        l->it = NULL;
+        return -1;
+    }
+
+    if (ret == 0) {
+        l->state = ml_held;
+        l->gen = l->it->gen;
+        return 0;
+    }
+
+    l->state = ml_waiting;
+
+    return 1;
+}
+
+/*
+ * lock key, waiting for it as long as it takes.
+ * returns 0, or -1 if l already holds or waits for a lock.
+ */
+int memlock_lock(struct memlock *l, const char *key, size_t nkey, int flags)
+{
+    int ret = 0;
+    struct item_key ik;
+
+    item_key_init(&ik, key, nkey);
+
+    pthread_mutex_lock(&engine);
+
+    l->fn = NULL;
+    ret = memlock_request(l, &ik, flags & MEMLOCK_WRITE);
+    if (ret > 0) {
+        while (l->state != ml_held) {
+            pthread_cond_wait(&l->cond, &engine);
+        }
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&engine);
+
+    return ret;
+}
+
+/*
+ * lock key only if that needs no waiting, as the daemon's 'n' flag.
+ * returns 0, 1 if it is taken, or -1 if l is busy.
+ */
+int memlock_trylock(struct memlock *l, const char *key, size_t nkey, int flags)
+{
+    int ret = 0;
+    struct item_key ik;
+
+    item_key_init(&ik, key, nkey);
+
+    pthread_mutex_lock(&engine);
+
+    if (l->state != ml_idle) {
+        ret = -1;
+    }
+    else {
+        l->fn = NULL;
+        ret = memlock_request(l, &ik, (flags & MEMLOCK_WRITE) | EM_NONBLOCK) == 0 ? 0 : 1;
+    }
+
+    pthread_mutex_unlock(&engine);
+
+    return ret;
+}
+
+/*
+ * lock key without blocking the caller: fn(l, arg) is called once it is
+ * granted. returns 0 if it was granted right away, fn is not called
+ * then, 1 if queued, or -1 if l is busy.
+ */
+int memlock_lock_async(struct memlock *l, const char *key, size_t nkey, int flags,
+        memlock_granted_fn fn, void *arg)
+{
+    int ret = 0;
+    struct item_key ik;
+
+    item_key_init(&ik, key, nkey);
+
+    pthread_mutex_lock(&engine);
+
+    if (l->state == ml_idle) {
+        l->fn = fn;
+        l->arg = arg;
+    }
+    ret = memlock_request(l, &ik, flags & MEMLOCK_WRITE);
+
+    pthread_mutex_unlock(&engine);
+
+    return ret;
+}
+
+/*
+ * drop our hold or place in the queue, with the engine mutex held.
+ * returns 0, or -1 if l is idle or there is no memory for the grants,
+ * l is left as it was then.
+ */
+static int memlock_release(struct memlock *l, struct memlock_due *due)
+{
+    struct item *it = l->it;
+
+    if (l->state != ml_idle && memlock_due_reserve(due, it) != 0) {
+        return -1;
+    }
+
+    if (l->state == ml_held) {
+        l->it = NULL;
+        l->state = ml_idle;
+        if (hashlist_setunlock(it) > 0) {
+            hashlist_handoff(it, memlock_granted, due);
+        }
+        return 0;
+    }
+
+    if (l->state == ml_waiting) {
+        /* readers queued behind us may go now */
+        list_del_init(&l->w.node);
+        l->it = NULL;
+        l->state = ml_idle;
+        hashlist_handoff(it, memlock_granted, due);
+        return 0;
+    }
+
+    return -1;
+}
+
+/* returns 0, or -1 if l holds no lock or out of memory */
+int memlock_unlock(struct memlock *l)
+{
+    int ret = 0;
+    struct memlock_due due = {NULL, 0, 0};
+
+    pthread_mutex_lock(&engine);
+
+    ret = l->state == ml_held ? memlock_release(l, &due) : -1;
+
+    pthread_mutex_unlock(&engine);
+
+    memlock_run_due(&due);
+
+    return ret;
+}
+
+/*
+ * give up waiting for an async lock. returns 0, or -1 if l is not
+ * waiting: it was granted meanwhile, and is to be unlocked instead, or
+ * out of memory.
+ */
+int memlock_cancel(struct memlock *l)
+{
+    int ret = 0;
+    struct memlock_due due = {NULL, 0, 0};
+
+    pthread_mutex_lock(&engine);
+
+    ret = l->state == ml_waiting ? memlock_release(l, &due) : -1;
+
+    pthread_mutex_unlock(&engine);
+
+    memlock_run_due(&due);
+
+    return ret;
+}
+
+/* the fencing token of the lock l holds */
+uint64_t memlock_gen(const struct memlock *l)
+{
+    return l->gen;
+}
+
+/* returns 1 and fills in info if key is locked, 0 if not */
+int memlock_find(const char *key, size_t nkey, struct memlock_info *info)
+{
+    struct item *it = NULL;
+    struct item_key ik;
+    struct list_head *pos = NULL;
+
+    if (memlock_init() != 0) {
+        return 0;
+    }
+
+    item_key_init(&ik, key, nkey);
+
+    pthread_mutex_lock(&engine);
+
+    it = hashlist_findlock(&ik);
+    if (it != NULL && info != NULL) {
+        info->write = (it->val & EM_WRITE) != 0;
+        info->holders = it->ref;
+        info->gen = it->gen;
+        info->waiters = 0;
+        list_for_each(pos, &it->waiters) {
+            info->waiters++;
+        }
+    }
+
+    pthread_mutex_unlock(&engine);
+
+    return it != NULL;
+}
+
+/*
+ * who goes first on contended keys under prefix, or on all others with
+ * a NULL prefix: MEMLOCK_FAIR_*. keys locked at the time keep theirs.
+ * returns 0, or -1 if there are too many prefixes.
+ */
+int memlock_fairness(const char *prefix, size_t nprefix, int policy)
+{
+    int ret = 0;
+
+    if (memlock_init() != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&engine);
+    ret = hashlist_fairness(prefix, nprefix, policy);
+    pthread_mutex_unlock(&engine);
+
+    return ret;
+}
+
+/* releases whatever l holds or waits for */
+void memlock_free(struct memlock *l)
+{
+    struct memlock_due due = {NULL, 0, 0};
+
+    if (l == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&engine);
+    while (memlock_release(l, &due) != 0 && l->state != ml_idle) {
+        /* no memory for the grants, l can't be freed while queued */
+        pthread_mutex_unlock(&engine);
+        pthread_mutex_lock(&engine);
+    }
+    pthread_mutex_unlock(&engine);
+
+    memlock_run_due(&due);
+
+    pthread_cond_destroy(&l->cond);
+    free(l);
+
+    return;
+}
@@ -0,0 +1,108 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _MEMLOCK_H_
+#define _MEMLOCK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libmemlock: the lock engine of memlockd, in process, for the threads
+ * of one program. The semantics are the daemon's: read locks are shared,
+ * write locks exclusive, and blocked requests are granted in arrival
+ * order unless memlock_fairness() says otherwise. Every call is thread
+ * safe.
+ *
+ * A struct memlock is one lock request, like a connection to the daemon
+ * it holds or waits for one key at a time, and is reused from one lock
+ * to the next. It must not be used by two threads at once.
+ */
+
+#define MEMLOCK_READ  0x00
+#define MEMLOCK_WRITE 0x01
+
+/* memlock_fairness(), the ITEM_FAIR_* of the daemon's -f */
+#define MEMLOCK_FAIR_READER 0  /* readers join readers past waiting writers */
+#define MEMLOCK_FAIR_WRITER 1  /* waiting writers go before any reader */
+#define MEMLOCK_FAIR_PHASE  2  /* read and write phases take turns */
+
+struct memlock;
+
+struct memlock_info {
+    int      write;    /* held for writing */
+    int      holders;
+    int      waiters;
+    uint64_t gen;      /* fencing generation of the last grant */
+};
+
+/*
+ * a queued memlock_lock_async() was granted. called from the thread that
+ * released the lock, with no library lock held.
+ */
+typedef void (*memlock_granted_fn)(struct memlock *l, void *arg);
+
+int memlock_init(void);
+
+struct memlock *memlock_new(void);
+
+void memlock_free(struct memlock *l);
+
+int memlock_lock(struct memlock *l, const char *key, size_t nkey, int flags);
+
+int memlock_trylock(struct memlock *l, const char *key, size_t nkey, int flags);
+
+int memlock_lock_async(struct memlock *l, const char *key, size_t nkey, int flags,
+        memlock_granted_fn fn, void *arg);
+
+int memlock_cancel(struct memlock *l);
+
+int memlock_unlock(struct memlock *l);
+
+uint64_t memlock_gen(const struct memlock *l);
+
+int memlock_find(const char *key, size_t nkey, struct memlock_info *info);
+
+int memlock_fairness(const char *prefix, size_t nprefix, int policy);
+
+/*
+ * Same host locks in the shared memory segment of a memlockd -X. They
+ * are a key space of their own, apart from the daemon's table, for keys
+ * of up to 40 bytes. A struct shmlock is one client of the segment: one
+ * per thread, like a struct memlock, and it may hold many keys. Holds of
+ * a process that dies are released by the daemon.
+ */
+struct shmlock;
+
+struct shmlock *shmlock_attach(const char *path);
+
+void shmlock_detach(struct shmlock *h);
+
+int shmlock_lock(struct shmlock *h, const char *key, size_t nkey, int flags);
+
+int shmlock_trylock(struct shmlock *h, const char *key, size_t nkey, int flags);
+
+int shmlock_unlock(struct shmlock *h, const char *key, size_t nkey);
+
+/*
+ * The daemon's protocol over a pair of shared memory rings, set up on
+ * the unix socket of a memlockd -s: commands and replies as on the
+ * socket, without a read or write syscall for each. Commands may be
+ * queued back to back and their replies read in order. One per thread.
+ */
+struct shmring;
+
+struct shmring *shmring_connect(const char *path);
+
+void shmring_close(struct shmring *r);
+
+int shmring_send(struct shmring *r, const char *buf, size_t len);
+
+int shmring_recv(struct shmring *r, char *line, size_t size);
+
+#endif
@@ -0,0 +1,1020 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * memlock-proxy: terminates client connections and runs their requests
+ * over a small pool of daemon connections.
+ *
+ * A lock belongs to the daemon connection it was taken on, so a client
+ * holding or waiting for a lock is bound to a backend conn until it
+ * gives the lock up; the conn then goes back to the pool for the next
+ * client. Daemon connections scale with the locks held and waited for at
+ * a time instead of with the clients connected. "find" takes nothing and
+ * is pipelined with everyone else's over one shared conn per backend.
+ *
+ * With several -B backends the keys are spread over them by the cluster
+ * ring, the map memlockd -C uses.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "event.h"
+#include "list.h"
+#include "log.h"
+#include "daemon.h"
+#include "cluster.h"
+
+#define PACKAGE "memlock-proxy"
+#define PROXY_VERSION "1.0"
+
+#define PROXY_PORT 9971
+#define POOL_IDLE_DEFAULT 8
+#define LINE_MAX_SIZE 4096
+#define READ_SIZE 4096
+
+enum pconn_types {
+    pc_listen,
+    pc_client,
+    pc_bound,    /* backend conn lent to one client */
+    pc_shared,   /* backend conn pipelining everyone's finds */
+    pc_idle,     /* backend conn in the pool */
+    pc_orphan,   /* backend conn unlocking for a client that left */
+};
+
+struct pbuf {
+    char   *data;
+    size_t len;
+    size_t size;
+};
+
+struct backend;
+
+struct pconn {
+    int    fd;
+    int    type;
+    int    connecting;
+    int    dead;         /* close at the next event */
+    short  ev_flags;
+    struct event ev;
+    struct pbuf in;
+    struct pbuf out;
+    struct pconn *peer;  /* client and its bound backend conn */
+    struct backend *be;
+    int    inflight;     /* requests sent on, not answered yet */
+    int    held;         /* bound: the daemon granted us the lock */
+    struct pending *wait;    /* client: its request on the shared conn */
+    struct list_head node;   /* pool of the backend */
+    struct list_head queue;  /* shared: pending requests in order */
+};
+
+/* a request on the shared conn, client is NULL once it has gone */
+struct pending {
+    struct pconn *client;
+    struct list_head node;
+};
+
+struct backend {
+    const char *name;
+    struct addrinfo *ai;
+    struct list_head idle;
+    int    nidle;
+    struct pconn *shared;
+};
+
+static struct {
+    unsigned long long clients;
+    unsigned long long total_clients;
+    unsigned long long backend_conns;
+    unsigned long long requests;
+    unsigned long long reused;      /* locks taken on a pooled conn */
+    unsigned long long pipelined;   /* finds sent over a shared conn */
+} pstats;
+
+static struct event_base *base = NULL;
+static struct backend *backends = NULL;
+static int nbackends = 0;
+static int pool_idle = POOL_IDLE_DEFAULT;
+
+static void pconn_event(const int fd, const short which, void *arg);
+static void client_close(struct pconn *c);
+
+static int pbuf_add(struct pbuf *b, const char *data, size_t len)
+{
+    size_t size = b->size ? b->size : 256;
+    char *p = NULL;
+
+    while (b->len + len > size) {
+        size *= 2;
+    }
+
+    if (size != b->size) {
+        p = realloc(b->data, size);
+        if (p == NULL) {
+            return -1;
+        }
+        b->data = p;
+        b->size = size;
+    }
+
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+
+    return 0;
+}
+
+static void pbuf_consume(struct pbuf *b, size_t len)
+{
+    memmove(b->data, b->data + len, b->len - len);
+    b->len -= len;
+
+    return;
+}
+
+static void pconn_update(struct pconn *pc)
+{
+    short flags = EV_READ | EV_PERSIST;
+
+    if (pc->out.len > 0 || pc->connecting) {
+        flags |= EV_WRITE;
+    }
+
+    if (pc->ev_flags == flags) {
+        return;
+    }
+
+    event_del(&pc->ev);
+    event_set(&pc->ev, pc->fd, flags, pconn_event, pc);
+    event_base_set(base, &pc->ev);
+    event_add(&pc->ev, NULL);
+    pc->ev_flags = flags;
+
+    return;
+}
+
+/* a failed pconn is closed from its own event, never under a caller */
+static void pconn_kill(struct pconn *pc)
+{
+    pc->dead = 1;
+    event_active(&pc->ev, EV_WRITE, 0);
+
+    return;
+}
+
+static struct pconn *pconn_new(int fd, int type)
+{
+    struct pconn *pc = NULL;
+
+    pc = (struct pconn *)calloc(1, sizeof(struct pconn));
+    if (pc == NULL) {
+        return NULL;
+    }
+
+    pc->fd = fd;
+    pc->type = type;
+    INIT_LIST_HEAD(&pc->node);
+    INIT_LIST_HEAD(&pc->queue);
+
+    event_set(&pc->ev, fd, EV_READ | EV_PERSIST, pconn_event, pc);
+    event_base_set(base, &pc->ev);
+    event_add(&pc->ev, NULL);
+    pc->ev_flags = EV_READ | EV_PERSIST;
+
+    return pc;
+}
+
+static void pconn_free(struct pconn *pc)
+{
+    event_del(&pc->ev);
+    close(pc->fd);
+
+    free(pc->in.data);
+    free(pc->out.data);
+    free(pc);
+
+    return;
+}
+
+/* write now if we can, keep what the socket does not take */
+static void pconn_send(struct pconn *pc, const char *line, size_t len)
+{
+    ssize_t n = 0;
+
+    if (pc->out.len == 0 && !pc->connecting) {
+        n = write(pc->fd, line, len);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            pconn_kill(pc);
+            return;
+        }
+        if (n == (ssize_t)len) {
+            return;
+        }
+        if (n > 0) {
+            line += n;
+            len -= n;
+        }
+    }
+
+    if (pbuf_add(&pc->out, line, len) != 0) {
+        pconn_kill(pc);
+        return;
+    }
+
+    pconn_update(pc);
+
+    return;
+}
+
+static void pconn_sendline(struct pconn *pc, const char *line)
+{
+    char buf[LINE_MAX_SIZE + 2];
+    size_t len = strlen(line);
+
+    if (len > LINE_MAX_SIZE) {
+        len = LINE_MAX_SIZE;
+    }
+
+    memcpy(buf, line, len);
+    memcpy(buf + len, "\r\n", 2);
+
+    pconn_send(pc, buf, len + 2);
+
+    return;
+}
+
+/* -1 if the peer is gone or broken */
+static int pconn_flush(struct pconn *pc)
+{
+    ssize_t n = 0;
+
+    while (pc->out.len > 0) {
+        n = write(pc->fd, pc->out.data, pc->out.len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        pbuf_consume(&pc->out, n);
+    }
+
+    pconn_update(pc);
+
+    return 0;
+}
+
+/* 0 on EAGAIN, -1 on EOF or error */
+static int pconn_fill(struct pconn *pc)
+{
+    char buf[READ_SIZE];
+    ssize_t n = 0;
+
+    while (1) {
+        n = read(pc->fd, buf, sizeof(buf));
+        if (n > 0) {
+            if (pbuf_add(&pc->in, buf, n) != 0) {
+                return -1;
+            }
+            if (n < (ssize_t)sizeof(buf)) {
+                return 0;
+            }
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return -1;
+    }
+}
+
+/*
+ * the next line of pc->in or NULL. *len is its length without the CRLF,
+ * *used with it; the line is not terminated.
+ */
+static char *pconn_line(struct pconn *pc, size_t *len, size_t *used)
+{
+    char *el = NULL;
+
+    if (pc->in.len == 0) {
+        return NULL;
+    }
+
+    el = memchr(pc->in.data, '\n', pc->in.len);
+    if (el == NULL) {
+        return NULL;
+    }
+
+    *used = el - pc->in.data + 1;
+    if (el > pc->in.data && *(el - 1) == '\r') {
+        el--;
+    }
+    *len = el - pc->in.data;
+
+    return pc->in.data;
+}
+
+static struct pconn *backend_connect(struct backend *be, int type)
+{
+    int fd = -1;
+    int flags = 1;
+    struct pconn *pc = NULL;
+
+    fd = socket(be->ai->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0
+            || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    if (connect(fd, be->ai->ai_addr, be->ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        log_printf(LOGL_VERBOSE, "connect to %s: %s\n", be->name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    pc = pconn_new(fd, type);
+    if (pc == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    pc->be = be;
+    pc->connecting = 1;
+    pconn_update(pc);
+
+    pstats.backend_conns++;
+
+    return pc;
+}
+
+static void backend_free(struct pconn *b)
+{
+    if (b->type == pc_idle) {
+        list_del(&b->node);
+        b->be->nidle--;
+    }
+
+    pstats.backend_conns--;
+    pconn_free(b);
+
+    return;
+}
+
+/* an idle conn to be, or a new one */
+static struct pconn *pool_get(struct backend *be)
+{
+    struct pconn *b = NULL;
+
+    if (list_empty(&be->idle)) {
+        return backend_connect(be, pc_bound);
+    }
+
+    b = list_entry(be->idle.next, struct pconn, node);
+    list_del_init(&b->node);
+    be->nidle--;
+    b->type = pc_bound;
+
+    pstats.reused++;
+
+    return b;
+}
+
+static void pool_put(struct pconn *b)
+{
+    b->peer = NULL;
+    b->held = 0;
+    b->inflight = 0;
+
+    if (b->dead || b->be->nidle >= pool_idle) {
+        b->type = pc_orphan;
+        pconn_kill(b);
+        return;
+    }
+
+    b->type = pc_idle;
+    list_add(&b->node, &b->be->idle);
+    b->be->nidle++;
+
+    return;
+}
+
+static void client_reply(struct pconn *c, const char *line)
+{
+    pconn_sendline(c, line);
+
+    /* lines held back behind this reply may go now */
+    if (c->in.len > 0) {
+        event_active(&c->ev, EV_READ, 0);
+    }
+
+    return;
+}
+
+static void client_forward(struct pconn *c, struct pconn *b, const char *line)
+{
+    pconn_sendline(b, line);
+
+    b->inflight++;
+    c->inflight++;
+    pstats.requests++;
+
+    return;
+}
+
+static void process_stats(struct pconn *c)
+{
+    char buf[512] = {0};
+
+    snprintf(buf, sizeof(buf),
+            "+OK, proxy stats:\r\n"
+            "current clients: %llu\r\ntotal clients: %llu\r\n"
+            "backend conns: %llu\r\nrequests: %llu\r\n"
+            "pooled lock conns reused: %llu\r\npipelined finds: %llu",
+            pstats.clients, pstats.total_clients, pstats.backend_conns,
+            pstats.requests, pstats.reused, pstats.pipelined);
+
+    client_reply(c, buf);
+
+    return;
+}
+
+/* a find for key may go down the conn c is bound to: the same backend owns key */
+static int find_on_peer(const struct pconn *c, const char *key, int nkey)
+{
+    return c->peer != NULL && c->peer->be == &backends[cluster_node(key, nkey)];
+}
+
+/*
+ * one request of c. lock, unlock and find go to the daemon, the rest is
+ * answered here. returns -1 if c was closed.
+ */
+static int client_line(struct pconn *c, const char *line)
+{
+    int  nkey = 0;
+    char *cmd = NULL;
+    char *key = NULL;
+    char *save = NULL;
+    char copy[LINE_MAX_SIZE + 1];
+    struct backend *be = NULL;
+    struct pending *p = NULL;
+
+    if (strlen(line) > LINE_MAX_SIZE) {
+        client_reply(c, "-ERR, bad command line format");
+        return 0;
+    }
+
+    strcpy(copy, line);
+
+    cmd = strtok_r(copy, " ", &save);
+    key = cmd != NULL ? strtok_r(NULL, " ", &save) : NULL;
+    nkey = key != NULL ? strlen(key) : 0;
+
+    if (cmd == NULL) {
+        client_reply(c, "-ERR, unimplemented");
+    }
+    else if (strcmp(cmd, "lock") == 0 && key != NULL) {
+        if (c->peer == NULL) {
+            be = &backends[cluster_node(key, nkey)];
+            c->peer = pool_get(be);
+            if (c->peer == NULL) {
+                client_reply(c, "-ERR, backend unavailable");
+                return 0;
+            }
+            c->peer->peer = c;
+        }
+        client_forward(c, c->peer, line);
+    }
+    else if (strcmp(cmd, "unlock") == 0) {
+        if (c->peer == NULL) {
+            client_reply(c, "-ERR, sequence error");
+        }
+        else {
+            client_forward(c, c->peer, line);
+        }
+    }
+    else if (strcmp(cmd, "find") == 0 && key != NULL) {
+        if (find_on_peer(c, key, nkey)) {
+            client_forward(c, c->peer, line);
+            return 0;
+        }
+
+        be = &backends[cluster_node(key, nkey)];
+        if (be->shared == NULL) {
+            be->shared = backend_connect(be, pc_shared);
+        }
+        p = (struct pending *)calloc(1, sizeof(struct pending));
+        if (be->shared == NULL || p == NULL) {
+            free(p);
+            client_reply(c, "-ERR, backend unavailable");
+            return 0;
+        }
+
+        p->client = c;
+        c->wait = p;
+        list_add_tail(&p->node, &be->shared->queue);
+        client_forward(c, be->shared, line);
+        pstats.pipelined++;
+    }
+    else if (strcmp(cmd, "quit") == 0) {
+        client_close(c);
+        return -1;
+    }
+    else if (strcmp(cmd, "stats") == 0 && key == NULL) {
+        process_stats(c);
+    }
+    else if (strcmp(cmd, "help") == 0) {
+        client_reply(c, "+OK, lock proxy command usage (V" PROXY_VERSION "):\r\n"
+                "lock key_string {n | w/r | d}\r\nunlock\r\n"
+                "quit\r\nfind key_string\r\nstats\r\nhelp");
+    }
+    else {
+        client_reply(c, "-ERR, unimplemented");
+    }
+
+    return 0;
+}
+
+/*
+ * requests are answered in order. lines for the conn c is bound to may
+ * follow each other, the daemon answers them in order; anything else,
+ * or anything behind a find on a shared conn, waits until everything
+ * before it is answered.
+ */
+static int client_process(struct pconn *c)
+{
+    char   *line = NULL;
+    size_t len = 0;
+    size_t used = 0;
+    int    bound_cmd = 0;
+    char   *key = NULL;
+    char   *end = NULL;
+
+    while ((line = pconn_line(c, &len, &used)) != NULL) {
+        bound_cmd = (len > 5 && strncmp(line, "lock ", 5) == 0)
+            || (len == 6 && strncmp(line, "unlock", 6) == 0);
+
+        if (len > 5 && strncmp(line, "find ", 5) == 0) {
+            /* only a find for a key of the bound backend follows it */
+            key = line + 5;
+            end = (char *)memchr(key, ' ', len - 5);
+            bound_cmd = find_on_peer(c, key, end != NULL ? end - key : line + len - key);
+        }
+
+        if (c->inflight > 0 && (c->peer == NULL || !bound_cmd || c->wait != NULL)) {
+            return 0;
+        }
+
+        line[len] = '\0';
+        if (client_line(c, line) < 0) {
+            return -1;
+        }
+
+        pbuf_consume(&c->in, used);
+    }
+
+    if (c->in.len > LINE_MAX_SIZE) {
+        client_close(c);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void client_close(struct pconn *c)
+{
+    struct pconn *b = c->peer;
+
+    if (c->wait != NULL) {
+        c->wait->client = NULL;
+    }
+
+    if (b != NULL) {
+        c->peer = NULL;
+        b->peer = NULL;
+
+        if (b->inflight > 0) {
+            /* maybe queued for the lock: only closing takes us off */
+            b->type = pc_orphan;
+            pconn_kill(b);
+        }
+        else if (b->held) {
+            b->type = pc_orphan;
+            pconn_sendline(b, "unlock");
+            b->inflight = 1;
+        }
+        else {
+            pool_put(b);
+        }
+    }
+
+    pstats.clients--;
+    pconn_free(c);
+
+    return;
+}
+
+/* one reply from the daemon. returns -1 if b was closed */
+static int backend_line(struct pconn *b, const char *line)
+{
+    struct pconn *c = NULL;
+    struct pending *p = NULL;
+
+    switch (b->type) {
+        case pc_bound:
+            c = b->peer;
+            b->inflight--;
+            c->inflight--;
+
+            if (strcmp(line, "+OK, lock success") == 0) {
+                b->held = 1;
+            }
+            else if (strcmp(line, "+OK, unlock success") == 0) {
+                b->held = 0;
+            }
+
+            client_reply(c, line);
+
+            if (b->inflight == 0 && !b->held) {
+                c->peer = NULL;
+                pool_put(b);
+                return b->type == pc_idle ? 0 : -1;
+            }
+            return 0;
+
+        case pc_shared:
+            if (list_empty(&b->queue)) {
+                break;
+            }
+
+            p = list_entry(b->queue.next, struct pending, node);
+            list_del(&p->node);
+            b->inflight--;
+
+            c = p->client;
+            if (c != NULL) {
+                c->wait = NULL;
+                c->inflight--;
+                client_reply(c, line);
+            }
+            free(p);
+            return 0;
+
+        case pc_orphan:
+            /* the unlock for a client that left */
+            if (strcmp(line, "+OK, unlock success") == 0) {
+                pool_put(b);
+                return b->type == pc_idle ? 0 : -1;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    log_printf(LOGL_VERBOSE, "unexpected reply from %s: %s\n", b->be->name, line);
+    if (b->type == pc_idle) {
+        list_del_init(&b->node);
+        b->be->nidle--;
+        b->type = pc_orphan;
+    }
+    pconn_kill(b);
+
+    return -1;
+}
+
+/* the daemon conn b failed: tell whoever was waiting on it */
+static void backend_close(struct pconn *b)
+{
+    struct pconn *c = b->peer;
+    struct pending *p = NULL;
+
+    log_printf(LOGL_VERBOSE, "lost backend conn to %s\n", b->be->name);
+
+    if (b->type == pc_bound && c != NULL) {
+        c->peer = NULL;
+        if (b->held) {
+            /* the lock went with the conn, so does the client */
+            client_close(c);
+        }
+        else {
+            while (b->inflight-- > 0) {
+                c->inflight--;
+                client_reply(c, "-ERR, backend unavailable");
+            }
+        }
+    }
+    else if (b->type == pc_shared) {
+        b->be->shared = NULL;
+        while (!list_empty(&b->queue)) {
+            p = list_entry(b->queue.next, struct pending, node);
+            list_del(&p->node);
+            if (p->client != NULL) {
+                p->client->wait = NULL;
+                p->client->inflight--;
+                client_reply(p->client, "-ERR, backend unavailable");
+            }
+            free(p);
+        }
+    }
+
+    backend_free(b);
+
+    return;
+}
+
+static void backend_event(struct pconn *b, const short which)
+{
+    int err = 0;
+    char *line = NULL;
+    size_t n = 0;
+    size_t used = 0;
+    socklen_t len = sizeof(err);
+
+    if (b->dead) {
+        backend_close(b);
+        return;
+    }
+
+    if (b->connecting && (which & EV_WRITE)) {
+        if (getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            log_printf(LOGL_VERBOSE, "connect to %s: %s\n", b->be->name, strerror(err));
+            backend_close(b);
+            return;
+        }
+        b->connecting = 0;
+    }
+
+    if ((which & EV_WRITE) && pconn_flush(b) < 0) {
+        backend_close(b);
+        return;
+    }
+
+    if (which & EV_READ) {
+        if (pconn_fill(b) < 0) {
+            backend_close(b);
+            return;
+        }
+
+        while ((line = pconn_line(b, &n, &used)) != NULL) {
+            line[n] = '\0';
+            if (backend_line(b, line) < 0) {
+                return;
+            }
+            pbuf_consume(&b->in, used);
+        }
+    }
+
+    return;
+}
+
+static void client_event(struct pconn *c, const short which)
+{
+    if (c->dead) {
+        client_close(c);
+        return;
+    }
+
+    if ((which & EV_WRITE) && pconn_flush(c) < 0) {
+        client_close(c);
+        return;
+    }
+
+    if (which & EV_READ) {
+        if (pconn_fill(c) < 0) {
+            client_close(c);
+            return;
+        }
+        client_process(c);
+    }
+
+    return;
+}
+
+static void listen_event(struct pconn *l)
+{
+    int fd = -1;
+    int one = 1;
+    int flags = 0;
+
+    while ((fd = accept(l->fd, NULL, NULL)) >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if ((flags = fcntl(fd, F_GETFL, 0)) < 0
+                || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0
+                || pconn_new(fd, pc_client) == NULL) {
+            close(fd);
+            continue;
+        }
+
+        pstats.clients++;
+        pstats.total_clients++;
+    }
+
+    return;
+}
+
+static void pconn_event(const int fd, const short which, void *arg)
+{
+    struct pconn *pc = (struct pconn *)arg;
+
+    switch (pc->type) {
+        case pc_listen:
+            listen_event(pc);
+            break;
+        case pc_client:
+            client_event(pc, which);
+            break;
+        default:
+            backend_event(pc, which);
+            break;
+    }
+
+    return;
+}
+
+static int proxy_listen(const char *inter, int port)
+{
+    int fd = -1;
+    int flags = 1;
+    char portbuf[16];
+    struct addrinfo hints, *ai = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    snprintf(portbuf, sizeof(portbuf), "%d", port);
+    if (getaddrinfo(inter, portbuf, &hints, &ai) != 0) {
+        fprintf(stderr, "getaddrinfo(): cannot resolve %s\n", inter ? inter : "*");
+        return -1;
+    }
+
+    fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flags, sizeof(flags));
+
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, 1024) < 0
+            || (flags = fcntl(fd, F_GETFL, 0)) < 0
+            || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        fprintf(stderr, "cannot listen on port %d: %s\n", port, strerror(errno));
+        close(fd);
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    freeaddrinfo(ai);
+
+    if (pconn_new(fd, pc_listen) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int backends_init(const char *list)
+{
+    int i = 0;
+    char host[256];
+    const char *name = NULL;
+    const char *colon = NULL;
+    struct addrinfo hints;
+
+    nbackends = cluster_init(list, NULL, 0);
+    if (nbackends <= 0) {
+        return -1;
+    }
+
+    backends = (struct backend *)calloc(nbackends, sizeof(struct backend));
+    if (backends == NULL) {
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    for (i = 0; i < nbackends; i++) {
+        name = cluster_name(i);
+        colon = strrchr(name, ':');
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - name), name);
+
+        if (getaddrinfo(host, colon + 1, &hints, &backends[i].ai) != 0) {
+            fprintf(stderr, "cannot resolve backend %s\n", name);
+            return -1;
+        }
+
+        backends[i].name = name;
+        INIT_LIST_HEAD(&backends[i].idle);
+    }
+
+    return 0;
+}
+
+static void usage(void)
+{
+    printf(PACKAGE " " PROXY_VERSION "\n");
+    printf("-B <list>     memlockd backends, host:port,...; keys are spread over\n"
+           "              several the way memlockd -C does\n"
+           "-p <num>      TCP port number to listen on (default: %d)\n"
+           "-l <ip_addr>  interface to listen on, default is INDRR_ANY\n"
+           "-i <num>      idle conns kept per backend (default: %d)\n"
+           "-d            run as a daemon\n"
+           "-v            verbose\n"
+           "-h            print this help and exit\n",
+           PROXY_PORT, POOL_IDLE_DEFAULT);
+
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    int  c = 0;
+    int  port = PROXY_PORT;
+    int  verbose = 0;
+    int  do_daemonize = 0;
+    char *inter = NULL;
+    char *list = NULL;
+
+    while ((c = getopt(argc, argv, "B:p:l:i:dvh")) != -1) {
+        switch (c) {
+            case 'B':
+                list = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'l':
+                inter = optarg;
+                break;
+            case 'i':
+                pool_idle = atoi(optarg);
+                break;
+            case 'd':
+                do_daemonize = 1;
+                break;
+            case 'v':
+                verbose++;
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            default:
+                fprintf(stderr, "Illegal argument \"%c\"\n", c);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (list == NULL) {
+        fprintf(stderr, "no backends, use -B host:port\n");
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (do_daemonize && daemon_init() == -1) {
+        fprintf(stderr, "failed to daemon() in order to daemonize\n");
+        exit(EXIT_FAILURE);
+    }
+
+    log_level = verbose;
+    if (log_init(NULL, 0) != 0) {
+        fprintf(stderr, "failed to start logging\n");
+        exit(EXIT_FAILURE);
+    }
+
+    base = event_init();
+
+    if (backends_init(list) != 0 || proxy_listen(inter, port) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    event_base_loop(base, 0);
+
+    return 0;
+}
@@ -28,15 +28,28 @@
 #include "daemon.h"
 #include "socket.h"
 #include "item.h"
+#include "hash.h"
+#include "hotkeys.h"
+#include "metrics.h"
+#include "trace.h"
+#include "snapshot.h"
 #include "common.h"
+#include "journal.h"
+#include "repl.h"
+#include "hotrestart.h"
+#include "session.h"
+#include "cluster.h"
+#include "shm.h"
 
 #define PACKAGE "memlockd"
 
 #define SERVER_PORT 9970
+#define TRACE_FILE "/tmp/memlockd.trace"
 
 /* defaults */
 static void settings_init(void);
 static void signals_init(void);
+static void trace_signal_init(struct event_base *base);
 
 /* event handling, network IO */
 
@@ -54,18 +67,40 @@ static void usage(void)
 {
     printf(PACKAGE " " LOCKD_VERSION "\n");
     printf("-p <num>      TCP port number to listen on (default: %d)\n"
+           "-m <num>      TCP port to serve prometheus metrics on (default: off)\n"
            "-s <file>     unix socket path to listen on (disables network support)\n"
-           "-a <mask>     access mask for unix socket, in octal (default 0700)\n"
+           "-a <mask>     access mask for unix socket and -X file, in octal (default 0700)\n"
            "-l <ip_addr>  interface to listen on, default is INDRR_ANY\n"
            "-d            run as a daemon\n"
            "-u <username> assume identity of <username> (only when run as root)\n"
+           "-S <file>     snapshot the lock table to <file>, and restore it at startup\n"
+           "-I <sec>      seconds between snapshots, 0 only on demand (default: 60)\n"
+           "-g <sec>      seconds restored locks are kept for their owners (default: 30)\n"
+           "-J <file>     journal lock changes to <file>.N, replayed at startup\n"
+           "-M <num>      TCP port standbys connect to for replication (default: off)\n"
+           "-F <addr>     run as a standby of the primary at <addr>, host:port\n"
+           "-H <file>     unix socket for hot restart: take over from the process\n"
+           "              listening on it, then listen on it for a successor\n"
+           "-G <sec>      seconds a session keeps its lock after a disconnect (default: off)\n"
+           "-C <list>     cluster mode, keys are spread over the host:port,... nodes\n"
+           "-N <addr>     this node in the -C list (default: the entry on -p)\n"
+           "-X <file>     shared memory lock table for clients on this host, e.g. /dev/shm/memlock\n"
+           "-x <num>      keys the -X table has room for (default: 65536)\n"
+           "-O            keep an ordered key index for \"scan\" (default: off)\n"
+           "-f <policy>   who goes first on a contended key: reader, writer or phase\n"
+           "              (default: reader). <policy>:<prefix> sets it for the keys\n"
+           "              under <prefix> only, and may be given more than once\n"
+           "-T <file>     trace dump file, written on SIGUSR1 (default: %s)\n"
            "-c <num>      max simultaneous connections, default is 1024\n"
+           "-w <num>      pre-allocate <num> connection objects and buffers at startup\n"
+           "-L <file>     log to <file> instead of stderr\n"
+           "-R <mb>       rotate the log file every <mb> megabytes, 0 never (default: 64)\n"
            "-v            verbose (print errors/warnings while in event loop)\n"
            "-vv           very verbose (also print client commands/reponses)\n"
            "-h            print this help and exit\n"
            "-i            print license info\n"
            "-P <file>     save PID in <file>, only used with -d option\n",
-          SERVER_PORT);
+          SERVER_PORT, TRACE_FILE);
 #ifdef USE_THREADS
     printf("-t <num>      number of threads to use, default 4\n");
 #endif
@@ -73,6 +108,41 @@ static void usage(void)
     return;
 }
 
+/* -f policy[:prefix] */
+static int fairness_option(const char *arg)
+{
+    int  policy = 0;
+    size_t len = 0;
+    const char *prefix = NULL;
+
+    prefix = strchr(arg, ':');
+    len = prefix != NULL ? (size_t)(prefix - arg) : strlen(arg);
+
+    if (len == 6 && strncmp(arg, "reader", len) == 0) {
+        policy = ITEM_FAIR_READER;
+    }
+    else if (len == 6 && strncmp(arg, "writer", len) == 0) {
+        policy = ITEM_FAIR_WRITER;
+    }
+    else if (len == 5 && strncmp(arg, "phase", len) == 0) {
+        policy = ITEM_FAIR_PHASE;
+    }
+    else {
+        return -1;
+    }
+
+    if (prefix == NULL) {
+        return hashlist_fairness(NULL, 0, policy);
+    }
+
+    prefix++;
+    if (*prefix == '\0') {
+        return -1;
+    }
+
+    return hashlist_fairness(prefix, strlen(prefix), policy);
+}
+
 static void usage_license(void)
 {
     printf(PACKAGE " " LOCKD_VERSION "\n");
@@ -89,6 +159,7 @@ static void usage_license(void)
 int main(int argc, char *argv[])
 {
     int c = 0;
+    int taken = 0;
     int maxcore = 0;
     bool do_daemonize = false;
 
@@ -108,7 +179,7 @@ int main(int argc, char *argv[])
     setbuf(stderr, NULL);
 
     /* process arguments */
-    while ((c = getopt(argc, argv, "a:U:p:s:c:hivl:dru:P:t")) != -1) {
+    while ((c = getopt(argc, argv, "a:U:p:m:s:S:I:g:J:M:F:H:G:C:N:X:x:Of:T:c:w:hivl:L:R:dru:P:t")) != -1) {
         switch (c) {
             case 'a':
                 /* access for unix domain socket, as octal mask (like chmod)*/
@@ -117,12 +188,66 @@ int main(int argc, char *argv[])
             case 'p':
                 settings.port = atoi(optarg);
                 break;
+            case 'm':
+                settings.metrics_port = atoi(optarg);
+                break;
             case 's':
                 settings.socketpath = optarg;
                 break;
+            case 'S':
+                settings.snapshot_file = optarg;
+                break;
+            case 'I':
+                settings.snapshot_interval = atoi(optarg);
+                break;
+            case 'g':
+                settings.snapshot_grace = atoi(optarg);
+                break;
+            case 'J':
+                settings.journal_file = optarg;
+                break;
+            case 'M':
+                settings.repl_port = atoi(optarg);
+                break;
+            case 'F':
+                settings.repl_primary = optarg;
+                break;
+            case 'H':
+                settings.hot_path = optarg;
+                break;
+            case 'G':
+                settings.session_grace = atoi(optarg);
+                break;
+            case 'C':
+                settings.cluster_nodes = optarg;
+                break;
+            case 'N':
+                settings.cluster_self = optarg;
+                break;
+            case 'X':
+                settings.shm_file = optarg;
+                break;
+            case 'x':
+                settings.shm_slots = atoi(optarg);
+                break;
+            case 'O':
+                settings.ordered = true;
+                break;
+            case 'f':
+                if (fairness_option(optarg) != 0) {
+                    fprintf(stderr, "bad -f %s, want reader, writer or phase[:prefix]\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                settings.trace_file = optarg;
+                break;
             case 'c':
                 settings.maxconns = atoi(optarg);
                 break;
+            case 'w':
+                settings.prewarm_conns = atoi(optarg);
+                break;
             case 'h':
                 usage();
                 exit(EXIT_SUCCESS);
@@ -135,6 +260,12 @@ int main(int argc, char *argv[])
             case 'l':
                 settings.inter = strdup(optarg);
                 break;
+            case 'L':
+                settings.log_file = optarg;
+                break;
+            case 'R':
+                settings.log_rotate = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                break;
             case 'd':
                 do_daemonize = true;
                 break;
@@ -162,6 +293,13 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* a standby's table is whatever the primary sends it */
+    if (settings.repl_primary != NULL
+            && (settings.snapshot_file != NULL || settings.journal_file != NULL)) {
+        fprintf(stderr, "-F can't be combined with -S or -J\n");
+        exit(EXIT_FAILURE);
+    }
+
     /*
      * If needed, increase rlimits to allow as many connections
      * as needed.
@@ -214,18 +352,51 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* threads don't survive daemon_init(), start the log writer after it */
+    log_level = settings.verbose;
+    if (log_init(settings.log_file, settings.log_rotate) != 0) {
+        fprintf(stderr, "failed to start logging\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* initialize main thread libevent instance */
     main_base = event_init();
 
     /* initialize other stuff */
+    hash_init();
     hashlist_init();
+    if (settings.ordered) {
+        hashlist_index_init();
+    }
+    item_watch_hook = notify_watch_conns;
+    hotkeys_init();
     conn_init();
 
+    if (conn_prewarm(settings.prewarm_conns) != 0) {
+        fprintf(stderr, "failed to pre-allocate %d connections\n", settings.prewarm_conns);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cluster_init(settings.cluster_nodes, settings.cluster_self, settings.port) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
     stats.started = time(NULL);
 
     /* start up worker threads if MT mode */
     //thread_init(settings.num_threads, main_base);
 
+    INIT_LIST_HEAD(&listen_conn);
+
+    /* take the sockets and locks of a running predecessor, it exits */
+    if (settings.hot_path != NULL) {
+        taken = hotrestart_takeover(settings.hot_path, main_base);
+        if (taken < 0) {
+            fprintf(stderr, "failed to take over from %s\n", settings.hot_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if (do_daemonize) {
         if (daemon_already_running(pid_file) < 0) {
             fprintf(stderr, "server is already running.\n");
@@ -233,10 +404,11 @@ int main(int argc, char *argv[])
         }
     }
 
-    INIT_LIST_HEAD(&listen_conn);
-
-    /* create unix mode sockets after dropping privileges */
-    if (settings.socketpath != NULL) {
+    /*
+     * create unix mode sockets after dropping privileges, unless the
+     * listeners came with a handover
+     */
+    if (!taken && settings.socketpath != NULL) {
         if (socket_unix_init(settings.socketpath, settings.access)) {
             fprintf(stderr, "failed to listen\n");
             exit(EXIT_FAILURE);
@@ -244,17 +416,56 @@ int main(int argc, char *argv[])
     }
 
     /* create the listening socket, bind it, and init */
-    if (settings.socketpath == NULL) {
+    if (!taken && settings.socketpath == NULL) {
         if (socket_init(settings.port) < 0) {
             fprintf(stderr, "failed to listen\n");
             exit(EXIT_FAILURE);
         }
     }
 
-    /* start checkpoint and deadlock detect thread */
+    if (settings.metrics_port > 0) {
+        if (metrics_init(settings.metrics_port, main_base) != 0) {
+            fprintf(stderr, "failed to start metrics listener\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    trace_signal_init(main_base);
+
+    /* restore the last checkpoint and start taking new ones */
+    if (snapshot_init(main_base) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (repl_init(main_base) != 0) {
+        fprintf(stderr, "failed to start replication\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (settings.session_grace > 0 && session_init(main_base) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (settings.shm_file != NULL) {
+        if (shm_init(settings.shm_file, settings.shm_slots, main_base) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (settings.hot_path != NULL) {
+        if (hotrestart_init(settings.hot_path, main_base) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    /* enter the event loop */
-    event_base_loop(main_base, 0);
+    /*
+     * enter the event loop, the journal records of each iteration are
+     * committed together
+     */
+    while (!daemon_quit) {
+        event_base_loop(main_base, EVLOOP_ONCE);
+        journal_commit();
+    }
     
     hashlist_close();
 
@@ -262,13 +473,17 @@ int main(int argc, char *argv[])
         unlink(pid_file);
     }
 
+    log_close();
+
     return 0;
 }
 
 static void settings_init(void)
 {
     settings.maxconns = 1024;  /* to limit connections-related memory to about 5MB */
+    settings.prewarm_conns = 0;
     settings.port = SERVER_PORT;
+    settings.metrics_port = 0;
     settings.verbose = 0;
 #ifdef USE_THREADS
     settings.num_threads = 4;
@@ -278,6 +493,22 @@ static void settings_init(void)
     settings.access = 0700;
     settings.inter = NULL;  /* By default this string should be NULL for getaddrinfo() */
     settings.socketpath = NULL;  /* by default, not using a unix socket */
+    settings.trace_file = TRACE_FILE;
+    settings.log_file = NULL;
+    settings.snapshot_file = NULL;
+    settings.snapshot_interval = 60;
+    settings.snapshot_grace = 30;
+    settings.journal_file = NULL;
+    settings.repl_port = 0;
+    settings.repl_primary = NULL;
+    settings.hot_path = NULL;
+    settings.session_grace = 0;
+    settings.cluster_nodes = NULL;
+    settings.cluster_self = NULL;
+    settings.shm_file = NULL;
+    settings.shm_slots = 65536;
+    settings.ordered = false;
+    settings.log_rotate = 64 * 1024 * 1024;
 }
 
 static void signal_handler(int sgi)
@@ -304,6 +535,34 @@ static void signal_handler(int sgi)
     sleep(2);
 }
 
+/* SIGUSR1 is delivered through the event loop, the ring is dumped there */
+static void trace_signal_handler(const int sig, const short which, void *arg)
+{
+    long n = trace_dump(settings.trace_file);
+
+    if (n < 0) {
+        log_printf(LOGL_ERROR, "failed to dump trace to %s\n", settings.trace_file);
+    }
+    else {
+        log_printf(LOGL_VERBOSE, "dumped %ld trace events to %s\n", n, settings.trace_file);
+    }
+
+    return;
+}
+
+static void trace_signal_init(struct event_base *base)
+{
+    static struct event ev;
+
+    signal_set(&ev, SIGUSR1, trace_signal_handler, NULL);
+    event_base_set(base, &ev);
+    if (signal_add(&ev, NULL) == -1) {
+        fprintf(stderr, "failed to set SIGUSR1 handler\n");
+    }
+
+    return;
+}
+
 static void signals_init(void)
 {
     struct sigaction act;
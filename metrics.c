@@ -0,0 +1,399 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Prometheus text exposition on a port of its own.
+ *
+ * The event loop only copies its counters into a snapshot on a timer,
+ * which also measures how late the loop is running. A separate thread
+ * accepts scrapes and renders the last snapshot, so a scrape never
+ * costs the lock traffic more than that copy.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "metrics.h"
+
+#define METRICS_BUF_SIZE (64 * 1024)
+
+struct metrics_snap {
+    struct stats       st;
+    unsigned long long items;
+    unsigned long long buckets;
+    unsigned long long maxconns;
+    time_t             now;
+};
+
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_snap snap;
+
+static int metrics_fd = -1;
+static struct event tick_ev;
+static uint64_t tick_due = 0;
+
+static void metrics_publish(void)
+{
+    uint64_t now = current_usec();
+
+    if (tick_due != 0 && now > tick_due) {
+        hist_record(&stats.lag_hist, now - tick_due);
+    }
+
+    pthread_mutex_lock(&snap_lock);
+    memcpy(&snap.st, &stats, sizeof(struct stats));
+    snap.items = hashlist_count();
+    snap.buckets = g_hashlist.mask + 1;
+    snap.maxconns = settings.maxconns;
+    snap.now = time(NULL);
+    pthread_mutex_unlock(&snap_lock);
+
+    tick_due = now + METRICS_INTERVAL * 1000;
+
+    return;
+}
+
+static void metrics_tick(const int fd, const short which, void *arg)
+{
+    struct timeval tv = {METRICS_INTERVAL / 1000, (METRICS_INTERVAL % 1000) * 1000};
+
+    metrics_publish();
+
+    evtimer_add(&tick_ev, &tv);
+
+    return;
+}
+
+static int render_counter(char *buf, int size, const char *name,
+        const char *help, const char *type, unsigned long long v)
+{
+    return snprintf(buf, size, "# HELP memlockd_%s %s\n# TYPE memlockd_%s %s\n"
+            "memlockd_%s %llu\n", name, help, name, type, name, v);
+}
+
+/* a histogram in `scale' units per second, as a summary with quantiles */
+static int render_summary(char *buf, int size, const char *name, const char *help,
+        const char *labels, const struct histogram *h, double scale)
+{
+    int off = 0;
+    unsigned int i = 0;
+    static const double q[] = {50.0, 90.0, 99.0, 99.9};
+
+    off += snprintf(buf + off, size - off,
+            "# HELP memlockd_%s %s\n# TYPE memlockd_%s summary\n", name, help, name);
+
+    for (i = 0; i < sizeof(q) / sizeof(q[0]) && off < size; i++) {
+        off += snprintf(buf + off, size - off, "memlockd_%s{%s%squantile=\"%g\"} %.9g\n",
+                name, labels, *labels ? "," : "", q[i] / 100.0,
+                hist_percentile(h, q[i]) / scale);
+    }
+
+    if (off < size) {
+        off += snprintf(buf + off, size - off,
+                "memlockd_%s_sum%s%s%s %.9g\nmemlockd_%s_count%s%s%s %llu\n",
+                name, *labels ? "{" : "", labels, *labels ? "}" : "", h->sum / scale,
+                name, *labels ? "{" : "", labels, *labels ? "}" : "",
+                (unsigned long long)h->count);
+    }
+
+    return off;
+}
+
+static int metrics_render(const struct metrics_snap *s, char *buf, int size)
+{
+    int off = 0;
+
+#define ADD(f) do { if (off < size) off += (f); } while (0)
+
+    ADD(render_counter(buf + off, size - off, "uptime_seconds",
+                "Seconds since the server started.", "gauge",
+                (unsigned long long)(s->now - s->st.started)));
+    ADD(render_counter(buf + off, size - off, "curr_connections",
+                "Open client connections.", "gauge", s->st.curr_conns));
+    ADD(render_counter(buf + off, size - off, "max_connections",
+                "Connection limit.", "gauge", s->maxconns));
+    ADD(render_counter(buf + off, size - off, "connections_total",
+                "Client connections accepted.", "counter", s->st.total_conns));
+    ADD(render_counter(buf + off, size - off, "free_connections",
+                "Connection objects on the free list.", "gauge", s->st.conn_free));
+    ADD(render_counter(buf + off, size - off, "free_buffers",
+                "I/O buffers on the free list.", "gauge", s->st.buf_free));
+    ADD(render_counter(buf + off, size - off, "items",
+                "Keys currently locked or waited for.", "gauge", s->items));
+    ADD(render_counter(buf + off, size - off, "table_buckets",
+                "Lock table buckets.", "gauge", s->buckets));
+    ADD(snprintf(buf + off, size - off,
+                "# HELP memlockd_table_load_factor Keys per lock table bucket.\n"
+                "# TYPE memlockd_table_load_factor gauge\n"
+                "memlockd_table_load_factor %.6f\n",
+                s->buckets ? (double)s->items / s->buckets : 0.0));
+    ADD(render_counter(buf + off, size - off, "waiters",
+                "Connections queued waiting for a lock.", "gauge", s->st.curr_waiters));
+    ADD(render_counter(buf + off, size - off, "lock_grants_total",
+                "Locks granted.", "counter", s->st.lock_cmds));
+    ADD(render_counter(buf + off, size - off, "lock_failures_total",
+                "Lock requests refused.", "counter", s->st.lock_hits));
+    ADD(render_counter(buf + off, size - off, "lock_blocks_total",
+                "Lock requests that had to wait.", "counter", s->st.lock_blks));
+    ADD(render_counter(buf + off, size - off, "unlocks_total",
+                "Unlock commands.", "counter", s->st.unlock_cmds));
+    ADD(render_counter(buf + off, size - off, "snapshots_total",
+                "Lock table snapshots written.", "counter", s->st.snapshots));
+    ADD(render_counter(buf + off, size - off, "snapshot_failures_total",
+                "Lock table snapshots that failed.", "counter", s->st.snapshot_fails));
+    ADD(snprintf(buf + off, size - off,
+                "# HELP memlockd_snapshot_duration_seconds Time the last snapshot took.\n"
+                "# TYPE memlockd_snapshot_duration_seconds gauge\n"
+                "memlockd_snapshot_duration_seconds %.6f\n", s->st.snapshot_usec / 1e6));
+    ADD(render_counter(buf + off, size - off, "snapshot_last_timestamp_seconds",
+                "When the last snapshot was written.", "gauge",
+                (unsigned long long)s->st.snapshot_last));
+    ADD(render_counter(buf + off, size - off, "journal_records_total",
+                "Lock changes appended to the journal.", "counter", s->st.journal_records));
+    ADD(render_counter(buf + off, size - off, "journal_commits_total",
+                "Journal group commits, one write and fdatasync each.", "counter",
+                s->st.journal_batches));
+    ADD(render_counter(buf + off, size - off, "journal_failures_total",
+                "Journal commits that failed to write or sync.", "counter",
+                s->st.journal_fails));
+    ADD(render_summary(buf + off, size - off, "journal_sync_seconds",
+                "Time per journal write and fdatasync.", "", &s->st.sync_hist, 1e6));
+    ADD(render_counter(buf + off, size - off, "repl_standbys",
+                "Standbys connected.", "gauge", s->st.repl_standbys));
+    ADD(render_counter(buf + off, size - off, "repl_lag_records",
+                "Journal records the slowest standby has not acknowledged.", "gauge",
+                s->st.repl_lag));
+    ADD(render_counter(buf + off, size - off, "repl_shipped_bytes_total",
+                "Bytes sent to standbys.", "counter", s->st.repl_bytes));
+    ADD(render_counter(buf + off, size - off, "repl_applied_lsn",
+                "Last journal record applied, on a standby.", "gauge",
+                s->st.repl_applied));
+    ADD(snprintf(buf + off, size - off,
+                "# HELP memlockd_repl_delay_seconds Age of the last batch applied, on a standby.\n"
+                "# TYPE memlockd_repl_delay_seconds gauge\n"
+                "memlockd_repl_delay_seconds %.6f\n", s->st.repl_delay_usec / 1e6));
+    ADD(render_counter(buf + off, size - off, "sessions",
+                "Resumable sessions, attached or not.", "gauge", s->st.sessions));
+    ADD(render_counter(buf + off, size - off, "session_detached_locks",
+                "Locks kept for sessions whose connection is gone.", "gauge",
+                s->st.sessions_detached_locks));
+    ADD(render_counter(buf + off, size - off, "session_resumes_total",
+                "Sessions taken over by a new connection.", "counter",
+                s->st.session_resumes));
+    ADD(render_counter(buf + off, size - off, "session_expires_total",
+                "Detached sessions dropped after the grace period.", "counter",
+                s->st.session_expires));
+    ADD(render_counter(buf + off, size - off, "cluster_moved_total",
+                "Requests for keys owned by another cluster node.", "counter",
+                s->st.cluster_moved));
+    ADD(render_counter(buf + off, size - off, "shm_clients",
+                "Processes attached to the shared memory lock table.", "gauge",
+                s->st.shm_clients));
+    ADD(render_counter(buf + off, size - off, "shm_reaped_total",
+                "Shared memory clients found dead and cleaned up after.", "counter",
+                s->st.shm_reaped));
+    ADD(render_counter(buf + off, size - off, "shm_reaped_locks_total",
+                "Shared memory locks released for dead clients.", "counter",
+                s->st.shm_reaped_locks));
+    ADD(render_counter(buf + off, size - off, "ring_conns",
+                "Connections on shared memory rings.", "gauge", s->st.ring_conns));
+    ADD(render_counter(buf + off, size - off, "ring_wakeups_total",
+                "Wakeups by ring clients, each drains all they queued.", "counter",
+                s->st.ring_wakeups));
+    ADD(render_counter(buf + off, size - off, "watchers",
+                "Connections waiting on a watch.", "gauge", s->st.watchers));
+    ADD(render_counter(buf + off, size - off, "watch_fired_total",
+                "Watches fired by a release or a change of mode.", "counter",
+                s->st.watch_fired));
+    ADD(render_summary(buf + off, size - off, "wait_seconds",
+                "Time blocked lock requests waited for the grant.", "",
+                &s->st.wait_hist, 1e6));
+    ADD(render_summary(buf + off, size - off, "hold_seconds",
+                "Time locks were held from grant to unlock.", "",
+                &s->st.hold_hist, 1e6));
+    ADD(render_summary(buf + off, size - off, "command_seconds",
+                "Time spent processing a command.", "",
+                &s->st.cmd_hist, 1e9));
+    ADD(render_summary(buf + off, size - off, "loop_lag_seconds",
+                "How late the event loop ran its metrics timer.", "thread=\"main\"",
+                &s->st.lag_hist, 1e6));
+
+#undef ADD
+
+    return off < size ? off : size - 1;
+}
+
+/* reads and ignores the request, answers every path with the metrics */
+static void metrics_serve(int fd, struct metrics_snap *s, char *buf)
+{
+    int  n = 0, len = 0, hlen = 0;
+    char req[1024];
+    char head[256];
+    struct timeval tv = {1, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (void *)&tv, sizeof(tv));
+
+    while (len < (int)sizeof(req) - 1) {
+        n = read(fd, req + len, sizeof(req) - 1 - len);
+        if (n <= 0) {
+            return;
+        }
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&snap_lock);
+    memcpy(s, &snap, sizeof(struct metrics_snap));
+    pthread_mutex_unlock(&snap_lock);
+
+    len = metrics_render(s, buf, METRICS_BUF_SIZE);
+
+    hlen = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %d\r\nConnection: close\r\n\r\n", len);
+
+    if (send(fd, head, hlen, MSG_NOSIGNAL) != hlen) {
+        return;
+    }
+
+    for (n = 0; n < len; ) {
+        hlen = send(fd, buf + n, len - n, MSG_NOSIGNAL);
+        if (hlen <= 0) {
+            return;
+        }
+        n += hlen;
+    }
+
+    return;
+}
+
+static void *metrics_thread(void *arg)
+{
+    int fd = -1;
+    char *buf = NULL;
+    struct metrics_snap *s = NULL;
+
+    buf = (char *)malloc(METRICS_BUF_SIZE);
+    s = (struct metrics_snap *)malloc(sizeof(struct metrics_snap));
+    if (buf == NULL || s == NULL) {
+        log_printf(LOGL_ERROR, "metrics_thread(): out of memory\n");
+        free(buf);
+        free(s);
+        return NULL;
+    }
+
+    for (;;) {
+        fd = accept(metrics_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            log_printf(LOGL_VERBOSE, "metrics accept(): %s\n", strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        metrics_serve(fd, s, buf);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int metrics_listen(const int port)
+{
+    int sfd = -1;
+    int flags = 1;
+    int error = 0;
+    char port_buf[NI_MAXSERV] = {0};
+    struct addrinfo *ai = NULL;
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_family = AF_UNSPEC;
+
+    snprintf(port_buf, sizeof(port_buf), "%d", port);
+
+    error = getaddrinfo(settings.inter, port_buf, &hints, &ai);
+    if (error != 0) {
+        fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+        return -1;
+    }
+
+    sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sfd == -1) {
+        fprintf(stderr, "socket(): fatal error\n");
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+
+    if (bind(sfd, ai->ai_addr, ai->ai_addrlen) == -1 || listen(sfd, 16) == -1) {
+        fprintf(stderr, "metrics bind()/listen(): %s\n", strerror(errno));
+        close(sfd);
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    freeaddrinfo(ai);
+
+    return sfd;
+}
+
+int metrics_init(const int port, struct event_base *base)
+{
+    int ret = 0;
+    pthread_t tid;
+    pthread_attr_t attr;
+    sigset_t all, old;
+
+    metrics_fd = metrics_listen(port);
+    if (metrics_fd < 0) {
+        return -1;
+    }
+
+    evtimer_set(&tick_ev, metrics_tick, NULL);
+    event_base_set(base, &tick_ev);
+    metrics_tick(-1, 0, NULL);
+
+    /* signals are for the event loop, the thread starts with all blocked */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&tid, &attr, metrics_thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0) {
+        fprintf(stderr, "failed to create metrics thread\n");
+        return -1;
+    }
+
+    return 0;
+}
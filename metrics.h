@@ -0,0 +1,19 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "event.h"
+
+/* how often the event loop publishes a snapshot, in msec */
+#define METRICS_INTERVAL 100
+
+int metrics_init(const int port, struct event_base *base);
+
+#endif
@@ -0,0 +1,777 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Primary/standby replication.
+ *
+ * A primary started with -M accepts standbys on that port. A standby that
+ * connects first gets the whole table as a snapshot image taken at the
+ * current journal lsn, then every batch journal_commit() seals at the end
+ * of a loop iteration. Shipping is a copy into the standby's output
+ * buffer and one send() per standby per iteration, nothing waits for the
+ * standby. Standbys ack the last lsn they applied every
+ * REPL_ACK_INTERVAL msec, the distance to the primary's lsn is the lag.
+ *
+ * A standby started with -F host:port keeps a mirror of the primary's
+ * table, refuses lock requests, and reconnects and resyncs whenever the
+ * stream breaks. "promote" stops following; the mirrored holds then
+ * belong to nobody and are released after the -g grace, as after a
+ * restart.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "common.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "repl.h"
+
+#define REPL_BACKLOG_MAX (256 * 1024 * 1024)  /* unsent bytes before a standby is dropped */
+#define REPL_READ_SIZE (64 * 1024)
+#define REPL_RETRY 1  /* seconds between attempts to reach the primary */
+#define REPL_ACK_INTERVAL 10  /* msec between acks from a standby */
+
+struct standby {
+    int      fd;
+    short    ev_flags;
+    struct event ev;
+    char     *out;
+    size_t   off;
+    size_t   len;
+    size_t   size;
+    uint64_t acked;
+    char     ack[sizeof(uint64_t)];
+    int      nack;
+    char     name[64];
+    struct standby *next;
+};
+
+int repl_standby = 0;
+
+static struct event_base *repl_base = NULL;
+
+/* primary side */
+static struct standby *standbys = NULL;
+static int listen_fd = -1;
+static struct event listen_ev;
+
+/* standby side */
+static char primary_host[256];
+static char primary_port[NI_MAXSERV];
+static int primary_fd = -1;
+static struct event primary_ev;
+static struct event retry_ev;
+static struct event ack_ev;
+static uint64_t acked_lsn = 0;  /* last lsn acked to the primary */
+static char *in = NULL;
+static size_t in_len = 0, in_size = 0;
+
+static void standby_event(const int fd, const short which, void *arg);
+
+static int set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void repl_update_lag(void)
+{
+    uint64_t lsn = journal_lsn(), lag = 0;
+    struct standby *s = NULL;
+
+    for (s = standbys; s != NULL; s = s->next) {
+        if (lsn - s->acked > lag) {
+            lag = lsn - s->acked;
+        }
+    }
+
+    stats.repl_lag = lag;
+
+    return;
+}
+
+static void standby_close(struct standby *s)
+{
+    struct standby **ps = &standbys;
+
+    while (*ps != NULL && *ps != s) {
+        ps = &(*ps)->next;
+    }
+    if (*ps != NULL) {
+        *ps = s->next;
+    }
+
+    log_printf(LOGL_VERBOSE, "standby %s gone, acked lsn %llu\n", s->name,
+            (unsigned long long)s->acked);
+
+    event_del(&s->ev);
+    close(s->fd);
+    free(s->out);
+    free(s);
+
+    stats.repl_standbys--;
+    repl_update_lag();
+
+    return;
+}
+
+/* room for need more bytes at the end of s->out */
+static int standby_reserve(struct standby *s, size_t need)
+{
+    size_t ns = 0;
+    char *no = NULL;
+
+    if (s->off > 0) {
+        memmove(s->out, s->out + s->off, s->len - s->off);
+        s->len -= s->off;
+        s->off = 0;
+    }
+
+    if (s->len + need <= s->size) {
+        return 0;
+    }
+
+    ns = s->size ? s->size : REPL_READ_SIZE;
+    while (ns < s->len + need) {
+        ns *= 2;
+    }
+
+    no = (char *)realloc(s->out, ns);
+    if (no == NULL) {
+        return -1;
+    }
+
+    s->out = no;
+    s->size = ns;
+
+    return 0;
+}
+
+static void frame_init(struct repl_frame *f, int type, size_t len, uint64_t lsn)
+{
+    f->magic = REPL_MAGIC;
+    f->type = type;
+    f->len = len;
+    f->lsn = lsn;
+    f->usec = current_usec();
+
+    return;
+}
+
+/* write what the socket takes, then wait for writability only if needed */
+static int standby_flush(struct standby *s)
+{
+    ssize_t n = 0;
+    short flags = EV_READ | EV_PERSIST;
+
+    while (s->off < s->len) {
+        n = send(s->fd, s->out + s->off, s->len - s->off, MSG_NOSIGNAL);
+        if (n > 0) {
+            s->off += n;
+            stats.repl_bytes += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        return -1;
+    }
+
+    if (s->off == s->len) {
+        s->off = s->len = 0;
+    }
+    else {
+        flags |= EV_WRITE;
+    }
+
+    if (flags != s->ev_flags) {
+        event_del(&s->ev);
+        event_set(&s->ev, s->fd, flags, standby_event, s);
+        event_base_set(repl_base, &s->ev);
+        if (event_add(&s->ev, NULL) == -1) {
+            return -1;
+        }
+        s->ev_flags = flags;
+    }
+
+    return 0;
+}
+
+/* called by journal_commit() with each sealed batch */
+void repl_ship(const char *data, size_t len, uint64_t lsn)
+{
+    struct standby *s = NULL, *next = NULL;
+    struct repl_frame f;
+
+    if (standbys == NULL) {
+        return;
+    }
+
+    frame_init(&f, REPL_RECORDS, len, lsn);
+
+    for (s = standbys; s != NULL; s = next) {
+        next = s->next;
+
+        if (s->len - s->off + len > REPL_BACKLOG_MAX
+                || standby_reserve(s, sizeof(f) + len) != 0) {
+            log_printf(LOGL_ERROR, "standby %s is too far behind, dropped\n", s->name);
+            standby_close(s);
+            continue;
+        }
+
+        memcpy(s->out + s->len, &f, sizeof(f));
+        memcpy(s->out + s->len + sizeof(f), data, len);
+        s->len += sizeof(f) + len;
+
+        if (standby_flush(s) != 0) {
+            standby_close(s);
+        }
+    }
+
+    repl_update_lag();
+
+    return;
+}
+
+static void standby_event(const int fd, const short which, void *arg)
+{
+    int i = 0;
+    ssize_t n = 0;
+    char buf[512];
+    struct standby *s = (struct standby *)arg;
+
+    if (which & EV_WRITE) {
+        if (standby_flush(s) != 0) {
+            standby_close(s);
+            return;
+        }
+    }
+
+    if (which & EV_READ) {
+        n = read(fd, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            standby_close(s);
+            return;
+        }
+
+        for (i = 0; i < n; i++) {
+            s->ack[s->nack++] = buf[i];
+            if (s->nack == sizeof(s->ack)) {
+                memcpy(&s->acked, s->ack, sizeof(s->acked));
+                s->nack = 0;
+            }
+        }
+
+        repl_update_lag();
+    }
+
+    return;
+}
+
+/* a new standby: send it the table as it is, then the stream */
+static void repl_accept(const int fd, const short which, void *arg)
+{
+    int sfd = -1, flags = 1;
+    unsigned int count = 0;
+    size_t size = 0;
+    uint64_t lsn = 0;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char host[NI_MAXHOST] = "?", port[NI_MAXSERV] = "?";
+    struct standby *s = NULL;
+    struct repl_frame f;
+
+    sfd = accept(fd, (struct sockaddr *)&addr, &addrlen);
+    if (sfd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            log_printf(LOGL_ERROR, "replication accept(): %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    if (repl_standby) {
+        log_printf(LOGL_VERBOSE, "refused a standby, this server is a standby itself\n");
+        close(sfd);
+        return;
+    }
+
+    s = (struct standby *)calloc(1, sizeof(struct standby));
+    if (s == NULL || set_nonblock(sfd) != 0) {
+        log_printf(LOGL_ERROR, "failed to set up a standby connection\n");
+        free(s);
+        close(sfd);
+        return;
+    }
+
+    setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+    getnameinfo((struct sockaddr *)&addr, addrlen, host, sizeof(host), port, sizeof(port),
+            NI_NUMERICHOST | NI_NUMERICSERV);
+    snprintf(s->name, sizeof(s->name), "%s:%s", host, port);
+    s->fd = sfd;
+
+    /* records up to the image's lsn go out to the others first */
+    journal_commit();
+    lsn = journal_lsn();
+
+    size = snapshot_size(&count);
+    if (standby_reserve(s, sizeof(f) + size) != 0) {
+        log_printf(LOGL_ERROR, "no memory for the image of standby %s\n", s->name);
+        free(s->out);
+        free(s);
+        close(sfd);
+        return;
+    }
+
+    frame_init(&f, REPL_FULL, size, lsn);
+    memcpy(s->out, &f, sizeof(f));
+    memset(s->out + sizeof(f), 0, size);
+    snapshot_fill(s->out + sizeof(f), size, count, lsn);
+    s->len = sizeof(f) + size;
+    s->acked = lsn;
+
+    event_set(&s->ev, sfd, EV_READ | EV_PERSIST, standby_event, s);
+    event_base_set(repl_base, &s->ev);
+    if (event_add(&s->ev, NULL) == -1) {
+        log_printf(LOGL_ERROR, "failed to add standby event\n");
+        free(s->out);
+        free(s);
+        close(sfd);
+        return;
+    }
+    s->ev_flags = EV_READ | EV_PERSIST;
+
+    s->next = standbys;
+    standbys = s;
+    stats.repl_standbys++;
+
+    log_printf(LOGL_VERBOSE, "standby %s connected, sending %u locks at lsn %llu\n",
+            s->name, count, (unsigned long long)lsn);
+
+    if (standby_flush(s) != 0) {
+        standby_close(s);
+    }
+
+    return;
+}
+
+static void repl_retry(const int fd, const short which, void *arg);
+
+static void primary_lost(void)
+{
+    struct timeval tv = {REPL_RETRY, 0};
+
+    if (primary_fd >= 0) {
+        log_printf(LOGL_ERROR, "lost primary %s:%s\n", primary_host, primary_port);
+        event_del(&primary_ev);
+        close(primary_fd);
+        primary_fd = -1;
+    }
+
+    in_len = 0;
+
+    if (repl_standby) {
+        evtimer_add(&retry_ev, &tv);
+    }
+
+    return;
+}
+
+/* the primary's image: drop the mirror and load it */
+static int primary_full(const char *buf, size_t len)
+{
+    long n = 0;
+    uint64_t lsn = 0;
+
+    hashlist_close();
+    hashlist_init();
+
+    n = snapshot_restore(buf, len, &lsn);
+    if (n < 0) {
+        log_printf(LOGL_ERROR, "bad table image from the primary\n");
+        return -1;
+    }
+
+    journal_reset(lsn);
+
+    log_printf(LOGL_VERBOSE, "synced %ld locks from the primary at lsn %llu\n", n,
+            (unsigned long long)lsn);
+
+    return 0;
+}
+
+static int primary_records(const char *buf, size_t len)
+{
+    size_t off = 0;
+    const struct journal_rec *r = NULL;
+
+    while (off < len) {
+        r = (const struct journal_rec *)(buf + off);
+        if (journal_check(r, len - off) != 0) {
+            log_printf(LOGL_ERROR, "bad journal record from the primary\n");
+            return -1;
+        }
+
+        journal_apply(r);
+        off += r->len;
+    }
+
+    return 0;
+}
+
+static void primary_read(const int fd, const short which, void *arg)
+{
+    int ret = 0;
+    ssize_t n = 0;
+    size_t off = 0, need = 0;
+    uint64_t now = 0, lsn = 0;
+    char *ni = NULL;
+    const struct repl_frame *f = NULL;
+
+    if (in_size - in_len < REPL_READ_SIZE) {
+        ni = (char *)realloc(in, in_len + REPL_READ_SIZE);
+        if (ni == NULL) {
+            log_printf(LOGL_ERROR, "primary_read(): out of memory\n");
+            primary_lost();
+            return;
+        }
+        in = ni;
+        in_size = in_len + REPL_READ_SIZE;
+    }
+
+    n = read(fd, in + in_len, in_size - in_len);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        primary_lost();
+        return;
+    }
+    if (n < 0) {
+        return;
+    }
+    in_len += n;
+
+    lsn = stats.repl_applied;
+
+    while (in_len - off >= sizeof(struct repl_frame)) {
+        f = (const struct repl_frame *)(in + off);
+        if (f->magic != REPL_MAGIC) {
+            log_printf(LOGL_ERROR, "bad frame from the primary\n");
+            primary_lost();
+            return;
+        }
+
+        need = sizeof(struct repl_frame) + f->len;
+        if (in_len - off < need) {
+            break;
+        }
+
+        if (f->type == REPL_FULL) {
+            ret = primary_full(in + off + sizeof(struct repl_frame), f->len);
+        }
+        else {
+            ret = primary_records(in + off + sizeof(struct repl_frame), f->len);
+        }
+        if (ret != 0) {
+            primary_lost();
+            return;
+        }
+
+        lsn = f->lsn;
+        now = current_usec();
+        stats.repl_delay_usec = now > f->usec ? now - f->usec : 0;
+        off += need;
+    }
+
+    if (off > 0) {
+        memmove(in, in + off, in_len - off);
+        in_len -= off;
+    }
+
+    /* a large image arrives over many reads, make room for all of it */
+    if (in_len >= sizeof(struct repl_frame)) {
+        f = (const struct repl_frame *)in;
+        need = sizeof(struct repl_frame) + f->len;
+        if (need > in_size) {
+            ni = (char *)realloc(in, need);
+            if (ni == NULL) {
+                log_printf(LOGL_ERROR, "primary_read(): out of memory\n");
+                primary_lost();
+                return;
+            }
+            in = ni;
+            in_size = need;
+        }
+    }
+
+    stats.repl_applied = lsn;
+
+    return;
+}
+
+/* acks are batched on a timer so the primary isn't woken per read */
+static void repl_ack(const int fd, const short which, void *arg)
+{
+    uint64_t lsn = stats.repl_applied;
+    struct timeval tv = {0, REPL_ACK_INTERVAL * 1000};
+
+    if (primary_fd >= 0 && lsn != acked_lsn) {
+        if (send(primary_fd, &lsn, sizeof(lsn), MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(lsn)) {
+            acked_lsn = lsn;
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            primary_lost();
+        }
+    }
+
+    if (repl_standby) {
+        evtimer_add(&ack_ev, &tv);
+    }
+
+    return;
+}
+
+static void primary_connected(const int fd, const short which, void *arg)
+{
+    int err = 0, flags = 1;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+        log_printf(LOGL_VERBOSE, "connect to primary %s:%s: %s\n", primary_host,
+                primary_port, strerror(err ? err : errno));
+        close(primary_fd);
+        primary_fd = -1;
+        primary_lost();
+        return;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+
+    event_set(&primary_ev, fd, EV_READ | EV_PERSIST, primary_read, NULL);
+    event_base_set(repl_base, &primary_ev);
+    if (event_add(&primary_ev, NULL) == -1) {
+        close(primary_fd);
+        primary_fd = -1;
+        primary_lost();
+        return;
+    }
+
+    acked_lsn = 0;
+
+    log_printf(LOGL_VERBOSE, "following primary %s:%s\n", primary_host, primary_port);
+
+    return;
+}
+
+static void repl_connect(void)
+{
+    int fd = -1;
+    struct addrinfo *ai = NULL;
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_family = AF_UNSPEC;
+
+    if (getaddrinfo(primary_host, primary_port, &hints, &ai) != 0) {
+        primary_lost();
+        return;
+    }
+
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0 || set_nonblock(fd) != 0
+            || (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        freeaddrinfo(ai);
+        primary_lost();
+        return;
+    }
+
+    freeaddrinfo(ai);
+
+    primary_fd = fd;
+    event_set(&primary_ev, fd, EV_WRITE, primary_connected, NULL);
+    event_base_set(repl_base, &primary_ev);
+    if (event_add(&primary_ev, NULL) == -1) {
+        close(fd);
+        primary_fd = -1;
+        primary_lost();
+    }
+
+    return;
+}
+
+static void repl_retry(const int fd, const short which, void *arg)
+{
+    if (repl_standby && primary_fd < 0) {
+        repl_connect();
+    }
+
+    return;
+}
+
+/* stop following and take over, 0 on success, -1 if not a standby */
+int repl_promote(void)
+{
+    if (!repl_standby) {
+        return -1;
+    }
+
+    repl_standby = 0;
+    evtimer_del(&retry_ev);
+    evtimer_del(&ack_ev);
+
+    if (primary_fd >= 0) {
+        event_del(&primary_ev);
+        close(primary_fd);
+        primary_fd = -1;
+    }
+
+    free(in);
+    in = NULL;
+    in_len = in_size = 0;
+
+    snapshot_adopt();
+
+    log_printf(LOGL_ERROR, "promoted to primary at lsn %llu\n",
+            (unsigned long long)journal_lsn());
+
+    return 0;
+}
+
+/* the "stats replication" lines */
+int repl_format(char *buf, int size)
+{
+    int off = 0;
+    struct standby *s = NULL;
+
+    if (repl_standby) {
+        return snprintf(buf, size, "role: standby\r\nprimary: %s:%s %s\r\n"
+                "applied lsn: %llu\r\ndelay usec: %llu",
+                primary_host, primary_port, primary_fd >= 0 ? "up" : "down",
+                stats.repl_applied, stats.repl_delay_usec);
+    }
+
+    off = snprintf(buf, size, "role: primary\r\nlsn: %llu\r\nstandbys: %llu\r\n"
+            "lag records: %llu\r\nshipped bytes: %llu",
+            (unsigned long long)journal_lsn(), stats.repl_standbys,
+            stats.repl_lag, stats.repl_bytes);
+
+    for (s = standbys; s != NULL && off < size; s = s->next) {
+        off += snprintf(buf + off, size - off, "\r\nstandby %s acked %llu",
+                s->name, (unsigned long long)s->acked);
+    }
+
+    return off < size ? off : size - 1;
+}
+
+static int repl_listen(const int port)
+{
+    int sfd = -1;
+    int flags = 1;
+    int error = 0;
+    char port_buf[NI_MAXSERV] = {0};
+    struct addrinfo *ai = NULL;
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_family = AF_UNSPEC;
+
+    snprintf(port_buf, sizeof(port_buf), "%d", port);
+
+    error = getaddrinfo(settings.inter, port_buf, &hints, &ai);
+    if (error != 0) {
+        fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+        return -1;
+    }
+
+    sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sfd == -1) {
+        fprintf(stderr, "socket(): fatal error\n");
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+
+    if (set_nonblock(sfd) != 0 || bind(sfd, ai->ai_addr, ai->ai_addrlen) == -1
+            || listen(sfd, 16) == -1) {
+        fprintf(stderr, "replication bind()/listen(): %s\n", strerror(errno));
+        close(sfd);
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    freeaddrinfo(ai);
+
+    return sfd;
+}
+
+/* listen for standbys on settings.repl_port, follow settings.repl_primary */
+int repl_init(struct event_base *base)
+{
+    char *p = NULL;
+
+    repl_base = base;
+
+    if (settings.repl_port > 0) {
+        listen_fd = repl_listen(settings.repl_port);
+        if (listen_fd < 0) {
+            return -1;
+        }
+
+        event_set(&listen_ev, listen_fd, EV_READ | EV_PERSIST, repl_accept, NULL);
+        event_base_set(base, &listen_ev);
+        if (event_add(&listen_ev, NULL) == -1) {
+            fprintf(stderr, "failed to add replication listen event\n");
+            return -1;
+        }
+    }
+
+    if (settings.repl_primary != NULL) {
+        p = strrchr(settings.repl_primary, ':');
+        if (p == NULL || p == settings.repl_primary || p[1] == '\0') {
+            fprintf(stderr, "primary must be host:port, not %s\n", settings.repl_primary);
+            return -1;
+        }
+
+        snprintf(primary_host, sizeof(primary_host), "%.*s",
+                (int)(p - settings.repl_primary), settings.repl_primary);
+        snprintf(primary_port, sizeof(primary_port), "%s", p + 1);
+
+        repl_standby = 1;
+
+        evtimer_set(&retry_ev, repl_retry, NULL);
+        event_base_set(base, &retry_ev);
+        evtimer_set(&ack_ev, repl_ack, NULL);
+        event_base_set(base, &ack_ev);
+        repl_ack(-1, 0, NULL);
+        repl_connect();
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _REPL_H_
+#define _REPL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+
+#define REPL_MAGIC 0x31524c4d  /* "MLR1" */
+
+enum repl_types {
+    REPL_FULL = 1,  /* a snapshot image, replaces the standby's table */
+    REPL_RECORDS,   /* one journal batch */
+};
+
+/*
+ * primary to standby: a frame followed by len bytes of payload.
+ * standby to primary: the last lsn applied, a raw uint64_t per ack.
+ */
+struct repl_frame {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t len;
+    uint64_t lsn;   /* last lsn the payload covers */
+    uint64_t usec;  /* primary clock when shipped */
+};
+
+extern int repl_standby;  /* following a primary, locks are refused */
+
+void repl_ship(const char *data, size_t len, uint64_t lsn);
+
+int repl_promote(void);
+
+int repl_format(char *buf, int size);
+
+int repl_init(struct event_base *base);
+
+#endif
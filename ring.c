@@ -0,0 +1,267 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Shared memory transport for clients on the unix socket.
+ *
+ * "ring" makes a region with a request and a reply ring and two
+ * eventfds, and passes them back with the reply. From then on the conn
+ * reads its commands from the request ring and writes its replies to the
+ * reply ring, through ring_read() and ring_write() in place of read()
+ * and write(), and the state machine is none the wiser. One wakeup on
+ * our eventfd drains every request the client queued meanwhile.
+ *
+ * The socket stays open and is watched only for the client going away,
+ * which closes the conn and gives its lock up as usual.
+ */
+
+#define _GNU_SOURCE  /* memfd_create() */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "common.h"
+#include "shmring.h"
+#include "ring.h"
+
+/* a wakeup from the client, go through everything it queued */
+static void ring_handler(const int fd, const short which, void *arg)
+{
+    uint64_t n = 0;
+    struct conn *c = (struct conn *)arg;
+
+    if (read(fd, &n, sizeof(n)) != sizeof(n)) {
+        /* spurious, nothing to reset */
+    }
+
+    stats.ring_wakeups++;
+
+    /* as if the socket were readable or writable, with no event on it */
+    event_handler(c->sfd, 0, c);
+
+    return;
+}
+
+/* the reply, with the region and the client's ends of the eventfds */
+static int ring_send_fds(struct conn *c, int memfd)
+{
+    int fds[3] = {memfd, c->ring->efd, c->ring->client_efd};
+    char reply[64];
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm = NULL;
+
+    snprintf(reply, sizeof(reply), "+OK, ring %d\r\n", RING_SIZE);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    iov.iov_base = reply;
+    iov.iov_len = strlen(reply);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    if (sendmsg(c->sfd, &msg, MSG_NOSIGNAL) != (ssize_t)iov.iov_len) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * "ring": move c onto a new pair of rings. the reply is sent here, with
+ * the fds. returns 0, or -1 with c left on its socket.
+ */
+int ring_attach(struct conn *c)
+{
+    int memfd = -1;
+    void *region = MAP_FAILED;
+    struct ring *r = NULL;
+
+    r = (struct ring *)calloc(1, sizeof(struct ring));
+    if (r == NULL) {
+        return -1;
+    }
+    r->efd = -1;
+    r->client_efd = -1;
+
+    memfd = memfd_create("memlock-ring", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, RING_REGION) != 0) {
+        goto fail;
+    }
+
+    region = mmap(NULL, RING_REGION, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (region == MAP_FAILED) {
+        goto fail;
+    }
+
+    r->hdr = (struct ring_hdr *)region;
+    memcpy(r->hdr->magic, RING_MAGIC, 8);
+    r->hdr->size = RING_SIZE;
+
+    r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    r->client_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->efd < 0 || r->client_efd < 0) {
+        goto fail;
+    }
+
+    event_set(&r->event, r->efd, EV_READ | EV_PERSIST, ring_handler, (void *)c);
+    event_base_set(c->event.ev_base, &r->event);
+    if (event_add(&r->event, 0) == -1) {
+        goto fail;
+    }
+
+    c->ring = r;
+    if (ring_send_fds(c, memfd) != 0) {
+        c->ring = NULL;
+        event_del(&r->event);
+        goto fail;
+    }
+    close(memfd);
+
+    stats.ring_conns++;
+
+    return 0;
+
+fail:
+    log_printf(LOGL_VERBOSE, "ring setup for %d failed: %s\n", c->sfd, strerror(errno));
+
+    if (region != MAP_FAILED) {
+        munmap(region, RING_REGION);
+    }
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    if (r->efd >= 0) {
+        close(r->efd);
+    }
+    if (r->client_efd >= 0) {
+        close(r->client_efd);
+    }
+    free(r);
+
+    return -1;
+}
+
+/*
+ * read() for a ring conn: requests from the ring, or -1 with EAGAIN when
+ * there are none. the socket is only looked at when it became readable,
+ * for the client hanging up, which returns 0. it has no business
+ * sending anything else there. the client can write the ring positions,
+ * garbage there is -1 with EPROTO.
+ */
+ssize_t ring_read(struct conn *c, char *buf, size_t size)
+{
+    char   byte = 0;
+    uint32_t n = 0;
+    ssize_t res = 0;
+    struct ring_hdr *h = c->ring->hdr;
+
+    n = ring_get(&h->req, RING_REQ(h), buf, size);
+    if (n == 0) {
+        ring_sleep(&h->req.waiting);
+        n = ring_get(&h->req, RING_REQ(h), buf, size);
+        if (n > 0 && n != RING_BROKEN) {
+            __atomic_store_n(&h->req.waiting, 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (n == RING_BROKEN) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (n > 0) {
+        ring_wake(&h->req.full, c->ring->client_efd);
+        return n;
+    }
+
+    if (c->which & EV_READ) {
+        c->which &= ~EV_READ;
+        res = read(c->sfd, &byte, 1);
+        if (res == 0) {
+            return 0;
+        }
+        if (res > 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        return -1;
+    }
+
+    errno = EAGAIN;
+
+    return -1;
+}
+
+/*
+ * write() for a ring conn. when the client leaves no room it wakes us
+ * on our eventfd once it has read some, there is no event to wait for.
+ */
+ssize_t ring_write(struct conn *c, const char *buf, size_t len)
+{
+    uint32_t n = 0;
+    struct ring_hdr *h = c->ring->hdr;
+
+    n = ring_put(&h->resp, RING_RESP(h), buf, len);
+    if (n == 0) {
+        ring_sleep(&h->resp.full);
+        n = ring_put(&h->resp, RING_RESP(h), buf, len);
+        if (n > 0 && n != RING_BROKEN) {
+            __atomic_store_n(&h->resp.full, 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (n == RING_BROKEN) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (n > 0) {
+        ring_wake(&h->resp.waiting, c->ring->client_efd);
+        return n;
+    }
+
+    errno = EAGAIN;
+
+    return -1;
+}
+
+void ring_free(struct conn *c)
+{
+    struct ring *r = c->ring;
+
+    if (r == NULL) {
+        return;
+    }
+
+    event_del(&r->event);
+    munmap(r->hdr, RING_REGION);
+    close(r->efd);
+    close(r->client_efd);
+    free(r);
+
+    c->ring = NULL;
+    stats.ring_conns--;
+
+    return;
+}
@@ -0,0 +1,34 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <sys/types.h>
+
+#include "event.h"
+
+struct conn;
+struct ring_hdr;
+
+struct ring {
+    struct ring_hdr *hdr;
+    int    efd;          /* ours: requests came, or reply space freed */
+    int    client_efd;   /* theirs: replies came, or request space freed */
+    struct event event;  /* on efd */
+};
+
+int ring_attach(struct conn *c);
+
+ssize_t ring_read(struct conn *c, char *buf, size_t size);
+
+ssize_t ring_write(struct conn *c, const char *buf, size_t len);
+
+void ring_free(struct conn *c);
+
+#endif
@@ -0,0 +1,237 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Session resumption.
+ *
+ * "session" gives the connection a server issued id. When a conn with a
+ * session goes away without "quit", conn_close() leaves the lock it holds
+ * to the session instead of releasing it; "session <id>" on a new
+ * connection within settings.session_grace seconds takes the session and
+ * its lock over, and waiters never notice the blip. Once the grace runs
+ * out the hold is released like an unlock. A lock that was only waited
+ * for is not kept, the waiter has to ask again.
+ *
+ * Ids are random 64 bit numbers, knowing one is what proves ownership.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#include "common.h"
+#include "locktable.h"
+#include "trace.h"
+#include "session.h"
+
+#define SESSION_HASH(s)     ((unsigned int)((s)->id ^ ((s)->id >> 32)))
+#define SESSION_KEY_HASH(k) ((unsigned int)(*(k) ^ (*(k) >> 32)))
+#define SESSION_KEY_EQ(s, k) ((s)->id == *(k))
+
+DEFINE_LOCKTABLE(sesstable, struct session, uint64_t, h_next,
+        SESSION_HASH, SESSION_KEY_HASH, SESSION_KEY_EQ)
+
+static struct sesstable sessions;
+static struct list_head detached;
+static struct event expire_ev;
+static uint64_t sess_counter = 0;
+
+static uint64_t session_id(void)
+{
+    uint64_t id = 0;
+
+    while (id == 0 || sesstable_search(&sessions, &id) != NULL) {
+        if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+            /* no entropy: unique still, just guessable */
+            id = current_usec() ^ (++sess_counter << 48);
+        }
+    }
+
+    return id;
+}
+
+struct session *session_new(struct conn *c)
+{
+    struct session *s = NULL;
+
+    s = (struct session *)calloc(1, sizeof(struct session));
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->id = session_id();
+    s->c = c;
+    INIT_LIST_HEAD(&s->dnode);
+    sesstable_insert(&sessions, s);
+
+    c->sess = s;
+    stats.sessions++;
+
+    return s;
+}
+
+static void session_free(struct session *s)
+{
+    list_del(&s->dnode);
+    sesstable_remove(&sessions, s);
+    free(s);
+
+    stats.sessions--;
+
+    return;
+}
+
+/* give up the hold of a detached session, as an unlock would */
+static void session_release(struct session *s)
+{
+    struct item *it = s->it;
+
+    if (it == NULL) {
+        return;
+    }
+
+    s->it = NULL;
+    stats.sessions_detached_locks--;
+
+    trace_event(TRACE_UNLOCK, 0, -1, it->k.hv, s->lock_cmd);
+    hist_record(&stats.hold_hist, current_usec() - s->stamp);
+
+    if (hashlist_setunlock(it) > 0) {
+        notify_block_conns(it);
+    }
+
+    return;
+}
+
+/*
+ * c is closing: keep its session, and the lock it holds, for
+ * settings.session_grace seconds.
+ */
+void session_detach(struct conn *c)
+{
+    struct session *s = c->sess;
+
+    if (s == NULL) {
+        return;
+    }
+
+    c->sess = NULL;
+    s->c = NULL;
+    s->expire = time(NULL) + settings.session_grace;
+    list_add_tail(&s->dnode, &detached);
+
+    if (c->flags == sess_lock && c->lock_it != NULL) {
+        /* a durable grant whose reply is still held */
+        list_del_init(&c->wait.node);
+
+        s->it = c->lock_it;
+        s->lock_cmd = c->wait.flags;
+        s->stamp = c->stamp;
+        stats.sessions_detached_locks++;
+
+        c->lock_it = NULL;
+        c->flags = sess_init;
+    }
+
+    return;
+}
+
+/* "quit": the client is done, nothing is kept for it */
+void session_end(struct conn *c)
+{
+    if (c->sess != NULL) {
+        session_free(c->sess);
+        c->sess = NULL;
+    }
+
+    return;
+}
+
+/*
+ * attach session id to c, which has no session and no lock of its own.
+ * a conn still attached to it is taken to be dead and closed.
+ * returns 0, or -1 if there is no such session.
+ */
+int session_resume(struct conn *c, uint64_t id)
+{
+    struct session *s = NULL;
+    struct conn *old = NULL;
+
+    s = sesstable_search(&sessions, &id);
+    if (s == NULL) {
+        return -1;
+    }
+
+    if (s->c != NULL) {
+        /* its lock moves over with the session */
+        old = s->c;
+        session_detach(old);
+        conn_close(old);
+    }
+
+    list_del_init(&s->dnode);
+    s->c = c;
+    c->sess = s;
+
+    if (s->it != NULL) {
+        c->lock_it = s->it;
+        c->wait.flags = s->lock_cmd;
+        c->stamp = s->stamp;
+        c->flags = sess_lock;
+        s->it = NULL;
+        stats.sessions_detached_locks--;
+    }
+
+    stats.session_resumes++;
+
+    return 0;
+}
+
+static void session_expire(const int fd, const short which, void *arg)
+{
+    time_t now = time(NULL);
+    struct timeval tv = {1, 0};
+    struct session *s = NULL;
+
+    while (!list_empty(&detached)) {
+        s = list_entry(detached.next, struct session, dnode);
+        if (s->expire > now) {
+            break;
+        }
+
+        log_printf(LOGL_VERBOSE, "session %016llx expired%s\n", (unsigned long long)s->id,
+                s->it != NULL ? ", lock released" : "");
+
+        session_release(s);
+        session_free(s);
+        stats.session_expires++;
+    }
+
+    evtimer_add(&expire_ev, &tv);
+
+    return;
+}
+
+int session_init(struct event_base *base)
+{
+    if (sesstable_init(&sessions, 1024) != 0) {
+        fprintf(stderr, "sesstable_init(): init fatal error\n");
+        return -1;
+    }
+
+    INIT_LIST_HEAD(&detached);
+
+    evtimer_set(&expire_ev, session_expire, NULL);
+    event_base_set(base, &expire_ev);
+    session_expire(-1, 0, NULL);
+
+    return 0;
+}
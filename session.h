@@ -0,0 +1,47 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "event.h"
+#include "list.h"
+
+struct conn;
+struct item;
+
+/*
+ * A session outlives its connection by settings.session_grace seconds.
+ * While attached the lock state lives in the conn as usual, a detached
+ * session keeps the hold the conn had until it is resumed or expires.
+ */
+struct session {
+    uint64_t id;
+    struct conn *c;          /* attached conn, NULL while detached */
+    struct item *it;         /* hold kept while detached */
+    int      lock_cmd;
+    uint64_t stamp;          /* when the hold was granted */
+    time_t   expire;         /* detached: when the hold is given up */
+    struct list_head dnode;  /* detached list, in expiry order */
+    struct session *h_next;
+};
+
+int session_init(struct event_base *base);
+
+struct session *session_new(struct conn *c);
+
+int session_resume(struct conn *c, uint64_t id);
+
+void session_detach(struct conn *c);
+
+void session_end(struct conn *c);
+
+#endif
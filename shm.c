@@ -0,0 +1,88 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * The daemon's side of the shared memory lock table, see shmlock.c.
+ *
+ * Clients lock and unlock in the segment without us. What is left here
+ * is creating the segment, or taking over the one of the process we
+ * restart from, and the robust part: every interval each
+ * client's pid is checked and the holds of a process that is gone are
+ * released, waking whoever waited on them, before its id is reused.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "common.h"
+#include "shmlock.h"
+#include "shm.h"
+
+static struct shm_hdr *segment = NULL;
+static struct event reap_ev;
+
+static void shm_reap(const int fd, const short which, void *arg)
+{
+    int i = 0, n = 0;
+    int32_t pid = 0;
+    unsigned long long clients = 0;
+    struct timeval tv = {SHM_REAP_INTERVAL, 0};
+
+    for (i = 0; i < SHM_CLIENTS; i++) {
+        pid = __atomic_load_n(&segment->clients[i].pid, __ATOMIC_ACQUIRE);
+        if (pid == 0) {
+            continue;
+        }
+
+        if (kill(pid, 0) == 0 || errno != ESRCH) {
+            clients++;
+            continue;
+        }
+
+        n = shmlock_release_client(segment, i);
+        __atomic_store_n(&segment->clients[i].pid, 0, __ATOMIC_RELEASE);
+
+        log_printf(LOGL_VERBOSE, "shm client %d, pid %d, is gone, %d locks released\n",
+                i, (int)pid, n);
+
+        stats.shm_reaped++;
+        stats.shm_reaped_locks += n;
+    }
+
+    stats.shm_clients = clients;
+
+    evtimer_add(&reap_ev, &tv);
+
+    return;
+}
+
+int shm_init(const char *path, unsigned int nslots, struct event_base *base)
+{
+    segment = shmlock_create(path, nslots, settings.access & 0666);
+    if (segment == NULL) {
+        fprintf(stderr, "failed to create shared memory segment %s: %s\n",
+                path, strerror(errno));
+        return -1;
+    }
+
+    if (segment->nslots < nslots) {
+        log_printf(LOGL_ERROR, "shared memory segment %s reused with its %u slots, "
+                "remove it to resize\n", path, segment->nslots);
+    }
+
+    evtimer_set(&reap_ev, shm_reap, NULL);
+    event_base_set(base, &reap_ev);
+
+    /* a reused segment may hold locks of clients that died meanwhile */
+    shm_reap(-1, 0, NULL);
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include "event.h"
+
+#define SHM_REAP_INTERVAL 1  /* seconds between checks for dead clients */
+
+int shm_init(const char *path, unsigned int nslots, struct event_base *base);
+
+#endif
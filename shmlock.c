@@ -0,0 +1,446 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Shared memory locks for clients on the daemon's host.
+ *
+ * memlockd -X creates the segment, clients map it and lock with a
+ * compare and swap on the key's slot: no syscall and no daemon on the
+ * way unless the lock is taken. Every client has an id, its bit in a
+ * slot's state is its read hold and id + 1 in the writer field its write
+ * hold, so a hold can always be traced to its owner. A client that has
+ * to wait sets the waiters bit and sleeps on the slot's futex word, the
+ * release that leaves the slot free bumps the word and wakes them all to
+ * try again. Unlike the daemon's queue that is not first come first
+ * served.
+ *
+ * The daemon is the one that cleans up after crashes: once a client's
+ * process is gone it clears that client's bits from every slot and wakes
+ * whoever waited on them, see shm.c.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "hash.h"
+#include "shmlock.h"
+#include "memlock.h"
+
+struct shmlock {
+    struct shm_hdr  *hdr;
+    struct shm_slot *slots;
+    size_t size;
+    int    id;
+};
+
+#define SLOT_AT(hdr, i) \
+    ((struct shm_slot *)((char *)(hdr) + SHM_SLOTS_OFF) + (i))
+
+static void futex_wait(uint32_t *addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+
+    return;
+}
+
+static void futex_wake(uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+    return;
+}
+
+/*
+ * take hold, one bit or the writer field, off the slot. waiters are
+ * woken once nobody holds it any more: readers only wait for a writer,
+ * so while readers remain whoever waits still has to.
+ */
+static int slot_release(struct shm_slot *s, uint64_t hold)
+{
+    uint64_t old = 0, new = 0;
+
+    old = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+    do {
+        if ((old & hold) != hold) {
+            return -1;
+        }
+        new = old & ~hold;
+        if ((new & (SHM_READERS | SHM_WRITER)) == 0) {
+            new &= ~SHM_WAITERS;
+        }
+    } while (!__atomic_compare_exchange_n(&s->state, &old, new, 0,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if ((old & SHM_WAITERS) && !(new & SHM_WAITERS)) {
+        __atomic_fetch_add(&s->seq, 1, __ATOMIC_RELEASE);
+        futex_wake(&s->seq);
+    }
+
+    return 0;
+}
+
+/* the slot of key, taking a free one for it if create is set */
+static struct shm_slot *slot_find(struct shmlock *h, const char *key, size_t nkey, int create)
+{
+    unsigned int i = 0, hv = 0, mask = h->hdr->nslots - 1;
+    uint32_t claim = 0;
+    struct shm_slot *s = NULL;
+
+    if (nkey == 0 || nkey > SHM_KEY_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    hv = em_hash(key, (int)nkey, SHM_SEED);
+
+    for (i = 0; i <= mask; i++) {
+        s = &h->slots[(hv + i) & mask];
+
+        claim = __atomic_load_n(&s->claim, __ATOMIC_ACQUIRE);
+        while (claim != SHM_READY) {
+            if (claim != 0) {
+                /* another client is filling it in, or died doing so */
+                sched_yield();
+                claim = __atomic_load_n(&s->claim, __ATOMIC_ACQUIRE);
+                continue;
+            }
+
+            if (!create) {
+                errno = ENOENT;
+                return NULL;
+            }
+
+            if (__atomic_compare_exchange_n(&s->claim, &claim, (uint32_t)h->id + 1, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                s->hv = hv;
+                s->nkey = (uint16_t)nkey;
+                memcpy(s->key, key, nkey);
+                __atomic_store_n(&s->claim, SHM_READY, __ATOMIC_RELEASE);
+                return s;
+            }
+        }
+
+        if (s->hv == hv && s->nkey == nkey && memcmp(s->key, key, nkey) == 0) {
+            return s;
+        }
+    }
+
+    errno = ENOSPC;
+
+    return NULL;
+}
+
+static int shmlock_acquire(struct shmlock *h, const char *key, size_t nkey,
+        int flags, int wait)
+{
+    uint32_t seq = 0;
+    uint64_t old = 0, busy = 0, hold = 0;
+    struct shm_slot *s = NULL;
+
+    s = slot_find(h, key, nkey, 1);
+    if (s == NULL) {
+        return -1;
+    }
+
+    if (flags & MEMLOCK_WRITE) {
+        hold = (uint64_t)(h->id + 1) << SHM_WSHIFT;
+        busy = SHM_READERS | SHM_WRITER;
+    }
+    else {
+        hold = 1ULL << h->id;
+        busy = SHM_WRITER;
+    }
+
+    old = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+    for (;;) {
+        if ((old & SHM_WRITER) == ((uint64_t)(h->id + 1) << SHM_WSHIFT)
+                || (old & (1ULL << h->id))) {
+            /* one hold per key and client */
+            errno = EDEADLK;
+            return -1;
+        }
+
+        if ((old & busy) == 0) {
+            if (__atomic_compare_exchange_n(&s->state, &old, old | hold, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return 0;
+            }
+            continue;
+        }
+
+        if (!wait) {
+            return 1;
+        }
+
+        /*
+         * read seq before announcing ourselves: a release after that
+         * changes state, failing the CAS, or bumps seq, failing the wait
+         */
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (!__atomic_compare_exchange_n(&s->state, &old, old | SHM_WAITERS, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        futex_wait(&s->seq, seq);
+        old = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+    }
+
+    return -1;
+}
+
+/* map the segment at path and take a client id in it */
+struct shmlock *shmlock_attach(const char *path)
+{
+    int i = 0, fd = -1;
+    int32_t pid = 0;
+    struct stat st;
+    struct shmlock *h = NULL;
+    struct shm_hdr *hdr = NULL;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < SHM_SLOTS_OFF) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hdr = (struct shm_hdr *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (memcmp(hdr->magic, SHM_MAGIC, 8) != 0 || (size_t)st.st_size < SHM_SIZE(hdr->nslots)) {
+        munmap(hdr, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    h = (struct shmlock *)calloc(1, sizeof(struct shmlock));
+    if (h == NULL) {
+        munmap(hdr, st.st_size);
+        return NULL;
+    }
+
+    h->hdr = hdr;
+    h->slots = SLOT_AT(hdr, 0);
+    h->size = st.st_size;
+    h->id = -1;
+
+    for (i = 0; i < SHM_CLIENTS; i++) {
+        pid = 0;
+        if (__atomic_compare_exchange_n(&hdr->clients[i].pid, &pid, (int32_t)getpid(), 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            h->id = i;
+            break;
+        }
+    }
+
+    if (h->id < 0) {
+        munmap(hdr, st.st_size);
+        free(h);
+        errno = EBUSY;
+        return NULL;
+    }
+
+    return h;
+}
+
+/* release whatever h holds and give its client id back */
+void shmlock_detach(struct shmlock *h)
+{
+    if (h == NULL) {
+        return;
+    }
+
+    shmlock_release_client(h->hdr, h->id);
+    __atomic_store_n(&h->hdr->clients[h->id].pid, 0, __ATOMIC_RELEASE);
+
+    munmap(h->hdr, h->size);
+    free(h);
+
+    return;
+}
+
+/*
+ * lock key, waiting for it as long as it takes.
+ * returns 0, or -1 with errno set: ENAMETOOLONG for a key over
+ * SHM_KEY_MAX bytes, ENOSPC with every slot taken, EDEADLK if h holds
+ * key already.
+ */
+int shmlock_lock(struct shmlock *h, const char *key, size_t nkey, int flags)
+{
+    return shmlock_acquire(h, key, nkey, flags, 1);
+}
+
+/* as shmlock_lock(), but returns 1 where it would wait */
+int shmlock_trylock(struct shmlock *h, const char *key, size_t nkey, int flags)
+{
+    return shmlock_acquire(h, key, nkey, flags, 0);
+}
+
+/* returns 0, or -1 if h does not hold key */
+int shmlock_unlock(struct shmlock *h, const char *key, size_t nkey)
+{
+    uint64_t state = 0, writer = 0;
+    struct shm_slot *s = NULL;
+
+    s = slot_find(h, key, nkey, 0);
+    if (s == NULL) {
+        return -1;
+    }
+
+    state = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+    writer = (uint64_t)(h->id + 1) << SHM_WSHIFT;
+
+    if ((state & SHM_WRITER) == writer) {
+        return slot_release(s, writer);
+    }
+
+    return slot_release(s, 1ULL << h->id);
+}
+
+/*
+ * map the segment at path if it is one: a daemon restarting, -H or not,
+ * goes on with the clients still locking in it. NULL with errno ENOENT
+ * if there is none, EINVAL if the file is something else.
+ */
+static struct shm_hdr *shmlock_reopen(const char *path)
+{
+    int fd = -1;
+    unsigned int n = 0;
+    struct stat st;
+    struct shm_hdr *hdr = NULL;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < SHM_SLOTS_OFF) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hdr = (struct shm_hdr *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        return NULL;
+    }
+
+    n = hdr->nslots;
+    if (memcmp(hdr->magic, SHM_MAGIC, 8) != 0 || n == 0 || (n & (n - 1)) != 0
+            || (size_t)st.st_size != SHM_SIZE(n)) {
+        munmap(hdr, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return hdr;
+}
+
+/*
+ * open the segment at path, or create it with nslots rounded up to a
+ * power of two if there is none. an existing segment keeps its size and
+ * its holds, the caller reaps those of clients that are gone. anything
+ * else at path is replaced: no client attaches to it.
+ */
+struct shm_hdr *shmlock_create(const char *path, unsigned int nslots, int mode)
+{
+    int fd = -1;
+    unsigned int n = 1;
+    struct shm_hdr *hdr = NULL;
+
+    hdr = shmlock_reopen(path);
+    if (hdr != NULL) {
+        return hdr;
+    }
+
+    if (errno != ENOENT && errno != EINVAL) {
+        return NULL;
+    }
+
+    while (n < nslots) {
+        n <<= 1;
+    }
+
+    unlink(path);
+
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, mode);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    /* open() applies the umask, the mode is meant as given */
+    if (fchmod(fd, mode) != 0 || ftruncate(fd, SHM_SIZE(n)) != 0) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    hdr = (struct shm_hdr *)mmap(NULL, SHM_SIZE(n), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        unlink(path);
+        return NULL;
+    }
+
+    hdr->nslots = n;
+    memcpy(hdr->magic, SHM_MAGIC, 8);
+
+    return hdr;
+}
+
+/*
+ * drop every hold of client id, and any slot it was filling in. the
+ * client must be gone or be the caller. returns the holds dropped.
+ */
+int shmlock_release_client(struct shm_hdr *hdr, int id)
+{
+    int n = 0;
+    unsigned int i = 0;
+    uint32_t claim = (uint32_t)id + 1;
+    uint64_t state = 0, writer = (uint64_t)(id + 1) << SHM_WSHIFT;
+    struct shm_slot *s = NULL;
+
+    for (i = 0; i < hdr->nslots; i++) {
+        s = SLOT_AT(hdr, i);
+
+        if (__atomic_compare_exchange_n(&s->claim, &claim, 0, 0,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        claim = (uint32_t)id + 1;
+
+        state = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+        if ((state & SHM_WRITER) == writer && slot_release(s, writer) == 0) {
+            n++;
+        }
+        else if ((state & (1ULL << id)) && slot_release(s, 1ULL << id) == 0) {
+            n++;
+        }
+    }
+
+    return n;
+}
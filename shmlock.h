@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _SHMLOCK_H_
+#define _SHMLOCK_H_
+
+#include <stdint.h>
+
+#define SHM_MAGIC    "MLSHM001"
+#define SHM_CLIENTS  56        /* one reader bit each in shm_slot.state */
+#define SHM_KEY_MAX  40
+#define SHM_SEED     0         /* em_hash() seed, the same in every process */
+#define SHM_READY    0xffffffffu
+
+/* shm_slot.state */
+#define SHM_READERS  ((1ULL << SHM_CLIENTS) - 1)
+#define SHM_WSHIFT   56
+#define SHM_WRITER   (0x7fULL << SHM_WSHIFT)   /* writer's client id + 1 */
+#define SHM_WAITERS  (1ULL << 63)
+
+/*
+ * The segment: shm_hdr, then nslots shm_slot from SHM_SLOTS_OFF on. A
+ * slot belongs to its key from first use for as long as the segment
+ * lives, keys are found by linear probing from hv.
+ */
+struct shm_client {
+    int32_t  pid;      /* 0 for a free entry */
+    uint32_t pad;
+};
+
+struct shm_hdr {
+    char     magic[8];
+    uint32_t nslots;   /* a power of two */
+    uint32_t pad;
+    struct shm_client clients[SHM_CLIENTS];
+};
+
+struct shm_slot {
+    uint64_t state;    /* reader bits, writer, waiters */
+    uint32_t seq;      /* futex word, bumped by a release with waiters */
+    uint32_t claim;    /* 0 free, client id + 1 filling it in, SHM_READY */
+    uint32_t hv;
+    uint16_t nkey;
+    uint16_t pad;
+    char     key[SHM_KEY_MAX];
+};
+
+#define SHM_SLOTS_OFF ((sizeof(struct shm_hdr) + 63) & ~(size_t)63)
+#define SHM_SIZE(n)   (SHM_SLOTS_OFF + (size_t)(n) * sizeof(struct shm_slot))
+
+struct shm_hdr *shmlock_create(const char *path, unsigned int nslots, int mode);
+
+int shmlock_release_client(struct shm_hdr *hdr, int id);
+
+#endif
@@ -0,0 +1,281 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Client side of the shared memory transport, see ring.c.
+ *
+ * shmring_connect() asks for the rings on the unix socket and keeps the
+ * socket open: the daemon takes it closing for the client going away.
+ * Requests are copied into the request ring, the daemon's eventfd is
+ * only written when it sleeps, so a client sending faster than the
+ * daemon answers queues its commands up without syscalls.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shmring.h"
+#include "memlock.h"
+
+#define SHMRING_LINE_MAX 4096
+
+struct shmring {
+    int    sfd;
+    int    efd;         /* the daemon's */
+    int    client_efd;  /* ours */
+    struct ring_hdr *hdr;
+    int    nin;         /* bytes of an unfinished reply line in in */
+    char   in[SHMRING_LINE_MAX];
+};
+
+static int shmring_recv_fds(int sfd, char *reply, size_t size, int *fds, int n)
+{
+    ssize_t len = 0;
+    char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm = NULL;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = reply;
+    iov.iov_len = size - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    len = recvmsg(sfd, &msg, MSG_CMSG_CLOEXEC);
+    if (len <= 0) {
+        return -1;
+    }
+    reply[len] = '\0';
+
+    cm = CMSG_FIRSTHDR(&msg);
+    if (cm == NULL || cm->cmsg_type != SCM_RIGHTS
+            || cm->cmsg_len != CMSG_LEN(sizeof(int) * n)) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(int) * n);
+
+    return 0;
+}
+
+/* sleep until the daemon wakes us, -1 if it hung up */
+static int shmring_wait(struct shmring *r)
+{
+    uint64_t n = 0;
+    struct pollfd pfd[2];
+
+    pfd[0].fd = r->client_efd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = r->sfd;
+    pfd[1].events = POLLIN;
+
+    while (poll(pfd, 2, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    if (pfd[1].revents) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    if (read(r->client_efd, &n, sizeof(n)) != sizeof(n)) {
+        /* raced with another reset, nothing lost */
+    }
+
+    return 0;
+}
+
+/* connect to the daemon's unix socket at path and switch to rings */
+struct shmring *shmring_connect(const char *path)
+{
+    int fds[3] = {-1, -1, -1};
+    char reply[64];
+    void *region = MAP_FAILED;
+    struct sockaddr_un addr;
+    struct shmring *r = NULL;
+
+    r = (struct shmring *)calloc(1, sizeof(struct shmring));
+    if (r == NULL) {
+        return NULL;
+    }
+
+    r->sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (r->sfd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (connect(r->sfd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || write(r->sfd, "ring\r\n", 6) != 6
+            || shmring_recv_fds(r->sfd, reply, sizeof(reply), fds, 3) != 0) {
+        goto fail;
+    }
+
+    if (strncmp(reply, "+OK, ring", 9) != 0) {
+        errno = EPROTO;
+        goto fail;
+    }
+
+    region = mmap(NULL, RING_REGION, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    fds[0] = -1;
+    if (region == MAP_FAILED) {
+        goto fail;
+    }
+
+    r->hdr = (struct ring_hdr *)region;
+    if (memcmp(r->hdr->magic, RING_MAGIC, 8) != 0 || r->hdr->size != RING_SIZE) {
+        munmap(region, RING_REGION);
+        errno = EPROTO;
+        goto fail;
+    }
+
+    r->efd = fds[1];
+    r->client_efd = fds[2];
+
+    return r;
+
+fail:
+    if (fds[0] >= 0) {
+        close(fds[0]);
+    }
+    if (fds[1] >= 0) {
+        close(fds[1]);
+    }
+    if (fds[2] >= 0) {
+        close(fds[2]);
+    }
+    close(r->sfd);
+    free(r);
+
+    return NULL;
+}
+
+void shmring_close(struct shmring *r)
+{
+    if (r == NULL) {
+        return;
+    }
+
+    close(r->sfd);
+    close(r->efd);
+    close(r->client_efd);
+    munmap(r->hdr, RING_REGION);
+    free(r);
+
+    return;
+}
+
+/*
+ * queue len bytes of commands, waiting for room if need be. their replies
+ * come back in order through shmring_recv(). as on a socket, replies
+ * have to be read before queuing more than the two rings hold. returns
+ * 0, or -1 once the daemon is gone or the rings are garbage.
+ */
+int shmring_send(struct shmring *r, const char *buf, size_t len)
+{
+    uint32_t n = 0;
+    struct ring_hdr *h = r->hdr;
+
+    while (len > 0) {
+        n = ring_put(&h->req, RING_REQ(h), buf, len > RING_SIZE ? RING_SIZE : len);
+        if (n == 0) {
+            ring_sleep(&h->req.full);
+            n = ring_put(&h->req, RING_REQ(h), buf, len > RING_SIZE ? RING_SIZE : len);
+            if (n == 0) {
+                if (shmring_wait(r) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            __atomic_store_n(&h->req.full, 0, __ATOMIC_RELAXED);
+        }
+
+        if (n == RING_BROKEN) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        ring_wake(&h->req.waiting, r->efd);
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * the next reply line, without its "\r\n", into line. waits for it.
+ * returns its length, or -1 once the daemon is gone or the rings are garbage.
+ */
+int shmring_recv(struct shmring *r, char *line, size_t size)
+{
+    int len = 0;
+    uint32_t n = 0;
+    char *el = NULL;
+    struct ring_hdr *h = r->hdr;
+
+    while ((el = memchr(r->in, '\n', r->nin)) == NULL) {
+        if (r->nin == SHMRING_LINE_MAX) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        n = ring_get(&h->resp, RING_RESP(h), r->in + r->nin, SHMRING_LINE_MAX - r->nin);
+        if (n == 0) {
+            ring_sleep(&h->resp.waiting);
+            n = ring_get(&h->resp, RING_RESP(h), r->in + r->nin, SHMRING_LINE_MAX - r->nin);
+            if (n == 0) {
+                if (shmring_wait(r) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            __atomic_store_n(&h->resp.waiting, 0, __ATOMIC_RELAXED);
+        }
+
+        if (n == RING_BROKEN) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        ring_wake(&h->resp.full, r->efd);
+        r->nin += n;
+    }
+
+    len = el - r->in;
+    if (len > 0 && r->in[len - 1] == '\r') {
+        len--;
+    }
+    if ((size_t)len >= size) {
+        len = size - 1;
+    }
+    memcpy(line, r->in, len);
+    line[len] = '\0';
+
+    r->nin -= el + 1 - r->in;
+    memmove(r->in, el + 1, r->nin);
+
+    return len;
+}
@@ -0,0 +1,139 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _SHMRING_H_
+#define _SHMRING_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RING_MAGIC "MLRING01"
+#define RING_SIZE  65536   /* bytes each way, a power of two */
+
+/*
+ * One direction of a connection: a single producer, single consumer byte
+ * ring. head and tail run free and are masked on use. A side that finds
+ * nothing to do sets its flag and sleeps on its eventfd; the other side
+ * clears the flag and writes the eventfd when it has made progress, so
+ * neither pays a syscall while the other is awake.
+ */
+struct ring_half {
+    uint32_t head;     /* consumer position */
+    uint32_t waiting;  /* consumer asleep until there is data */
+    char     pad1[56];
+    uint32_t tail;     /* producer position */
+    uint32_t full;     /* producer asleep until there is space */
+    char     pad2[56];
+};
+
+/* the region: ring_hdr, then RING_SIZE bytes of requests and of replies */
+struct ring_hdr {
+    char     magic[8];
+    uint32_t size;
+    char     pad[52];
+    struct ring_half req;   /* client to daemon */
+    struct ring_half resp;  /* daemon to client */
+};
+
+/*
+ * ring_put() and ring_get() on a ring whose positions are more than
+ * RING_SIZE apart: the other side wrote garbage to them.
+ */
+#define RING_BROKEN    0xffffffffu
+
+#define RING_REGION    (sizeof(struct ring_hdr) + 2 * RING_SIZE)
+#define RING_REQ(hdr)  ((char *)(hdr) + sizeof(struct ring_hdr))
+#define RING_RESP(hdr) (RING_REQ(hdr) + RING_SIZE)
+
+/* copy up to len bytes in, returns how many fit or RING_BROKEN */
+static inline uint32_t ring_put(struct ring_half *h, char *data, const char *buf, uint32_t len)
+{
+    uint32_t tail = h->tail, off = 0, n = 0;
+
+    n = tail - __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    if (n > RING_SIZE) {
+        return RING_BROKEN;
+    }
+
+    n = RING_SIZE - n;
+    if (len < n) {
+        n = len;
+    }
+
+    off = tail & (RING_SIZE - 1);
+    if (off + n > RING_SIZE) {
+        memcpy(data + off, buf, RING_SIZE - off);
+        memcpy(data, buf + RING_SIZE - off, n - (RING_SIZE - off));
+    }
+    else {
+        memcpy(data + off, buf, n);
+    }
+
+    __atomic_store_n(&h->tail, tail + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/* copy up to size bytes out, returns how many there were or RING_BROKEN */
+static inline uint32_t ring_get(struct ring_half *h, const char *data, char *buf, uint32_t size)
+{
+    uint32_t head = h->head, off = 0, n = 0;
+
+    n = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE) - head;
+    if (n > RING_SIZE) {
+        return RING_BROKEN;
+    }
+
+    if (size < n) {
+        n = size;
+    }
+
+    off = head & (RING_SIZE - 1);
+    if (off + n > RING_SIZE) {
+        memcpy(buf, data + off, RING_SIZE - off);
+        memcpy(buf + RING_SIZE - off, data, n - (RING_SIZE - off));
+    }
+    else {
+        memcpy(buf, data + off, n);
+    }
+
+    __atomic_store_n(&h->head, head + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/* we made progress: wake the other side if it sleeps on flag */
+static inline void ring_wake(uint32_t *flag, int efd)
+{
+    uint64_t one = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(flag, __ATOMIC_RELAXED)
+            && __atomic_exchange_n(flag, 0, __ATOMIC_SEQ_CST)) {
+        if (write(efd, &one, sizeof(one)) != sizeof(one)) {
+            /* the counter is already non zero, it is awake anyway */
+        }
+    }
+
+    return;
+}
+
+/*
+ * about to sleep on flag: announce it, then look again with the fence
+ * in between, so the other side either sees the flag or we see its work.
+ */
+static inline void ring_sleep(uint32_t *flag)
+{
+    __atomic_store_n(flag, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return;
+}
+
+#endif
@@ -0,0 +1,422 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * Point-in-time snapshots of the lock table.
+ *
+ * The event loop forks, the child sees the table frozen at the fork by
+ * copy-on-write and writes it through a shared mapping to path.tmp, then
+ * renames it over path. The loop goes on serving locks meanwhile and
+ * reaps the child on its next tick.
+ *
+ * At startup the file is mapped and the items recreated in one pass, then
+ * the journal written since the snapshot is replayed over them. The
+ * owners of restored locks are gone, so the holds are kept for
+ * settings.snapshot_grace seconds and then released to the waiters.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "hash.h"
+#include "common.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "hotrestart.h"
+
+#define SNAP_TICK 1  /* seconds between child reaping and due checks */
+
+static struct event snap_ev;
+static pid_t snap_child = 0;
+static uint64_t snap_lsn = 0;        /* journal lsn the running child covers */
+static unsigned int snap_seg = 0;    /* first journal segment it does not */
+static uint64_t snap_started = 0;
+static time_t snap_due = 0;
+static time_t orphan_deadline = 0;
+static char snap_tmp[PATH_MAX];
+
+struct snap_walk {
+    char     *p;
+    size_t   size;
+    unsigned int count;
+};
+
+static void snapshot_size_fn(struct item *it, void *arg)
+{
+    struct snap_walk *w = (struct snap_walk *)arg;
+
+    if (it->ref > 0) {
+        w->size += SNAP_REC_SIZE(it->k.nkey);
+        w->count++;
+    }
+
+    return;
+}
+
+/* bytes needed for a snapshot of the table as it is now */
+size_t snapshot_size(unsigned int *count)
+{
+    struct snap_walk w = {NULL, sizeof(struct snap_hdr), 0};
+
+    hashlist_walk(snapshot_size_fn, &w);
+
+    *count = w.count;
+
+    return w.size;
+}
+
+static void snapshot_fill_fn(struct item *it, void *arg)
+{
+    struct snap_walk *w = (struct snap_walk *)arg;
+    struct snap_rec *r = (struct snap_rec *)w->p;
+
+    if (it->ref <= 0) {
+        return;
+    }
+
+    r->nkey = it->k.nkey;
+    r->val = it->val;
+    r->ref = it->ref;
+    r->pad = 0;
+    r->exp = it->exp;
+    r->gen = it->gen;
+    memcpy(w->p + sizeof(struct snap_rec), it->k.key, it->k.nkey);
+
+    w->p += SNAP_REC_SIZE(it->k.nkey);
+
+    return;
+}
+
+/* buf is snapshot_size() bytes, zeroed */
+void snapshot_fill(char *buf, size_t size, unsigned int count, uint64_t lsn)
+{
+    struct snap_hdr *h = (struct snap_hdr *)buf;
+    struct snap_walk w = {buf + sizeof(struct snap_hdr), size, count};
+
+    hashlist_walk(snapshot_fill_fn, &w);
+
+    memcpy(h->magic, SNAP_MAGIC, sizeof(h->magic));
+    h->version = SNAP_VERSION;
+    h->count = count;
+    h->size = size;
+    h->fence = g_fence;
+    h->lsn = lsn;
+    h->created = time(NULL);
+    h->sum = em_hash_wyhash(buf + sizeof(struct snap_hdr),
+            (int)(size - sizeof(struct snap_hdr)), 0);
+
+    return;
+}
+
+/*
+ * recreate the items of a snapshot image, held by nobody until
+ * hashlist_release_orphans(notify_block_conns). returns the number of items or -1.
+ */
+long snapshot_restore(const char *buf, size_t size, uint64_t *lsn)
+{
+    unsigned int i = 0;
+    const char *p = NULL, *end = buf + size;
+    const struct snap_hdr *h = (const struct snap_hdr *)buf;
+    const struct snap_rec *r = NULL;
+    struct item_key ik;
+
+    if (size < sizeof(struct snap_hdr)
+            || memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0
+            || h->version != SNAP_VERSION || h->size != size) {
+        return -1;
+    }
+
+    if (h->sum != em_hash_wyhash(buf + sizeof(struct snap_hdr),
+                (int)(size - sizeof(struct snap_hdr)), 0)) {
+        return -1;
+    }
+
+    hashlist_reserve(hashlist_count() + h->count);
+
+    p = buf + sizeof(struct snap_hdr);
+    for (i = 0; i < h->count; i++) {
+        r = (const struct snap_rec *)p;
+        if (p + sizeof(struct snap_rec) > end
+                || p + SNAP_REC_SIZE(r->nkey) > end || r->ref <= 0) {
+            return -1;
+        }
+
+        item_key_init(&ik, p + sizeof(struct snap_rec), r->nkey);
+        if (hashlist_findlock(&ik) == NULL
+                && hashlist_restore(&ik, r->val, r->ref, r->exp, r->gen) == NULL) {
+            return -1;
+        }
+
+        p += SNAP_REC_SIZE(r->nkey);
+    }
+
+    if (h->fence > g_fence) {
+        g_fence = h->fence;
+    }
+
+    if (lsn != NULL) {
+        *lsn = h->lsn;
+    }
+
+    return h->count;
+}
+
+/* returns the number of items restored, 0 without a file, -1 on error */
+long snapshot_load(const char *path, uint64_t *lsn)
+{
+    int fd = -1;
+    long n = 0;
+    char *p = NULL;
+    struct stat st;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct snap_hdr)) {
+        close(fd);
+        return -1;
+    }
+
+    p = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+
+    n = snapshot_restore(p, st.st_size, lsn);
+
+    munmap(p, st.st_size);
+
+    return n;
+}
+
+static void snapshot_close_fds(int keep)
+{
+    int fd = 0, max = (int)sysconf(_SC_OPEN_MAX);
+
+#ifdef SYS_close_range
+    if (keep > 3) {
+        syscall(SYS_close_range, 3, keep - 1, 0);
+    }
+    if (syscall(SYS_close_range, keep + 1, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+
+    for (fd = 3; fd < max; fd++) {
+        if (fd != keep) {
+            close(fd);
+        }
+    }
+
+    return;
+}
+
+/*
+ * in the child: no malloc, no logging, the other threads did not come
+ * along. client sockets are closed first so that the parent's closes are
+ * seen by the clients right away.
+ */
+static void snapshot_child(void)
+{
+    int fd = -1;
+    size_t size = 0;
+    unsigned int count = 0;
+    char *p = NULL;
+
+    fd = open(snap_tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        _exit(1);
+    }
+
+    snapshot_close_fds(fd);
+
+    size = snapshot_size(&count);
+
+    if (ftruncate(fd, size) != 0) {
+        _exit(1);
+    }
+
+    p = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        _exit(1);
+    }
+
+    snapshot_fill(p, size, count, snap_lsn);
+
+    if (msync(p, size, MS_SYNC) != 0 || munmap(p, size) != 0
+            || fsync(fd) != 0 || close(fd) != 0) {
+        _exit(1);
+    }
+
+    if (rename(snap_tmp, settings.snapshot_file) != 0) {
+        _exit(1);
+    }
+
+    _exit(0);
+}
+
+/* 0 if a snapshot child was started, -1 if one is running or fork failed */
+int snapshot_start(void)
+{
+    pid_t pid = 0;
+
+    if (settings.snapshot_file == NULL || snap_child > 0) {
+        return -1;
+    }
+
+    /* what the child sees is the journal up to here */
+    snap_lsn = journal_rotate(&snap_seg);
+
+    pid = fork();
+    if (pid < 0) {
+        log_printf(LOGL_ERROR, "snapshot fork(): %s\n", strerror(errno));
+        stats.snapshot_fails++;
+        return -1;
+    }
+
+    if (pid == 0) {
+        snapshot_child();
+    }
+
+    snap_child = pid;
+    snap_started = current_usec();
+
+    return 0;
+}
+
+static void snapshot_reap(void)
+{
+    int status = 0;
+    pid_t pid = 0;
+
+    if (snap_child <= 0) {
+        return;
+    }
+
+    pid = waitpid(snap_child, &status, WNOHANG);
+    if (pid == 0 || (pid < 0 && errno == EINTR)) {
+        return;
+    }
+
+    snap_child = 0;
+    stats.snapshot_usec = current_usec() - snap_started;
+
+    if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        stats.snapshots++;
+        stats.snapshot_last = time(NULL);
+        journal_compact(snap_seg);
+        log_printf(LOGL_VERBOSE, "snapshot written to %s in %llu usec\n",
+                settings.snapshot_file, stats.snapshot_usec);
+    }
+    else {
+        stats.snapshot_fails++;
+        unlink(snap_tmp);
+        log_printf(LOGL_ERROR, "snapshot to %s failed\n", settings.snapshot_file);
+    }
+
+    return;
+}
+
+static void snapshot_tick(const int fd, const short which, void *arg)
+{
+    time_t now = time(NULL);
+    struct timeval tv = {SNAP_TICK, 0};
+
+    snapshot_reap();
+
+    if (orphan_deadline != 0 && now >= orphan_deadline) {
+        orphan_deadline = 0;
+        log_printf(LOGL_VERBOSE, "released %u restored locks\n", hashlist_release_orphans(notify_block_conns));
+    }
+
+    if (settings.snapshot_file != NULL && settings.snapshot_interval > 0
+            && now >= snap_due && snap_child == 0) {
+        snapshot_start();
+        snap_due = now + settings.snapshot_interval;
+    }
+
+    evtimer_add(&snap_ev, &tv);
+
+    return;
+}
+
+/*
+ * the holds in the table belong to nobody, after a restart or when a
+ * standby is promoted. keep them settings.snapshot_grace seconds.
+ */
+void snapshot_adopt(void)
+{
+    if (hashlist_adopt_orphans() > 0) {
+        orphan_deadline = time(NULL) + settings.snapshot_grace;
+    }
+
+    return;
+}
+
+/*
+ * load settings.snapshot_file if there is one, replay the journal over
+ * it and start the timer.
+ */
+int snapshot_init(struct event_base *base)
+{
+    int  taken = 0;
+    long n = 0;
+    uint64_t lsn = 0;
+    uint64_t start = current_usec();
+
+    /* a hot restart brought the table along */
+    taken = hotrestart_taken(&lsn);
+
+    if (settings.snapshot_file != NULL) {
+        snprintf(snap_tmp, sizeof(snap_tmp), "%s.tmp", settings.snapshot_file);
+
+        n = taken ? 0 : snapshot_load(settings.snapshot_file, &lsn);
+        if (n < 0) {
+            fprintf(stderr, "failed to load snapshot %s\n", settings.snapshot_file);
+            return -1;
+        }
+
+        if (n > 0) {
+            log_printf(LOGL_VERBOSE, "restored %ld locks from %s in %llu usec\n", n,
+                    settings.snapshot_file, (unsigned long long)(current_usec() - start));
+        }
+
+        snap_due = time(NULL) + settings.snapshot_interval;
+    }
+
+    /* standbys are fed the journal records even when there is no file */
+    if (settings.journal_file != NULL || settings.repl_port > 0
+            || settings.repl_primary != NULL) {
+        if (journal_open(settings.journal_file, lsn, base) != 0) {
+            return -1;
+        }
+    }
+
+    if (!taken) {
+        snapshot_adopt();
+    }
+
+    evtimer_set(&snap_ev, snapshot_tick, NULL);
+    event_base_set(base, &snap_ev);
+    snapshot_tick(-1, 0, NULL);
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+
+#define SNAP_MAGIC "MLSNAP01"
+#define SNAP_VERSION 1
+
+/*
+ * file layout: snap_hdr, then count records, each a snap_rec followed by
+ * its key and padding to 8 bytes. sum is em_hash_wyhash() of everything
+ * after the header.
+ */
+struct snap_hdr {
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t size;     /* whole file */
+    uint64_t fence;    /* g_fence when taken */
+    uint64_t lsn;      /* last journal record included, 0 without journal */
+    int64_t  created;
+    uint32_t sum;
+    uint32_t pad;
+    uint64_t reserved;
+};
+
+struct snap_rec {
+    uint32_t nkey;
+    int32_t  val;
+    int32_t  ref;
+    uint32_t pad;
+    int64_t  exp;
+    uint64_t gen;
+};
+
+#define SNAP_REC_SIZE(nkey) ((sizeof(struct snap_rec) + (nkey) + 7) & ~(size_t)7)
+
+size_t snapshot_size(unsigned int *count);
+
+void snapshot_fill(char *buf, size_t size, unsigned int count, uint64_t lsn);
+
+long snapshot_restore(const char *buf, size_t size, uint64_t *lsn);
+
+long snapshot_load(const char *path, uint64_t *lsn);
+
+int snapshot_start(void);
+
+void snapshot_adopt(void);
+
+int snapshot_init(struct event_base *base);
+
+#endif
@@ -33,7 +33,7 @@ static int socket_unix_new(void);
 int socket_init(const int port)
 {
     int sfd = -1;
-    int flags = 0;
+    int flags = 1;
     int error = 0;
     int success = 0;
 
@@ -101,7 +101,7 @@ int socket_init(const int port)
         }
 
         if ((listen_conn_add = conn_new(sfd, conn_listening, \
-                        EV_READ | EV_PERSIST, 1, main_base)) == NULL) {
+                        EV_READ | EV_PERSIST, main_base)) == NULL) {
             fprintf(stderr, "failed to create listening connection\n");
             exit(EXIT_FAILURE);
         }
@@ -172,7 +172,7 @@ int socket_unix_init(const char *path, int access_mask)
     }
 
     if (!(listen_conn_add = conn_new(sfd, conn_listening,
-                    EV_READ | EV_PERSIST, 1, main_base))) {
+                    EV_READ | EV_PERSIST, main_base))) {
         fprintf(stderr, "failed to create listening connection\n");
         exit(EXIT_FAILURE);
     }
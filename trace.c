@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "trace.h"
+
+/*
+ * writers claim a slot with one atomic add and never wait, the oldest
+ * records are overwritten. head counts every event ever recorded.
+ */
+static uint64_t trace_head = 0;
+static struct trace_rec trace_ring[TRACE_RING_SIZE];
+
+static uint64_t trace_clock(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_event(int event, uint32_t conn, int fd, uint32_t hv, int mode)
+{
+    uint64_t seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    struct trace_rec *r = &trace_ring[seq & (TRACE_RING_SIZE - 1)];
+
+    r->ts = trace_clock(CLOCK_MONOTONIC);
+    r->hv = hv;
+    r->conn = conn;
+    r->fd = fd;
+    r->event = (uint8_t)event;
+    r->mode = (uint8_t)mode;
+    r->pad = 0;
+
+    return;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t n = 0;
+    const char *p = (const char *)buf;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * writes the ring to path, oldest record first. called from the event
+ * loop, the only writer, so the ring does not move under us.
+ */
+long trace_dump(const char *path)
+{
+    int fd = -1;
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+    uint64_t first = (head - count) & (TRACE_RING_SIZE - 1);
+    uint64_t n1 = count < TRACE_RING_SIZE - first ? count : TRACE_RING_SIZE - first;
+    struct trace_hdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.recsize = sizeof(struct trace_rec);
+    hdr.count = count;
+    hdr.mono_ns = trace_clock(CLOCK_MONOTONIC);
+    hdr.real_ns = trace_clock(CLOCK_REALTIME);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (write_all(fd, &hdr, sizeof(hdr)) != 0
+            || write_all(fd, &trace_ring[first], n1 * sizeof(struct trace_rec)) != 0
+            || write_all(fd, &trace_ring[0], (count - n1) * sizeof(struct trace_rec)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return (long)count;
+}
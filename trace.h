@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Always-on ring of the last TRACE_RING_SIZE lock events, dumped with
+ * the "trace dump" command or SIGUSR1 and read back by trace_decode.
+ */
+#define TRACE_RING_SIZE (1 << 16)  /* power of two */
+
+#define TRACE_MAGIC "MLTRACE1"
+#define TRACE_VERSION 1
+
+enum trace_events {
+    TRACE_GRANT = 1,  /* lock granted on request */
+    TRACE_BLOCK,      /* lock request queued */
+    TRACE_HANDOFF,    /* queued request granted */
+    TRACE_UNLOCK,     /* lock released or wait abandoned */
+    TRACE_CLOSE,      /* conn closed holding or waiting for a lock */
+    TRACE_FAIL,       /* non-blocking lock request refused */
+};
+
+/* the dump file is a trace_hdr then count records, oldest first */
+struct trace_hdr {
+    char     magic[8];
+    uint32_t version;
+    uint32_t recsize;
+    uint64_t count;
+    uint64_t mono_ns;  /* CLOCK_MONOTONIC at dump time */
+    uint64_t real_ns;  /* CLOCK_REALTIME at dump time */
+};
+
+struct trace_rec {
+    uint64_t ts;     /* CLOCK_MONOTONIC nsec */
+    uint32_t hv;     /* key hash */
+    uint32_t conn;   /* conn id, unique for the process lifetime */
+    int32_t  fd;
+    uint8_t  event;
+    uint8_t  mode;   /* lock flags, EM_WRITE | EM_NONBLOCK */
+    uint16_t pad;
+};
+
+void trace_event(int event, uint32_t conn, int fd, uint32_t hv, int mode);
+
+long trace_dump(const char *path);
+
+#endif
@@ -0,0 +1,170 @@
+/**
+ * Copyright (c) 2012,
+ *     tonglulin@gmail.com All rights reserved.
+ *
+ * Use, modification and distribution are subject to the "New BSD License"
+ * as listed at <url: http://www.opensource.org/licenses/bsd-license.php >.
+ */
+
+/*
+ * trace_decode: print a memlockd trace dump as a timeline, one event per
+ * line, with how long each waiter waited and each holder held the lock.
+ *
+ * usage: trace_decode [-k key_hash] [-c conn_id] dump_file
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "item.h"
+#include "trace.h"
+
+/* last block and grant time per conn id, open addressed */
+#define SLOTS (1 << 16)
+
+struct slot {
+    uint32_t conn;
+    uint64_t block;
+    uint64_t grant;
+};
+
+static struct slot slots[SLOTS];
+
+static struct slot *slot_get(uint32_t conn)
+{
+    unsigned int i = (conn * 2654435761u) & (SLOTS - 1);
+
+    while (slots[i].conn != 0 && slots[i].conn != conn) {
+        i = (i + 1) & (SLOTS - 1);
+    }
+
+    if (slots[i].conn == 0) {
+        slots[i].conn = conn;
+    }
+
+    return &slots[i];
+}
+
+static const char *event_name(int event)
+{
+    switch (event) {
+        case TRACE_GRANT:   return "grant";
+        case TRACE_BLOCK:   return "block";
+        case TRACE_HANDOFF: return "handoff";
+        case TRACE_UNLOCK:  return "unlock";
+        case TRACE_CLOSE:   return "close";
+        case TRACE_FAIL:    return "fail";
+        default:            return "?";
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-k key_hash] [-c conn_id] dump_file\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int c = 0, haskey = 0;
+    uint32_t key = 0, conn = 0;
+    uint64_t i = 0, base = 0;
+    char when[64];
+    time_t secs = 0;
+    struct tm tm;
+    FILE *fp = NULL;
+    struct slot *s = NULL;
+    struct trace_hdr hdr;
+    struct trace_rec r;
+
+    while ((c = getopt(argc, argv, "k:c:")) != -1) {
+        switch (c) {
+            case 'k':
+                key = (uint32_t)strtoul(optarg, NULL, 0);
+                haskey = 1;
+                break;
+            case 'c':
+                conn = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    fp = fopen(argv[optind], "rb");
+    if (fp == NULL) {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+            || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0
+            || hdr.version != TRACE_VERSION
+            || hdr.recsize != sizeof(struct trace_rec)) {
+        fprintf(stderr, "%s: not a version %d memlockd trace\n", argv[optind], TRACE_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%llu events\n", (unsigned long long)hdr.count);
+    printf("%-26s %12s %8s %5s %-8s %-10s %s\n",
+            "time", "+usec", "conn", "fd", "event", "key_hash", "mode");
+
+    for (i = 0; i < hdr.count; i++) {
+        if (fread(&r, sizeof(r), 1, fp) != 1) {
+            fprintf(stderr, "truncated dump, %llu of %llu events\n",
+                    (unsigned long long)i, (unsigned long long)hdr.count);
+            break;
+        }
+
+        if (base == 0) {
+            base = r.ts;
+        }
+
+        s = slot_get(r.conn);
+        if (r.event == TRACE_BLOCK) {
+            s->block = r.ts;
+        }
+
+        if ((!haskey || r.hv == key) && (conn == 0 || r.conn == conn)) {
+            /* monotonic stamps to wall clock, through the dump time pair */
+            secs = (time_t)((hdr.real_ns - (hdr.mono_ns - r.ts)) / 1000000000);
+            localtime_r(&secs, &tm);
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+            printf("%s.%06llu %12.3f %8u %5d %-8s 0x%08x %-4s",
+                    when, (unsigned long long)((hdr.real_ns - (hdr.mono_ns - r.ts)) % 1000000000) / 1000,
+                    (r.ts - base) / 1000.0, r.conn, r.fd, event_name(r.event), r.hv,
+                    (r.mode & EM_WRITE) ? ((r.mode & EM_NONBLOCK) ? "wn" : "w")
+                                        : ((r.mode & EM_NONBLOCK) ? "rn" : "r"));
+
+            if (r.event == TRACE_HANDOFF && s->block != 0) {
+                printf(" waited %.3f ms", (r.ts - s->block) / 1e6);
+            }
+            else if (r.event == TRACE_UNLOCK && s->grant != 0) {
+                printf(" held %.3f ms", (r.ts - s->grant) / 1e6);
+            }
+            printf("\n");
+        }
+
+        if (r.event == TRACE_GRANT || r.event == TRACE_HANDOFF) {
+            s->grant = r.ts;
+            s->block = 0;
+        }
+        else if (r.event == TRACE_UNLOCK) {
+            s->grant = 0;
+            s->block = 0;
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}